@@ -0,0 +1,600 @@
+
+// throughput benchmarks over generated corpora. ./bench.sh builds and runs it.
+//   usage: bench [-t seconds per op] [-s scale] [corpus names or .json files...]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "json.h"
+
+
+
+///////////////////
+//    Corpora    //
+///////////////////
+
+struct gen {
+	char* buf;
+	size_t len, alloc;
+	uint64_t rng;
+};
+
+// xorshift64*, so every run sees the same documents
+static uint64_t rnd(struct gen* g) {
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static int rnd_n(struct gen* g, int n) {
+	return (int)(rnd(g) % (uint64_t)n);
+}
+
+static double rnd_d(struct gen* g, double lo, double hi) {
+	return lo + (hi - lo) * (double)(rnd(g) >> 11) / (double)(1ULL << 53);
+}
+
+static void put(struct gen* g, char* fmt, ...) {
+	va_list va;
+	int n;
+
+	for(;;) {
+		va_start(va, fmt);
+		n = vsnprintf(g->buf + g->len, g->alloc - g->len, fmt, va);
+		va_end(va);
+
+		if(n >= 0 && g->len + n < g->alloc) break;
+
+		g->alloc = g->alloc * 2 + n + 1;
+		g->buf = realloc(g->buf, g->alloc);
+		if(!g->buf) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+
+	g->len += n;
+}
+
+static char* words[] = {
+	"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "json", "parser",
+	"caf\xc3\xa9", "na\xc3\xafve", "\xe6\x97\xa5\xe6\x9c\xac", "\xf0\x9f\x98\x80", "data", "value",
+};
+
+// text with the odd escape and multi-byte character in it
+static void put_text(struct gen* g, int nwords) {
+	int i;
+
+	put(g, "\"");
+	for(i = 0; i < nwords; i++) {
+		if(i) put(g, " ");
+		put(g, "%s", words[rnd_n(g, 16)]);
+
+		switch(rnd_n(g, 24)) {
+			case 0: put(g, "\\n"); break;
+			case 1: put(g, "\\\"quoted\\\""); break;
+			case 2: put(g, "\\\\"); break;
+			case 3: put(g, "\\u00e9"); break;
+		}
+	}
+	put(g, "\"");
+}
+
+// canada.json: one polygon feature after another, almost all doubles
+static void gen_numeric(struct gen* g, int scale) {
+	int f, r, p, npoints;
+
+	put(g, "{\"type\":\"FeatureCollection\",\"features\":[");
+	for(f = 0; f < 40 * scale; f++) {
+		put(g, "%s{\"type\":\"Feature\",\"properties\":{\"name\":\"region %d\"},"
+			"\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[", f ? "," : "", f);
+
+		for(r = 0; r < 4; r++) {
+			put(g, "%s[", r ? "," : "");
+			npoints = 300 + rnd_n(g, 300);
+			for(p = 0; p < npoints; p++) {
+				put(g, "%s[%.15g,%.15g]", p ? "," : "", rnd_d(g, -141, -52), rnd_d(g, 41, 83));
+			}
+			put(g, "]");
+		}
+		put(g, "]}}");
+	}
+	put(g, "]}");
+}
+
+static void gen_strings(struct gen* g, int scale) {
+	int i;
+
+	put(g, "[");
+	for(i = 0; i < 20000 * scale; i++) {
+		if(i) put(g, ",");
+		put_text(g, 4 + rnd_n(g, 40));
+	}
+	put(g, "]");
+}
+
+// many short chains of alternating objects and arrays, 400 levels deep
+static void gen_nested(struct gen* g, int scale) {
+	int i, d, depth = 400;
+
+	put(g, "[");
+	for(i = 0; i < 100 * scale; i++) {
+		put(g, "%s", i ? "," : "");
+		for(d = 0; d < depth; d++) put(g, d & 1 ? "[%d," : "{\"k%d\":", d);
+		put(g, "null");
+		for(d = depth - 1; d >= 0; d--) put(g, d & 1 ? "]" : "}");
+	}
+	put(g, "]");
+}
+
+static void gen_wide(struct gen* g, int scale) {
+	int i;
+
+	put(g, "{");
+	for(i = 0; i < 200000 * scale; i++) {
+		put(g, "%s\"key_%d_%x\":%d", i ? "," : "", i, (unsigned)rnd(g), rnd_n(g, 1000000));
+	}
+	put(g, "}");
+}
+
+// twitter.json: statuses with a user, entities and a lot of small fields
+static void gen_twitter(struct gen* g, int scale) {
+	int i, j, n;
+
+	put(g, "{\"statuses\":[");
+	for(i = 0; i < 2000 * scale; i++) {
+		put(g, "%s{\"created_at\":\"Sun Aug 31 00:%02d:%02d +0000 2014\",\"id\":%llu,\"id_str\":\"%llu\",\"text\":",
+			i ? "," : "", rnd_n(g, 60), rnd_n(g, 60),
+			(unsigned long long)(505874924095815681ULL + i), (unsigned long long)(505874924095815681ULL + i));
+		put_text(g, 6 + rnd_n(g, 14));
+
+		put(g, ",\"truncated\":false,\"in_reply_to_status_id\":null,\"user\":{\"id\":%d,\"name\":\"user %d\","
+			"\"screen_name\":\"u%d\",\"location\":\"\",\"description\":", rnd_n(g, 1 << 30), i, i);
+		put_text(g, rnd_n(g, 20));
+		put(g, ",\"followers_count\":%d,\"friends_count\":%d,\"verified\":%s,\"lang\":\"ja\","
+			"\"profile_background_color\":\"C0DEED\",\"default_profile\":true},",
+			rnd_n(g, 100000), rnd_n(g, 5000), rnd_n(g, 10) ? "false" : "true");
+
+		put(g, "\"geo\":null,\"retweet_count\":%d,\"favorite_count\":%d,\"entities\":{\"hashtags\":[",
+			rnd_n(g, 500), rnd_n(g, 500));
+		n = rnd_n(g, 4);
+		for(j = 0; j < n; j++) put(g, "%s{\"text\":\"%s\",\"indices\":[%d,%d]}", j ? "," : "", words[rnd_n(g, 16)], j * 10, j * 10 + 8);
+		put(g, "],\"urls\":[],\"user_mentions\":[");
+		n = rnd_n(g, 3);
+		for(j = 0; j < n; j++) put(g, "%s{\"screen_name\":\"u%d\",\"id\":%d,\"indices\":[0,9]}", j ? "," : "", rnd_n(g, 1000), rnd_n(g, 1 << 30));
+		put(g, "]},\"favorited\":false,\"retweeted\":false,\"lang\":\"ja\"}");
+	}
+	put(g, "],\"search_metadata\":{\"completed_in\":0.087,\"max_id\":505874924095815681,\"count\":100}}");
+}
+
+// citm_catalog.json: objects keyed by numeric ids, small int arrays, repeated nulls
+static void gen_citm(struct gen* g, int scale) {
+	int i, j, n;
+
+	put(g, "{\"areaNames\":{");
+	for(i = 0; i < 200; i++) put(g, "%s\"%d\":\"area %d\"", i ? "," : "", 205705993 + i, i);
+
+	put(g, "},\"events\":{");
+	for(i = 0; i < 2000 * scale; i++) {
+		put(g, "%s\"%d\":{\"description\":null,\"id\":%d,\"logo\":%s,\"name\":\"event %d\",\"subTopicIds\":[",
+			i ? "," : "", 138586341 + i, 138586341 + i, rnd_n(g, 3) ? "null" : "\"/images/logo.jpg\"", i);
+		n = 1 + rnd_n(g, 4);
+		for(j = 0; j < n; j++) put(g, "%s%d", j ? "," : "", 337184262 + rnd_n(g, 100));
+		put(g, "],\"subjectCode\":null,\"subtitle\":null,\"topicIds\":[%d,%d]}", 324846099 + rnd_n(g, 10), 107888604);
+	}
+
+	put(g, "},\"performances\":[");
+	for(i = 0; i < 3000 * scale; i++) {
+		put(g, "%s{\"eventId\":%d,\"id\":%d,\"logo\":null,\"name\":null,\"prices\":[", i ? "," : "", 138586341 + rnd_n(g, 2000), 339887544 + i);
+		n = 2 + rnd_n(g, 4);
+		for(j = 0; j < n; j++) put(g, "%s{\"amount\":%d,\"audienceSubCategoryId\":337100890,\"seatCategoryId\":%d}", j ? "," : "", 10000 + rnd_n(g, 90000), 338937295 + j);
+		put(g, "],\"seatCategories\":[{\"areas\":[{\"areaId\":205705999,\"blockIds\":[]}],\"seatCategoryId\":338937295}],"
+			"\"seatMapImage\":null,\"start\":%lld,\"venueCode\":\"PLEYEL_PLEYEL\"}", 1372701600000LL + i * 86400000LL);
+	}
+	put(g, "]}");
+}
+
+struct corpus {
+	char* name;
+	void (*gen)(struct gen* g, int scale);
+};
+
+static struct corpus corpora[] = {
+	{"numeric", gen_numeric},
+	{"strings", gen_strings},
+	{"nested", gen_nested},
+	{"wide", gen_wide},
+	{"twitter", gen_twitter},
+	{"citm", gen_citm},
+};
+
+
+
+///////////////////
+//   Counting    //
+///////////////////
+
+// every library allocation gets a header with its size, so live bytes can be tracked
+struct counts {
+	size_t allocs, frees, live, peak;
+};
+
+static struct counts counts;
+
+static void* count_alloc(void* user, size_t size) {
+	size_t* p = malloc(size + 16);
+	(void)user;
+	if(!p) return NULL;
+
+	*p = size;
+	counts.allocs++;
+	counts.live += size;
+	if(counts.live > counts.peak) counts.peak = counts.live;
+
+	return (char*)p + 16;
+}
+
+static void* count_realloc(void* user, void* old, size_t size) {
+	size_t* p;
+
+	(void)user;
+	if(!old) return count_alloc(user, size);
+
+	p = (size_t*)((char*)old - 16);
+	counts.live -= *p;
+
+	p = realloc(p, size + 16);
+	if(!p) return NULL;
+
+	*p = size;
+	counts.allocs++;
+	counts.live += size;
+	if(counts.live > counts.peak) counts.peak = counts.live;
+
+	return (char*)p + 16;
+}
+
+static void count_free(void* user, void* old) {
+	size_t* p = (size_t*)((char*)old - 16);
+
+	(void)user;
+	counts.frees++;
+	counts.live -= *p;
+	free(p);
+}
+
+static struct json_allocator counting = {count_alloc, count_realloc, count_free, NULL};
+
+
+
+///////////////////
+//     Timing    //
+///////////////////
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+enum op {
+	OP_PARSE,
+	OP_STRINGIFY,
+	OP_LOOKUP,
+	OP_DEEP_COPY,
+	OP_FREE,
+	OP_MAX
+};
+
+static char* op_names[] = {"parse", "stringify", "obj_get_key", "deep_copy", "free"};
+
+struct lookup {
+	struct json_value* obj;
+	char* key;
+};
+
+struct bench {
+	char* src;
+	size_t len;
+
+	struct json_value* root;
+	struct json_string_buffer* sb;
+
+	struct lookup* keys;
+	size_t nkeys;
+};
+
+static void collect_keys(struct bench* b, struct json_value* v) {
+	struct json_link* l;
+	struct json_value* cv;
+	void* iter = NULL;
+	char* key;
+
+	if(v->type == JSON_TYPE_ARRAY) {
+		for(l = v->arr.head; l; l = l->next) collect_keys(b, l->v);
+	}
+	else if(v->type == JSON_TYPE_OBJ) {
+		while(json_obj_next(v, &iter, &key, &cv)) {
+			b->keys = realloc(b->keys, sizeof(*b->keys) * (b->nkeys + 1));
+			b->keys[b->nkeys].obj = v;
+			b->keys[b->nkeys].key = key;
+			b->nkeys++;
+
+			collect_keys(b, cv);
+		}
+	}
+}
+
+// one run of op. the lookups count as one document.
+static void run_op(struct bench* b, enum op op) {
+	struct json_write_context ctx = {0};
+	struct json_value* v;
+	struct json_file* jf;
+	size_t i;
+
+	switch(op) {
+		case OP_PARSE:
+			jf = json_parse_string(b->src, b->len);
+			if(!jf || jf->error) {
+				fprintf(stderr, "parse failed\n");
+				exit(1);
+			}
+			json_file_free(jf);
+			break;
+
+		case OP_STRINGIFY:
+			b->sb->length = 0;
+			ctx.sb = b->sb;
+			ctx.fmt.minify = 1;
+			json_stringify(&ctx, b->root);
+			break;
+
+		case OP_LOOKUP:
+			for(i = 0; i < b->nkeys; i++) {
+				if(json_obj_get_key(b->keys[i].obj, b->keys[i].key, &v)) {
+					fprintf(stderr, "lookup failed\n");
+					exit(1);
+				}
+			}
+			break;
+
+		case OP_DEEP_COPY:
+			json_free(json_deep_copy(b->root));
+			break;
+
+		default:
+			break;
+	}
+}
+
+// copy and free each need the other to repeat, so only their own half is timed
+static double time_copy_free(struct bench* b, enum op op, double min_time, long* runs) {
+	struct json_value* c;
+	double t0, total = 0;
+
+	for(*runs = 0; total < min_time || *runs < 3; (*runs)++) {
+		t0 = now();
+		c = json_deep_copy(b->root);
+		if(op == OP_DEEP_COPY) total += now() - t0;
+
+		t0 = now();
+		json_free(c);
+		if(op == OP_FREE) total += now() - t0;
+	}
+
+	return total;
+}
+
+static double time_op(struct bench* b, enum op op, double min_time, long* runs) {
+	double t0 = now(), t;
+
+	if(op == OP_DEEP_COPY || op == OP_FREE) return time_copy_free(b, op, min_time, runs);
+
+	for(*runs = 0; (t = now() - t0) < min_time || *runs < 3; (*runs)++) run_op(b, op);
+
+	return t;
+}
+
+// library allocations and frees made by one run, with the counting allocator in place.
+//   copy and free are counted apart, as they're timed.
+static struct counts count_op(struct bench* b, enum op op) {
+	struct json_string_buffer* sb = b->sb;
+	struct json_value* c = NULL;
+	struct counts before, n;
+
+	json_set_allocator(&counting);
+
+	if(op == OP_FREE) c = json_deep_copy(b->root);
+	if(op == OP_STRINGIFY) b->sb = json_string_buffer_create(4096);
+
+	before = counts;
+
+	switch(op) {
+		case OP_DEEP_COPY:
+			c = json_deep_copy(b->root);
+			break;
+
+		case OP_FREE:
+			json_free(c);
+			c = NULL;
+			break;
+
+		default:
+			run_op(b, op);
+			break;
+	}
+
+	n.allocs = counts.allocs - before.allocs;
+	n.frees = counts.frees - before.frees;
+
+	if(c) json_free(c);
+	if(op == OP_STRINGIFY) {
+		json_string_buffer_free(b->sb);
+		json_mem_free(b->sb);
+		b->sb = sb;
+	}
+
+	json_set_allocator(NULL);
+
+	return n;
+}
+
+// bytes held by the parsed tree
+static size_t tree_bytes(struct bench* b) {
+	struct json_file* jf;
+	size_t live;
+
+	json_set_allocator(&counting);
+	live = counts.live;
+
+	jf = json_parse_string(b->src, b->len);
+	live = counts.live - live;
+	json_file_free(jf);
+
+	json_set_allocator(NULL);
+
+	return live;
+}
+
+static void bench_source(char* name, char* src, size_t len, double min_time) {
+	struct bench b = {0};
+	struct json_file* jf;
+	struct counts n;
+	double t, mb;
+	long runs;
+	int op;
+
+	b.src = src;
+	b.len = len;
+	mb = len / (1024.0 * 1024.0);
+
+	jf = json_parse_string(src, len);
+	if(!jf || jf->error) {
+		fprintf(stderr, "%s: %s\n", name, jf ? jf->error_str : "parse failed");
+		if(jf) json_file_free(jf);
+		return;
+	}
+
+	b.root = jf->root;
+	b.sb = json_string_buffer_create(len + 1);
+	collect_keys(&b, b.root);
+
+	for(op = 0; op < OP_MAX; op++) {
+		if(op == OP_LOOKUP && !b.nkeys) continue;
+
+		t = time_op(&b, op, min_time, &runs);
+		n = count_op(&b, op);
+
+		if(op == OP_LOOKUP) {
+			printf("%-10s %-12s %10s %12.0f %12.1f %12zu %12zu\n", name, op_names[op], "-",
+				runs * b.nkeys / t, runs / t, n.allocs, n.frees);
+		}
+		else {
+			printf("%-10s %-12s %10.1f %12s %12.1f %12zu %12zu\n", name, op_names[op], runs * mb / t,
+				"-", runs / t, n.allocs, n.frees);
+		}
+	}
+
+	printf("%-10s %.2f MB source, %.2f MB tree, %zu keys, peak rss %.1f MB\n\n", name, mb,
+		tree_bytes(&b) / (1024.0 * 1024.0), b.nkeys, peak_rss_kb() / 1024.0);
+
+	free(b.keys);
+	json_string_buffer_free(b.sb);
+	json_mem_free(b.sb);
+	json_file_free(jf);
+}
+
+static char* read_file(char* path, size_t* len) {
+	FILE* f;
+	char* buf;
+	long sz;
+
+	f = fopen(path, "rb");
+	if(!f) return NULL;
+
+	fseek(f, 0, SEEK_END);
+	sz = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buf = malloc(sz + 1);
+	if(buf) {
+		*len = fread(buf, 1, sz, f);
+		buf[*len] = 0;
+	}
+
+	fclose(f);
+	return buf;
+}
+
+static int wanted(int argc, char** argv, int first, char* name) {
+	int i, any = 0;
+
+	for(i = first; i < argc; i++) {
+		if(strstr(argv[i], ".json")) continue;
+		any = 1;
+		if(!strcmp(argv[i], name)) return 1;
+	}
+
+	return !any;
+}
+
+int main(int argc, char* argv[]) {
+	double min_time = 0.5;
+	int scale = 1, first = 1, i;
+	struct gen g;
+	size_t len;
+	char* src;
+
+	for(; first < argc && argv[first][0] == '-'; first++) {
+		if(!strcmp(argv[first], "-t") && first + 1 < argc) min_time = atof(argv[++first]);
+		else if(!strcmp(argv[first], "-s") && first + 1 < argc) scale = atoi(argv[++first]);
+		else {
+			fprintf(stderr, "usage: %s [-t seconds per op] [-s scale] [corpus names or .json files...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("%-10s %-12s %10s %12s %12s %12s %12s\n", "corpus", "op", "MB/s", "lookups/s", "docs/s", "allocs/doc", "frees/doc");
+
+	for(i = 0; i < (int)(sizeof(corpora) / sizeof(corpora[0])); i++) {
+		if(!wanted(argc, argv, first, corpora[i].name)) continue;
+
+		memset(&g, 0, sizeof(g));
+		g.rng = 0x9e3779b97f4a7c15ULL;
+		corpora[i].gen(&g, scale);
+
+		bench_source(corpora[i].name, g.buf, g.len, min_time);
+		free(g.buf);
+	}
+
+	for(i = first; i < argc; i++) {
+		if(!strstr(argv[i], ".json")) continue;
+
+		src = read_file(argv[i], &len);
+		if(!src) {
+			fprintf(stderr, "can't read %s\n", argv[i]);
+			continue;
+		}
+
+		bench_source(argv[i], src, len, min_time);
+		free(src);
+	}
+
+	return 0;
+}
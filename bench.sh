@@ -0,0 +1,6 @@
+#!/bin/bash
+
+
+gcc -o bench bench.c json.c MurmurHash3.c -lm -pthread -O2 -std=c11 \
+	-Wno-implicit-function-declaration \
+	-fstrict-aliasing && ./bench $@
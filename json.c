@@ -8,12 +8,134 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <limits.h>
+#include <math.h>
+
+#ifdef _WIN32
+	#include <io.h>
+#else
+	#include <unistd.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#ifndef JSON_NO_THREADS
+	#include <pthread.h>
+#endif
+
+// iovec output copies shorter runs; an entry costs more than that
+#ifndef JSON_IOV_MIN_REF
+	#define JSON_IOV_MIN_REF 256
+#endif
+
+// json_stringify_parallel does smaller arrays serially
+#ifndef JSON_PARALLEL_MIN_ELEMS
+	#define JSON_PARALLEL_MIN_ELEMS 256
+#endif
+
+// nesting limit for json_cbor_decode, which recurses
+#ifndef JSON_CBOR_MAX_DEPTH
+	#define JSON_CBOR_MAX_DEPTH 1024
+#endif
+
+// json_intern pools containers up to this many members. bigger ones keep their own
+//   node, though their members are still pooled.
+#ifndef JSON_INTERN_MAX_LEN
+	#define JSON_INTERN_MAX_LEN 16
+#endif
+
+// freed nodes each thread keeps per size class for reuse
+#ifndef JSON_FREELIST_MAX
+	#define JSON_FREELIST_MAX 4096
+#endif
+
+// where json_save_image lays images out by default. far above the heap and below
+//   the usual mmap area on 64-bit linux. 0 means always relocate.
+#ifndef JSON_IMAGE_BASE
+	#if UINTPTR_MAX > 0xffffffffu
+		#define JSON_IMAGE_BASE ((uintptr_t)0x200000000000ull)
+	#else
+		#define JSON_IMAGE_BASE 0
+	#endif
+#endif
 
 #include "json.h"
 #include "MurmurHash3.h"
 
+// reference counts. the decrement returns the old value.
+#if defined(__GNUC__) || defined(__clang__)
+	#define json_atomic_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+	#define json_atomic_inc(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+	#define json_atomic_dec(p) __atomic_fetch_sub(p, 1, __ATOMIC_ACQ_REL)
+	// cached hashes. racing writers store the same value.
+	#define json_atomic_peek(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+	#define json_atomic_set(p, x) __atomic_store_n(p, x, __ATOMIC_RELAXED)
+#else
+	#define json_atomic_load(p) (*(p))
+	#define json_atomic_inc(p) (++*(p))
+	#define json_atomic_dec(p) ((*(p))--)
+	#define json_atomic_peek(p) (*(p))
+	#define json_atomic_set(p, x) (*(p) = (x))
+#endif
+
 #define MURMUR_SEED 718281828
 
+#if defined(_MSC_VER)
+	#define JSON_THREAD_LOCAL __declspec(thread)
+#else
+	#define JSON_THREAD_LOCAL _Thread_local
+#endif
+
+
+// NULL means the C library
+static struct json_allocator* global_allocator;
+static JSON_THREAD_LOCAL struct json_allocator* thread_allocator;
+
+#define cur_allocator() (thread_allocator ? thread_allocator : global_allocator)
+
+void json_set_allocator(struct json_allocator* a) {
+	global_allocator = a;
+}
+
+struct json_allocator* json_set_thread_allocator(struct json_allocator* a) {
+	struct json_allocator* old = thread_allocator;
+	thread_allocator = a;
+	return old;
+}
+
+void* json_mem_alloc(size_t size) {
+	struct json_allocator* a = cur_allocator();
+	
+	return a ? a->alloc(a->user, size) : malloc(size);
+}
+
+static void* json_mem_calloc(size_t n, size_t size) {
+	struct json_allocator* a = cur_allocator();
+	void* p;
+	
+	if(!a) return calloc(n, size);
+	if(size && n > SIZE_MAX / size) return NULL;
+	
+	p = a->alloc(a->user, n * size);
+	if(p) memset(p, 0, n * size);
+	
+	return p;
+}
+
+static void* json_mem_realloc(void* p, size_t size) {
+	struct json_allocator* a = cur_allocator();
+	
+	return a ? a->realloc(a->user, p, size) : realloc(p, size);
+}
+
+void json_mem_free(void* p) {
+	struct json_allocator* a = cur_allocator();
+	
+	if(!a) free(p);
+	else if(p) a->free(a->user, p);
+}
+
 
 enum token_type {
 	TOKEN_NONE = 0,
@@ -38,13 +160,165 @@ enum token_type {
 struct json_obj_field {
 	uint64_t hash;
 	char* key;
+	size_t key_len; // keys may contain nulls
 	struct json_value* value;
+	unsigned int flags; // JSON_STR_* for the key
+};
+
+
+///////////////////
+//   Freelists   //
+///////////////////
+
+// per-thread caches of freed nodes and small bucket arrays, so documents that
+//   come and go don't keep going back to malloc. only used with the C library
+//   allocator: a custom one gets every call, as it asked to.
+enum {
+	FL_VALUE,
+	FL_LINK,
+	FL_BUCKETS_8,
+	FL_BUCKETS_16,
+	FL_BUCKETS_32,
+	FL_CLASSES
+};
+
+static const size_t fl_sizes[FL_CLASSES] = {
+	sizeof(struct json_value),
+	sizeof(struct json_link),
+	sizeof(struct json_obj_field) * 8,
+	sizeof(struct json_obj_field) * 16,
+	sizeof(struct json_obj_field) * 32,
 };
 
+struct json_freelist {
+	void* head; // each free block starts with the next one's address
+	size_t len;
+};
+
+static JSON_THREAD_LOCAL struct json_freelist freelists[FL_CLASSES];
+
+void json_thread_cache_release(void) {
+	void* p;
+	int i;
+	
+	for(i = 0; i < FL_CLASSES; i++) {
+		while((p = freelists[i].head)) {
+			freelists[i].head = *(void**)p;
+			free(p);
+		}
+		freelists[i].len = 0;
+	}
+}
+
+#if !defined(JSON_NO_FREELISTS) && !defined(JSON_NO_THREADS)
+static pthread_once_t fl_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fl_key;
+static JSON_THREAD_LOCAL int fl_registered;
+
+static void fl_thread_exit(void* unused) {
+	(void)unused;
+	json_thread_cache_release();
+}
+
+static void fl_make_key(void) {
+	pthread_key_create(&fl_key, fl_thread_exit);
+}
+#endif
+
+#ifndef JSON_NO_FREELISTS
+static void* fl_alloc(int cls) {
+	struct json_freelist* f = &freelists[cls];
+	void* p;
+	
+	if((p = f->head) && !cur_allocator()) {
+		f->head = *(void**)p;
+		f->len--;
+		return p;
+	}
+	
+	return json_mem_alloc(fl_sizes[cls]);
+}
+
+static void fl_free(int cls, void* p) {
+	struct json_freelist* f = &freelists[cls];
+	
+	if(!p || cur_allocator() || f->len >= JSON_FREELIST_MAX) {
+		json_mem_free(p);
+		return;
+	}
+	
+#ifndef JSON_NO_THREADS
+	// the cache is emptied when the thread exits
+	if(!fl_registered) {
+		pthread_once(&fl_key_once, fl_make_key);
+		pthread_setspecific(fl_key, freelists);
+		fl_registered = 1;
+	}
+#endif
+	
+	*(void**)p = f->head;
+	f->head = p;
+	f->len++;
+}
+#else
+	#define fl_alloc(cls) json_mem_alloc(fl_sizes[cls])
+	#define fl_free(cls, p) json_mem_free(p)
+#endif
+
+static int buckets_class(size_t n) {
+	switch(n) {
+		case 8: return FL_BUCKETS_8;
+		case 16: return FL_BUCKETS_16;
+		case 32: return FL_BUCKETS_32;
+		default: return -1;
+	}
+}
+
+#define value_alloc() ((struct json_value*)fl_alloc(FL_VALUE))
+#define value_free(v) fl_free(FL_VALUE, v)
+#define link_alloc() ((struct json_link*)fl_alloc(FL_LINK))
+#define link_free(l) fl_free(FL_LINK, l)
+
+// zeroed
+static struct json_obj_field* buckets_alloc(size_t n) {
+	struct json_obj_field* b;
+	int cls = buckets_class(n);
+	
+	if(cls < 0) return json_mem_calloc(n, sizeof(*b));
+	
+	b = fl_alloc(cls);
+	if(b) memset(b, 0, fl_sizes[cls]);
+	
+	return b;
+}
+
+static void buckets_free(struct json_obj_field* b, size_t n) {
+	int cls = buckets_class(n);
+	
+	if(cls < 0) json_mem_free(b);
+	else fl_free(cls, b);
+}
+
 
 struct token {
 	enum token_type tokenType;
-	struct json_value* val;
+	struct json_value* val; // numbers
+	
+	char* str; // strings and labels. owned by the token until the parser takes it
+	size_t len;
+	unsigned int str_flags; // JSON_STR_*
+	
+	char* src; // the token's text in the source
+	size_t src_len;
+};
+
+
+// one per open container
+struct json_parse_frame {
+	struct json_value* container;
+	char* key; // pending object key, owned by the frame until the value arrives
+	size_t key_len;
+	unsigned int key_flags;
 };
 
 
@@ -57,41 +331,34 @@ struct json_parser {
 	char* end;
 	size_t source_len;
 	int eoi;
-	int gotToken;
+	
+	int strict; // RFC 8259 only
+	int validate_utf8;
+	int lazy_numbers;
 	
 	char* head;
-	int line_num; // these are 1-based
-	int char_num;
+	int line_num; // 1-based
+	char* line_start; // the column is derived from this when needed
 	
 	struct token cur_tok;
 	
 	// parsing info
-	struct json_value** stack;
+	struct json_parse_frame* stack;
 	int stack_cnt;
 	int stack_alloc;
+	
+	struct json_value* root;
 };
 
 static void json_parser_free(struct json_parser* jp) {
-	if(jp->err_str) free(jp->err_str);
-//	if(jp->source) free(jp->source); // freed externally
-	if(jp->stack) free(jp->stack);
+	if(jp->err_str) json_mem_free(jp->err_str);
+//	if(jp->source) json_mem_free(jp->source); // freed externally
+	if(jp->stack) json_mem_free(jp->stack);
 }
 
-// sentinels for the parser stack
-
-// the slot above contains an array, merge into it
-struct json_value* RESUME_ARRAY = (struct json_value*)&RESUME_ARRAY;
-
-// the slot above contains a label, the slot above that contains the object to merge into
-struct json_value* RESUME_OBJ = (struct json_value*)&RESUME_OBJ;
-
-// proper, safe bottom of the stack
-struct json_value* ROOT_VALUE = (struct json_value*)&ROOT_VALUE;
-
 
 
 static void dbg_print_token(struct token* ts);
-static void dbg_dump_stack(struct json_parser* jp, int depth);
 
 
 
@@ -100,7 +367,7 @@ int json_array_push_tail(struct json_value* a, struct json_value* val) {
 
 	struct json_link* node;
 	
-	node = malloc(sizeof(*node));
+	node = link_alloc();
 	if(!node) return 1;
 	
 	node->next = NULL;
@@ -138,7 +405,7 @@ struct json_value* json_array_pop_tail(struct json_value* a) {
 		a->arr.tail = a->arr.tail->prev;
 		a->arr.tail->next = NULL;
 		
-		free(t);
+		link_free(t);
 	}
 	else {
 		a->arr.head = a->arr.tail = NULL;
@@ -152,7 +419,7 @@ int json_array_push_head(struct json_value* a, struct json_value* val) {
 
 	struct json_link* node;
 	
-	node = malloc(sizeof(*node));
+	node = link_alloc();
 	if(!node) return 1;
 	
 	node->prev = NULL;
@@ -191,7 +458,7 @@ struct json_value* json_array_pop_head(struct json_value* a) {
 		a->arr.head = a->arr.head->prev;
 		a->arr.head->next = NULL;
 	
-		free(t);
+		link_free(t);
 	}
 	else {
 		a->arr.tail = a->arr.head = NULL;
@@ -223,19 +490,32 @@ size_t json_array_calc_length(struct json_value* a) {
 }
 
 
+// like strndup, but copies embedded nulls too
+static char* json_memdup(char* s, size_t len) {
+	char* d = json_mem_alloc(len + 1);
+	if(!d) return NULL;
+	
+	memcpy(d, s, len);
+	d[len] = 0;
+	
+	return d;
+}
+
+static char* json_strdup(char* s) {
+	return json_memdup(s, strlen(s));
+}
+
+
 // uses a truncated 128bit murmur3 hash
-static uint64_t hash_key(char* key, intptr_t len) {
+static uint64_t hash_key(char* key, size_t len) {
 	uint64_t hash[2];
 	
-	// len is optional
-	if(len == -1) len = strlen(key);
-	
 	MurmurHash3_x64_128(key, len, MURMUR_SEED, hash);
 	
 	return hash[0];
 }
 
-static int64_t find_bucket(struct json_value* obj, uint64_t hash, char* key) {
+static int64_t find_bucket(struct json_value* obj, uint64_t hash, char* key, size_t len) {
 	int64_t startBucket, bi;
 	
 	bi = startBucket = hash % obj->obj.alloc_size; 
@@ -251,7 +531,7 @@ static int64_t find_bucket(struct json_value* obj, uint64_t hash, char* key) {
 		}
 		
 		if(bucket->hash == hash) {
-			if(!strcmp(key, bucket->key)) {
+			if(bucket->key_len == len && !memcmp(key, bucket->key, len)) {
 				// bucket is the right one and contains a value already
 				return bi;
 			}
@@ -277,9 +557,12 @@ static int json_obj_resize(struct json_value* obj, int newSize) {
 	
 	old = op = obj->obj.buckets;
 	
+	obj->obj.buckets = buckets_alloc(newSize);
+	if(!obj->obj.buckets) {
+		obj->obj.buckets = old;
+		return 1;
+	}
 	obj->obj.alloc_size = newSize;
-	obj->obj.buckets = calloc(1, sizeof(*obj->obj.buckets) * newSize);
-	if(!obj->obj.buckets) return 1;
 	
 	for(i = 0, n = 0; i < oldlen && n < (int64_t)obj->len; i++) {
 		if(op->key == NULL) {
@@ -287,16 +570,18 @@ static int json_obj_resize(struct json_value* obj, int newSize) {
 			continue;
 		}
 		
-		bi = find_bucket(obj, op->hash, op->key);
+		bi = find_bucket(obj, op->hash, op->key, op->key_len);
 		obj->obj.buckets[bi].value = op->value;
 		obj->obj.buckets[bi].hash = op->hash;
 		obj->obj.buckets[bi].key = op->key;
+		obj->obj.buckets[bi].key_len = op->key_len;
+		obj->obj.buckets[bi].flags = op->flags;
 		
 		n++;
 		op++;
 	}
 	
-	free(old);
+	buckets_free(old, oldlen);
 	
 	return 0;
 }
@@ -306,12 +591,16 @@ static int json_obj_resize(struct json_value* obj, int newSize) {
 // returns 0 if val is set to the value
 // *val == NULL && return > 0 means the key was not found;
 int json_obj_get_key(struct json_value* obj, char* key, struct json_value** val) {
+	return json_obj_get_key_n(obj, key, strlen(key), val);
+}
+
+int json_obj_get_key_n(struct json_value* obj, char* key, size_t len, struct json_value** val) {
 	uint64_t hash;
 	int64_t bi;
 	
-	hash = hash_key(key, -1);
+	hash = hash_key(key, len);
 	
-	bi = find_bucket(obj, hash, key);
+	bi = find_bucket(obj, hash, key, len);
 	if(bi < 0 || obj->obj.buckets[bi].key == NULL) {
 		*val = NULL;
 		return 1;
@@ -323,16 +612,32 @@ int json_obj_get_key(struct json_value* obj, char* key, struct json_value** val)
 
 // zero for success
 int json_obj_set_key(struct json_value* obj, char* key, struct json_value* val) {
-	char* kd = strdup(key);
-	int res = json_obj_set_key_nodup(obj, kd, val);
+	return json_obj_set_key_n(obj, key, strlen(key), val);
+}
+
+int json_obj_set_key_n(struct json_value* obj, char* key, size_t len, struct json_value* val) {
+	char* kd = json_memdup(key, len);
+	int res;
 	
-	if(res) free(kd);
+	if(!kd) return 1;
+	
+	res = json_obj_set_key_nodup_n(obj, kd, len, val);
+	if(res) json_mem_free(kd);
 	
 	return res;
 }
 
-int json_obj_set_key_nodup(struct json_value* obj, char* key, struct json_value* val) {
-	uint64_t hash;
+static unsigned int json_str_flags(char* s, size_t len);
+static int obj_set_key_hashed(struct json_value* obj, uint64_t hash, char* key, size_t len, unsigned int flags, struct json_value* val, struct json_value** old);
+
+// takes ownership of key. flags are the key's JSON_STR_*. a value val replaces
+//   is stored in *old, or left to whoever else holds it if old is NULL.
+static int obj_set_key_flags(struct json_value* obj, char* key, size_t len, unsigned int flags, struct json_value* val, struct json_value** old) {
+	return obj_set_key_hashed(obj, hash_key(key, len), key, len, flags, val, old);
+}
+
+// same, for a key that has been hashed already
+static int obj_set_key_hashed(struct json_value* obj, uint64_t hash, char* key, size_t len, unsigned int flags, struct json_value* val, struct json_value** old) {
 	int64_t bi;
 	
 	// check size and grow if necessary
@@ -340,15 +645,69 @@ int json_obj_set_key_nodup(struct json_value* obj, char* key, struct json_value*
 		json_obj_resize(obj, obj->obj.alloc_size * 2);
 	}
 	
-	hash = hash_key(key, -1);
-	
-	bi = find_bucket(obj, hash, key);
+	bi = find_bucket(obj, hash, key, len);
 	if(bi < 0) return 1;
 	
+	if(old) *old = NULL;
+	
+	// an existing key keeps its slot. the old key belonged to the object.
+	if(obj->obj.buckets[bi].key) {
+		json_mem_free(obj->obj.buckets[bi].key);
+		if(old && obj->obj.buckets[bi].value != val) *old = obj->obj.buckets[bi].value;
+	}
+	else obj->len++;
+	
 	obj->obj.buckets[bi].value = val;
 	obj->obj.buckets[bi].key = key;
+	obj->obj.buckets[bi].key_len = len;
 	obj->obj.buckets[bi].hash = hash;
-	obj->len++;
+	obj->obj.buckets[bi].flags = flags;
+	
+	return 0;
+}
+
+int json_obj_set_key_nodup(struct json_value* obj, char* key, struct json_value* val) {
+	return json_obj_set_key_nodup_n(obj, key, strlen(key), val);
+}
+
+int json_obj_set_key_nodup_n(struct json_value* obj, char* key, size_t len, struct json_value* val) {
+	struct json_value* old;
+	int res;
+	
+	// the object owned the value it replaces
+	res = obj_set_key_flags(obj, key, len, json_str_flags(key, len), val, &old);
+	if(!res) json_free(old);
+	
+	return res;
+}
+
+int json_obj_delete_key(struct json_value* obj, char* key) {
+	return json_obj_delete_key_n(obj, key, strlen(key));
+}
+
+int json_obj_delete_key_n(struct json_value* obj, char* key, size_t len) {
+	struct json_obj_field* b = obj->obj.buckets;
+	size_t n = obj->obj.alloc_size, i, j, home;
+	int64_t bi;
+	
+	bi = find_bucket(obj, hash_key(key, len), key, len);
+	if(bi < 0 || !b[bi].key) return 1;
+	
+	json_mem_free(b[bi].key);
+	json_free(b[bi].value);
+	obj->len--;
+	
+	// no tombstones. later members of the probe run shift back into the hole,
+	//   unless their home bucket lies cyclically in (hole, j]
+	i = bi;
+	for(j = (i + 1) % n; b[j].key; j = (j + 1) % n) {
+		home = b[j].hash % n;
+		if(i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+		
+		b[i] = b[j];
+		i = j;
+	}
+	memset(&b[i], 0, sizeof(*b));
 	
 	return 0;
 }
@@ -356,8 +715,11 @@ int json_obj_set_key_nodup(struct json_value* obj, char* key, struct json_value*
 
 
 char* json_obj_get_strdup(struct json_value* obj, char* key) {
-	char* s = json_obj_get_str(obj, key);
-	return s ? strdup(s) : NULL;
+	json_value_t* val = json_obj_get_val(obj, key);
+	
+	if(!val || val->type != JSON_TYPE_STRING) return NULL;
+	
+	return json_memdup(val->s, val->len);
 }
 
 
@@ -388,7 +750,7 @@ int64_t json_obj_get_int(struct json_value* obj, char* key, int64_t def) {
 		return def;
 	}
 	
-	return val->n;
+	return json_as_int(val);
 }
 
 // returns a double or the default value if it's not an integer
@@ -403,15 +765,19 @@ double json_obj_get_double(struct json_value* obj, char* key, double def) {
 		return def;
 	}
 	
-	return val->d;
+	return json_as_double(val);
 }
 
 
 // returns the json_value struct for a key, or null if it doesn't exist
 struct json_value* json_obj_get_val(struct json_value* obj, char* key) {
+	return json_obj_get_val_n(obj, key, strlen(key));
+}
+
+struct json_value* json_obj_get_val_n(struct json_value* obj, char* key, size_t len) {
 	json_value_t* val;
 	
-	if(json_obj_get_key(obj, key, &val)) {
+	if(json_obj_get_key_n(obj, key, len, &val)) {
 		return NULL;
 	}
 
@@ -455,6 +821,16 @@ int json_obj_next(struct json_value* obj, void** iter, char** key, struct json_v
 	return 1;
 }
 
+// same, but also returns the key's length
+int json_obj_next_n(struct json_value* obj, void** iter, char** key, size_t* key_len, struct json_value** value) {
+	int ret = json_obj_next(obj, iter, key, value);
+	
+	// json_obj_next returns 1 for a non-object without touching key or iter
+	*key_len = ret == 1 && obj->type == JSON_TYPE_OBJ ? ((struct json_obj_field*)*iter)->key_len : 0;
+	
+	return ret;
+}
+
 
 /* key, target, offset, type */
 // returns number of values filled
@@ -517,7 +893,7 @@ int json_obj_unpack_string_array(struct json_value* obj, char*** out, size_t* le
 		return 2;
 	}
 	
-	a = malloc(l * 2 * sizeof(*a));
+	a = json_mem_alloc(l * 2 * sizeof(*a));
 	if(!a) {
 		return 3;
 	}
@@ -555,6 +931,18 @@ JSON_TYPE_INT is assumed to be C int
 numbers over 2^63 are not properly supported yet. they will be truncated to 0
 */
 
+// converts a number left as source text by lazy_numbers. not thread-safe.
+static void json_number_decode(struct json_value* v) {
+	if(!(v->flags & JSON_NUM_LAZY)) return;
+	
+	// the span always ends on a non-number char, so strto* stop there
+	if(v->type == JSON_TYPE_DOUBLE) v->d = strtod(v->num.src, NULL);
+	else v->n = strtoll(v->num.src, NULL, 10);
+	
+	v->flags &= ~JSON_NUM_LAZY;
+}
+
+
 // returns 0 if successful
 int json_as_type(struct json_value* v, enum json_type t, void* out) { 
 	int ret;
@@ -646,12 +1034,15 @@ int json_as_type(struct json_value* v, enum json_type t, void* out) {
 
 // returns 0 for success
 int64_t json_as_int(struct json_value* v) {
+	json_number_decode(v);
+	
 	switch(v->type) { // actual type
 		case JSON_TYPE_UNDEFINED:
 		case JSON_TYPE_NULL:
 			return 0;
 			
 		case JSON_TYPE_INT:
+		case JSON_TYPE_BOOL:
 			return v->n;
 			
 		case JSON_TYPE_DOUBLE:
@@ -671,12 +1062,15 @@ int64_t json_as_int(struct json_value* v) {
 
 // returns 0 for success
 double json_as_double(struct json_value* v) {
+	json_number_decode(v);
+	
 	switch(v->type) { // actual type
 		case JSON_TYPE_UNDEFINED:
 		case JSON_TYPE_NULL:
 			return 0.0;
 			
 		case JSON_TYPE_INT:
+		case JSON_TYPE_BOOL:
 			return v->n;
 			
 		case JSON_TYPE_DOUBLE:
@@ -704,7 +1098,7 @@ static char* a_sprintf(char* fmt, ...) {
 	va_start(args, fmt);
 
 	len = vsnprintf(NULL, 0, fmt, args);
-	buf = malloc(len + 1);
+	buf = json_mem_alloc(len + 1);
 	if(!buf) return NULL;
 
 	vsnprintf(buf, len, fmt, args);
@@ -721,30 +1115,37 @@ char* json_as_strdup(struct json_value* v) {
 	
 	switch(v->type) { // actual type
 		case JSON_TYPE_UNDEFINED:
-			return strdup("undefined");
+			return json_strdup("undefined");
 			
 		case JSON_TYPE_NULL:
-			return strdup("null");
+			return json_strdup("null");
+			
+		case JSON_TYPE_BOOL:
+			return json_strdup(v->n ? "true" : "false");
 			
 		case JSON_TYPE_INT:
+			if(v->flags & JSON_NUM_SRC) return json_memdup(v->num.src, v->len);
 			return a_sprintf("%ld", v->n); // BUG might leak memory
 			
 		case JSON_TYPE_DOUBLE:
+			if(v->flags & JSON_NUM_SRC) return json_memdup(v->num.src, v->len);
 			return a_sprintf("%f", v->d);
 			
 		case JSON_TYPE_COMMENT_SINGLE:
 		case JSON_TYPE_COMMENT_MULTI:
+			return json_strdup(v->s);
+		
 		case JSON_TYPE_STRING:
-			return strdup(v->s);
+			return json_memdup(v->s, v->len);
 			
 		case JSON_TYPE_OBJ:
-			return strdup("[Object]");
+			return json_strdup("[Object]");
 			
 		case JSON_TYPE_ARRAY:
-			return strdup("[Array]");
+			return json_strdup("[Array]");
 		
 		default:
-			return strdup("");
+			return json_strdup("");
 	}
 }
 
@@ -755,263 +1156,793 @@ float json_as_float(struct json_value* v) {
 
 
 
-// out must be big enough, at least as big as in+1 just to be safe
-// appends a null to out, but is also null-safe
-static int decode_c_escape_str(char* in, char* out, size_t len, size_t* outLen) {
-	size_t i, o;
-	
-	char tmp[7];
-	
-	for(i = 0, o = 0; i < len; i++, o++) {
-		if(*in == '\\') {
-			in++;
-			i++;
-			switch(*in) {
-				case '0': *out = '\0'; break; 
-				case 'r': *out = '\r'; break; 
-				case 'n': *out = '\n'; break;
-				case 'f': *out = '\f'; break;
-				case 'a': *out = '\a'; break;
-				case 'b': *out = '\b'; break;
-				case 'v': *out = '\v'; break;
-				case 't': *out = '\t'; break;
-				case 'x': 
-				
-					if(len < i + 1) {
-//						jp->error = JSON_PARSER_ERROR_UNEXPECTED_EOI;
-						//printf("JSON: EOF in hex escape sequence\n");
-						return 1;
-					}
-					if(!isxdigit(in[1])) {
-						// malformed hex code. output an 'x' and keep going.
-						*out = 'x';
-						break;
-					}
-					
-					tmp[0] = in[1];	
-				
-				
-					if(len < i + 2) {
-//						jp->error = JSON_PARSER_ERROR_UNEXPECTED_EOI;
-						//printf("JSON: EOF in hex escape sequence\n");
-						return 1;
-					}
-					if(!isxdigit(in[2])) {
-						// malformed hex code, but we have one digit
-						tmp[1] = 0;
-						
-						*out = strtol(tmp, NULL, 16);
-						in++; i++;
-						break;
-					}
-					else {
-						tmp[1] = in[2];
-						tmp[2] = 0;
-						
-						*out = strtol(tmp, NULL, 16);
-						in += 2; i += 2;
-					}					
-					break;
+#if defined(__GNUC__) || defined(__clang__)
+	#define JSON_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+	#define JSON_ALWAYS_INLINE inline
+#endif
+
+
+///////////////////
+//     UTF-8     //
+///////////////////
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+	#define JSON_SSE2 1
+#endif
+
+// the lookup validator needs pshufb. it is compiled with a target attribute
+//   and picked at runtime, so the rest of the library doesn't need -mssse3.
+#if !defined(JSON_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#include <tmmintrin.h>
+	#define JSON_SSSE3_UTF8 1
+#endif
+
+
+// the lengths and ranges of Unicode Table 3-7. returns 0 for valid utf-8.
+static int utf8_validate_scalar(unsigned char* s, unsigned char* end) {
 	
-				case 'u': 
-					if(in[1] == '{') {
-						int n;
-						int32_t code;
-						char* s;
-						// seek forward to the closing '}'
-						for(n = 0, s = in + 2;; n++) {
-							if(i + 3 >= len) {
-								//printf("JSON: EOF in unicode escape sequence\n");
-								return 2;
-							}
-							
-							if(s[0] == '}') break;
-							
-							if(n == INT_MAX) {
-								//printf("JSON: malformed unicode escape sequence\n");
-								return 3;
-							}
-							
-							if(!isxdigit(s[0])) {
-								//printf("JSON: invalid character inside unicode escape sequence\n");
-								break;
-							}
-							
-							s++;
-						}
-						
-						int nl = n > 6 ? 6 : n;
-					
-						if(n > 0) {
-							strncpy(tmp, s - nl, nl);
-							tmp[nl] = 0;
-							code = strtol(tmp, NULL, 16);
-						}
-						else {
-							code = 0;
-						}
-						
-						*out = code; // todo: utf8 conversion
-						in += n + 2; i += n + 2;
-					}
-					else {
-						int n;
-						int32_t code;
-						char* s;
-						// seek forward to the closing '}'
-						for(n = 0, s = in + 1; n < 4; n++) {
-							if(i + 2 >= len) {
-								//printf("JSON: EOF in unicode escape sequence\n");
-								return 2;
-							}
-							
-							if(!isxdigit(s[0])) {
-								break;
-							}
-							
-							s++;
-						}
-					
-						if(n > 0) {
-							strncpy(tmp, in + 1, n);
-							tmp[n] = 0;
-							code = strtol(tmp, NULL, 16);
-						}
-						else {
-							code = 0;
-						}
-						
-						*out = code; // todo: utf8 conversion
-						in += n; i += n;
-					}
-					
-					break;
-					
-				default:
-					// pass-through
-					*out = in[0];
+	while(s < end) {
+		unsigned char c = *s;
+		
+		// skip ascii 8 bytes at a time
+		if(c < 0x80) {
+			while(s + 8 <= end) {
+				uint64_t w;
+				memcpy(&w, s, 8);
+				if(w & 0x8080808080808080ull) break;
+				s += 8;
 			}
-		}
-		else {
-			*out = *in;
+			while(s < end && *s < 0x80) s++;
+			continue;
 		}
 		
-		out++;
-		in++;
+		if(c >= 0xc2 && c <= 0xdf) {
+			if(end - s < 2) return 1;
+			if((s[1] & 0xc0) != 0x80) return 1;
+			s += 2;
+		}
+		else if(c >= 0xe0 && c <= 0xef) {
+			if(end - s < 3) return 1;
+			if((s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80) return 1;
+			if(c == 0xe0 && s[1] < 0xa0) return 1; // overlong
+			if(c == 0xed && s[1] > 0x9f) return 1; // surrogate
+			s += 3;
+		}
+		else if(c >= 0xf0 && c <= 0xf4) {
+			if(end - s < 4) return 1;
+			if((s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 || (s[3] & 0xc0) != 0x80) return 1;
+			if(c == 0xf0 && s[1] < 0x90) return 1; // overlong
+			if(c == 0xf4 && s[1] > 0x8f) return 1; // > U+10FFFF
+			s += 4;
+		}
+		else return 1;
 	}
 	
-	*out = '\0';
-	if(outLen) *outLen = o; 
-	
 	return 0;
 }
 
 
+#ifdef JSON_SSSE3_UTF8
 
+/*
+Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+Each byte is checked against the byte before it with three nibble lookups;
+any combination that can't appear in valid utf-8 leaves a bit set. The
+lengths of 3 and 4 byte sequences are checked separately.
+*/
 
-///////////////////
-//    Parser     //
-///////////////////
-
+#define U8_TOO_SHORT   (1<<0) // 11______ 0_______ or 11______ 11______
+#define U8_TOO_LONG    (1<<1) // 0_______ 10______
+#define U8_OVERLONG_3  (1<<2) // 11100000 100_____
+#define U8_TOO_LARGE   (1<<3) // 11110100 1001____ and up
+#define U8_SURROGATE   (1<<4) // 11101101 101_____
+#define U8_OVERLONG_2  (1<<5) // 1100000_ 10______
+#define U8_TOO_LARGE_1000 (1<<6) // 11110101 1000____ and up
+#define U8_OVERLONG_4  (1<<6) // 11110000 1000____
+#define U8_TWO_CONTS   (1<<7) // 10______ 10______
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+__attribute__((target("ssse3")))
+static __m128i utf8_block_errors(__m128i input, __m128i prev_input) {
+	const __m128i nib = _mm_set1_epi8(0x0f);
+	
+	const __m128i byte_1_high_tbl = _mm_setr_epi8(
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+		U8_TOO_SHORT | U8_OVERLONG_2,
+		U8_TOO_SHORT,
+		U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+		U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4
+	);
+	
+	const __m128i byte_1_low_tbl = _mm_setr_epi8(
+		U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+		U8_CARRY | U8_OVERLONG_2,
+		U8_CARRY,
+		U8_CARRY,
+		U8_CARRY | U8_TOO_LARGE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000
+	);
+	
+	const __m128i byte_2_high_tbl = _mm_setr_epi8(
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+	);
+	
+	__m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+	__m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+	__m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+	
+	__m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_tbl, _mm_and_si128(_mm_srli_epi16(prev1, 4), nib));
+	__m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_tbl, _mm_and_si128(prev1, nib));
+	__m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_tbl, _mm_and_si128(_mm_srli_epi16(input, 4), nib));
+	
+	__m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+	
+	// the 3rd and 4th bytes of a sequence must be continuations, and nothing else may be
+	__m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 1)));
+	__m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 1)));
+	__m128i must23 = _mm_cmpgt_epi8(_mm_or_si128(third, fourth), _mm_setzero_si128());
+	__m128i must23_80 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+	
+	return _mm_xor_si128(must23_80, special);
+}
 
+// nonzero where the last bytes of the block start a sequence that continues into the next one
+__attribute__((target("ssse3")))
+static __m128i utf8_block_incomplete(__m128i input) {
+	const __m128i max = _mm_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1)
+	);
+	return _mm_subs_epu8(input, max);
+}
 
-// move forward one char
-static void lex_next_char(struct json_parser* jl) {
-	if(jl->error) { 
-		//printf("JSON: next char has error\n");
-		return;
-	}
-	if(*jl->head == '\n') {
-		jl->line_num++;
-		jl->char_num = 1;
+__attribute__((target("ssse3")))
+static int utf8_validate_ssse3(unsigned char* s, unsigned char* end) {
+	__m128i prev_input = _mm_setzero_si128();
+	__m128i prev_incomplete = _mm_setzero_si128();
+	__m128i error = _mm_setzero_si128();
+	unsigned char tail[16];
+	
+	for(; s + 16 <= end; s += 16) {
+		__m128i input = _mm_loadu_si128((__m128i*)s);
+		
+		if(!_mm_movemask_epi8(input)) {
+			// ascii; only an unfinished sequence from the last block can be wrong
+			error = _mm_or_si128(error, prev_incomplete);
+		}
+		else {
+			error = _mm_or_si128(error, utf8_block_errors(input, prev_input));
+			prev_incomplete = utf8_block_incomplete(input);
+		}
+		
+		prev_input = input;
 	}
-	else {
-		jl->char_num++;
+	
+	// pad the tail with zeros, which are valid and end any open sequence
+	if(s < end) {
+		__m128i input;
+		
+		memset(tail, 0, 16);
+		memcpy(tail, s, end - s);
+		input = _mm_loadu_si128((__m128i*)tail);
+		
+		error = _mm_or_si128(error, utf8_block_errors(input, prev_input));
+		prev_incomplete = utf8_block_incomplete(input);
 	}
 	
-	jl->head++;
-	//printf("%c\n", *jl->head);
-	//printf("line/char [%d/%d]\n", jl->line_num, jl->char_num);
+	error = _mm_or_si128(error, prev_incomplete);
+	
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xffff;
 }
 
+#endif // JSON_SSSE3_UTF8
 
 
-// returns erro code.
-static int lex_push_token_val(struct json_parser* jp, enum token_type t, struct json_value* val) {
+// returns 0 if s is valid utf-8
+int json_utf8_validate(char* s, size_t len) {
+#ifdef JSON_SSSE3_UTF8
+	static int has_ssse3 = -1;
 	
-	jp->gotToken = 1;
-	jp->cur_tok.tokenType = t;
-	jp->cur_tok.val = val;
-	
-	dbg_printf("pushing token %d at %d, %d\n", t, jp->line_num, jp->char_num);
+	if(has_ssse3 < 0) has_ssse3 = __builtin_cpu_supports("ssse3");
+	if(has_ssse3) return utf8_validate_ssse3((unsigned char*)s, (unsigned char*)s + len);
+#endif
 	
-	return 0;
+	return utf8_validate_scalar((unsigned char*)s, (unsigned char*)s + len);
 }
 
 
-
-// returns error code. val set to null
-static int lex_push_token(struct json_parser* jl, enum token_type t) {
-	return lex_push_token_val(jl, t, NULL);
+// writes the utf-8 encoding of code to out. returns the number of bytes written.
+static int utf8_encode(uint32_t code, char* out) {
+	unsigned char* o = (unsigned char*)out;
+	
+	if(code < 0x80) {
+		o[0] = code;
+		return 1;
+	}
+	if(code < 0x800) {
+		o[0] = 0xc0 | (code >> 6);
+		o[1] = 0x80 | (code & 0x3f);
+		return 2;
+	}
+	if(code < 0x10000) {
+		o[0] = 0xe0 | (code >> 12);
+		o[1] = 0x80 | ((code >> 6) & 0x3f);
+		o[2] = 0x80 | (code & 0x3f);
+		return 3;
+	}
+	
+	o[0] = 0xf0 | (code >> 18);
+	o[1] = 0x80 | ((code >> 12) & 0x3f);
+	o[2] = 0x80 | ((code >> 6) & 0x3f);
+	o[3] = 0x80 | (code & 0x3f);
+	return 4;
 }
 
 
-static int lex_string_token(struct json_parser* jl) {
-	size_t len;
-	struct json_value* val;
-	char* str;
-	char delim = *jl->head;
-	char* se = jl->head + 1;
+
+///////////////////
+//   Char Class  //
+///////////////////
+
+/*
+The lexer never calls the <ctype.h> functions; they depend on the locale
+and cost a function call per byte. Everything is looked up in these
+tables instead.
+*/
+
+enum lex_char_class {
+	LEX_CC_INVALID = 0,
+	LEX_CC_END,
+	LEX_CC_SPACE,
+	LEX_CC_SPACE_EXT, // whitespace that RFC 8259 doesn't allow
+	LEX_CC_NEWLINE,
+	LEX_CC_OBJ_START,
+	LEX_CC_OBJ_END,
+	LEX_CC_ARRAY_START,
+	LEX_CC_ARRAY_END,
+	LEX_CC_COMMA,
+	LEX_CC_COLON,
+	LEX_CC_SLASH,
+	LEX_CC_QUOTE,
+	LEX_CC_NUMBER,
+	LEX_CC_IDENT,
+	
+	LEX_CC_MAXVALUE
+};
+
+#define LEX_F_IDENT       0x01 // [A-Za-z0-9_$]
+#define LEX_F_DIGIT       0x02
+#define LEX_F_HEX         0x04
+#define LEX_F_STR_SPECIAL 0x08 // ends the fast scan inside a string
+#define LEX_F_STR_STRICT  0x10 // same, for strict mode. control chars are not allowed in strings
+#define LEX_F_ESCAPE      0x20 // valid after a backslash in strict mode
+
+// maps every byte to the lexer state that handles a token starting with it
+// anything not listed is an invalid character
+static const unsigned char lex_char_class[256] = {
+	['\0'] = LEX_CC_END,
+	[' '] = LEX_CC_SPACE, ['\t'] = LEX_CC_SPACE, ['\r'] = LEX_CC_SPACE,
+	['\f'] = LEX_CC_SPACE_EXT, ['\v'] = LEX_CC_SPACE_EXT,
+	['\n'] = LEX_CC_NEWLINE,
+	['{'] = LEX_CC_OBJ_START, ['}'] = LEX_CC_OBJ_END,
+	['['] = LEX_CC_ARRAY_START, [']'] = LEX_CC_ARRAY_END,
+	[','] = LEX_CC_COMMA, [':'] = LEX_CC_COLON, ['/'] = LEX_CC_SLASH,
+	['"'] = LEX_CC_QUOTE, ['\''] = LEX_CC_QUOTE, ['`'] = LEX_CC_QUOTE,
+	['0'] = LEX_CC_NUMBER, ['1'] = LEX_CC_NUMBER, ['2'] = LEX_CC_NUMBER, ['3'] = LEX_CC_NUMBER, ['4'] = LEX_CC_NUMBER, ['5'] = LEX_CC_NUMBER, ['6'] = LEX_CC_NUMBER,
+	['7'] = LEX_CC_NUMBER, ['8'] = LEX_CC_NUMBER, ['9'] = LEX_CC_NUMBER, ['-'] = LEX_CC_NUMBER, ['+'] = LEX_CC_NUMBER, ['.'] = LEX_CC_NUMBER,
+	['a'] = LEX_CC_IDENT, ['b'] = LEX_CC_IDENT, ['c'] = LEX_CC_IDENT, ['d'] = LEX_CC_IDENT, ['e'] = LEX_CC_IDENT, ['f'] = LEX_CC_IDENT, ['g'] = LEX_CC_IDENT,
+	['h'] = LEX_CC_IDENT, ['i'] = LEX_CC_IDENT, ['j'] = LEX_CC_IDENT, ['k'] = LEX_CC_IDENT, ['l'] = LEX_CC_IDENT, ['m'] = LEX_CC_IDENT, ['n'] = LEX_CC_IDENT,
+	['o'] = LEX_CC_IDENT, ['p'] = LEX_CC_IDENT, ['q'] = LEX_CC_IDENT, ['r'] = LEX_CC_IDENT, ['s'] = LEX_CC_IDENT, ['t'] = LEX_CC_IDENT, ['u'] = LEX_CC_IDENT,
+	['v'] = LEX_CC_IDENT, ['w'] = LEX_CC_IDENT, ['x'] = LEX_CC_IDENT, ['y'] = LEX_CC_IDENT, ['z'] = LEX_CC_IDENT, ['A'] = LEX_CC_IDENT, ['B'] = LEX_CC_IDENT,
+	['C'] = LEX_CC_IDENT, ['D'] = LEX_CC_IDENT, ['E'] = LEX_CC_IDENT, ['F'] = LEX_CC_IDENT, ['G'] = LEX_CC_IDENT, ['H'] = LEX_CC_IDENT, ['I'] = LEX_CC_IDENT,
+	['J'] = LEX_CC_IDENT, ['K'] = LEX_CC_IDENT, ['L'] = LEX_CC_IDENT, ['M'] = LEX_CC_IDENT, ['N'] = LEX_CC_IDENT, ['O'] = LEX_CC_IDENT, ['P'] = LEX_CC_IDENT,
+	['Q'] = LEX_CC_IDENT, ['R'] = LEX_CC_IDENT, ['S'] = LEX_CC_IDENT, ['T'] = LEX_CC_IDENT, ['U'] = LEX_CC_IDENT, ['V'] = LEX_CC_IDENT, ['W'] = LEX_CC_IDENT,
+	['X'] = LEX_CC_IDENT, ['Y'] = LEX_CC_IDENT, ['Z'] = LEX_CC_IDENT, ['_'] = LEX_CC_IDENT, ['$'] = LEX_CC_IDENT,
+};
+
+// character properties used inside tokens
+#define LEX_F_DEC (LEX_F_IDENT | LEX_F_DIGIT | LEX_F_HEX)
+#define LEX_F_HEX_ALPHA (LEX_F_IDENT | LEX_F_HEX)
+#define LEX_F_CTRL LEX_F_STR_STRICT
+static const unsigned char lex_char_flags[256] = {
+	['0'] = LEX_F_DEC, ['1'] = LEX_F_DEC, ['2'] = LEX_F_DEC, ['3'] = LEX_F_DEC, ['4'] = LEX_F_DEC,
+	['5'] = LEX_F_DEC, ['6'] = LEX_F_DEC, ['7'] = LEX_F_DEC, ['8'] = LEX_F_DEC, ['9'] = LEX_F_DEC,
+	['a'] = LEX_F_HEX_ALPHA, ['c'] = LEX_F_HEX_ALPHA, ['d'] = LEX_F_HEX_ALPHA, ['e'] = LEX_F_HEX_ALPHA, ['A'] = LEX_F_HEX_ALPHA,
+	['B'] = LEX_F_HEX_ALPHA, ['C'] = LEX_F_HEX_ALPHA, ['D'] = LEX_F_HEX_ALPHA, ['E'] = LEX_F_HEX_ALPHA, ['F'] = LEX_F_HEX_ALPHA,
+	['b'] = LEX_F_HEX_ALPHA | LEX_F_ESCAPE, ['f'] = LEX_F_HEX_ALPHA | LEX_F_ESCAPE,
+	['g'] = LEX_F_IDENT, ['h'] = LEX_F_IDENT, ['i'] = LEX_F_IDENT, ['j'] = LEX_F_IDENT, ['k'] = LEX_F_IDENT, ['l'] = LEX_F_IDENT, ['m'] = LEX_F_IDENT,
+	['o'] = LEX_F_IDENT, ['p'] = LEX_F_IDENT, ['q'] = LEX_F_IDENT, ['s'] = LEX_F_IDENT, ['v'] = LEX_F_IDENT, ['w'] = LEX_F_IDENT, ['x'] = LEX_F_IDENT,
+	['y'] = LEX_F_IDENT, ['z'] = LEX_F_IDENT, ['G'] = LEX_F_IDENT, ['H'] = LEX_F_IDENT, ['I'] = LEX_F_IDENT, ['J'] = LEX_F_IDENT, ['K'] = LEX_F_IDENT,
+	['L'] = LEX_F_IDENT, ['M'] = LEX_F_IDENT, ['N'] = LEX_F_IDENT, ['O'] = LEX_F_IDENT, ['P'] = LEX_F_IDENT, ['Q'] = LEX_F_IDENT, ['R'] = LEX_F_IDENT,
+	['S'] = LEX_F_IDENT, ['T'] = LEX_F_IDENT, ['U'] = LEX_F_IDENT, ['V'] = LEX_F_IDENT, ['W'] = LEX_F_IDENT, ['X'] = LEX_F_IDENT, ['Y'] = LEX_F_IDENT,
+	['Z'] = LEX_F_IDENT, ['_'] = LEX_F_IDENT, ['$'] = LEX_F_IDENT,
+	['n'] = LEX_F_IDENT | LEX_F_ESCAPE, ['r'] = LEX_F_IDENT | LEX_F_ESCAPE, ['t'] = LEX_F_IDENT | LEX_F_ESCAPE, ['u'] = LEX_F_IDENT | LEX_F_ESCAPE,
+	['\''] = LEX_F_STR_SPECIAL, ['`'] = LEX_F_STR_SPECIAL, ['\n'] = LEX_F_STR_SPECIAL | LEX_F_STR_STRICT,
+	['"'] = LEX_F_STR_SPECIAL | LEX_F_STR_STRICT | LEX_F_ESCAPE, ['\\'] = LEX_F_STR_SPECIAL | LEX_F_STR_STRICT | LEX_F_ESCAPE,
+	['/'] = LEX_F_ESCAPE, ['\0'] = LEX_F_STR_SPECIAL | LEX_F_STR_STRICT,
+	[0x01] = LEX_F_CTRL, [0x02] = LEX_F_CTRL, [0x03] = LEX_F_CTRL, [0x04] = LEX_F_CTRL, [0x05] = LEX_F_CTRL, [0x06] = LEX_F_CTRL, [0x07] = LEX_F_CTRL, [0x08] = LEX_F_CTRL,
+	[0x09] = LEX_F_CTRL, [0x0b] = LEX_F_CTRL, [0x0c] = LEX_F_CTRL, [0x0d] = LEX_F_CTRL, [0x0e] = LEX_F_CTRL, [0x0f] = LEX_F_CTRL, [0x10] = LEX_F_CTRL, [0x11] = LEX_F_CTRL,
+	[0x12] = LEX_F_CTRL, [0x13] = LEX_F_CTRL, [0x14] = LEX_F_CTRL, [0x15] = LEX_F_CTRL, [0x16] = LEX_F_CTRL, [0x17] = LEX_F_CTRL, [0x18] = LEX_F_CTRL, [0x19] = LEX_F_CTRL,
+	[0x1a] = LEX_F_CTRL, [0x1b] = LEX_F_CTRL, [0x1c] = LEX_F_CTRL, [0x1d] = LEX_F_CTRL, [0x1e] = LEX_F_CTRL, [0x1f] = LEX_F_CTRL,
+};
+#undef LEX_F_DEC
+#undef LEX_F_HEX_ALPHA
+#undef LEX_F_CTRL
+
+// hex digit values, with 0x10 set on every valid digit so that zero means invalid
+static const unsigned char lex_hex_table[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14, ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17,
+	['8'] = 0x18, ['9'] = 0x19, ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+};
+
+#define lex_is_ident(c) (lex_char_flags[(unsigned char)(c)] & LEX_F_IDENT)
+#define lex_is_digit(c) (lex_char_flags[(unsigned char)(c)] & LEX_F_DIGIT)
+#define lex_is_escape(c) (lex_char_flags[(unsigned char)(c)] & LEX_F_ESCAPE)
+
+// ascii-only, case-insensitive keyword match over a span that is known to be an identifier
+static int lex_keyword_eq(char* s, size_t len, char* kw, size_t kwlen) {
+	size_t i;
 	
-	int lines = 0;
-	int char_num = jl->char_num;
+	if(len != kwlen) return 0;
+	
+	for(i = 0; i < len; i++) {
+		if((s[i] | 0x20) != kw[i]) return 0;
+	}
 	
+	return 1;
+}
 
-	// find len, count lines
-	while(1) {
+
+// JSON_STR_* for a string that didn't come out of the lexer
+static unsigned int json_str_flags(char* s, size_t len) {
+	unsigned int clean = 1, ident = len > 0 && !lex_is_digit(s[0]);
+	unsigned char hi = 0;
+	size_t i;
+	
+	for(i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		
+		hi |= c;
+		if(c < 0x20 || c == '"' || c == '\\') clean = 0;
+		if(!lex_is_ident(c)) ident = 0;
+	}
+	
+	return (clean ? JSON_STR_CLEAN : 0) | (hi & 0x80 ? 0 : JSON_STR_ASCII) | (ident ? JSON_STR_IDENT : 0);
+}
+
+
+
+// reads exactly 4 hex digits. returns -1 if any of them is invalid.
+static int32_t decode_hex4(char* s) {
+	unsigned a = lex_hex_table[(unsigned char)s[0]];
+	unsigned b = lex_hex_table[(unsigned char)s[1]];
+	unsigned c = lex_hex_table[(unsigned char)s[2]];
+	unsigned d = lex_hex_table[(unsigned char)s[3]];
+	
+	if(!(a & b & c & d & 0x10)) return -1;
+	
+	return ((a & 0xf) << 12) | ((b & 0xf) << 8) | ((c & 0xf) << 4) | (d & 0xf);
+}
+
+
+// out must be at least len+1 bytes. no escape decodes to more bytes than it occupies.
+// appends a null to out, but is also null-safe
+// strict only accepts the escapes in RFC 8259 and rejects unpaired surrogates;
+//   relaxed mode replaces them with U+FFFD.
+static JSON_ALWAYS_INLINE int decode_c_escape_str(char* in, char* out, size_t len, size_t* outLen, int strict) {
+	char* end = in + len;
+	char* o = out;
+	unsigned h;
+	int32_t code, low;
+	int n;
+	
+	while(in < end) {
+		if(*in != '\\') {
+			*o++ = *in++;
+			continue;
+		}
 		
+		in++;
+		if(in >= end) return 1;
 		
-		if(*se == delim && *(se-1) != '\\') break;
-		if(*se == '\0') {
-			jl->error = JSON_LEX_ERROR_NULL_IN_STRING;
-			return 1;
+		if(strict && !lex_is_escape(*in)) return 4;
+		
+		switch(*in++) {
+			case '0': *o++ = '\0'; break; 
+			case 'r': *o++ = '\r'; break; 
+			case 'n': *o++ = '\n'; break;
+			case 'f': *o++ = '\f'; break;
+			case 'a': *o++ = '\a'; break;
+			case 'b': *o++ = '\b'; break;
+			case 'v': *o++ = '\v'; break;
+			case 't': *o++ = '\t'; break;
+			
+			case 'x': // one or two digits
+				if(in >= end || !(h = lex_hex_table[(unsigned char)*in])) {
+					// malformed hex code. output an 'x' and keep going.
+					*o++ = 'x';
+					break;
+				}
+				
+				code = h & 0xf;
+				in++;
+				
+				if(in < end && (h = lex_hex_table[(unsigned char)*in])) {
+					code = (code << 4) | (h & 0xf);
+					in++;
+				}
+				
+				*o++ = code;
+				break;
+			
+			case 'u':
+				if(!strict && in < end && *in == '{') { // \u{1F600}
+					in++;
+					for(code = 0, n = 0; in < end && (h = lex_hex_table[(unsigned char)*in]); in++, n++) {
+						if(n < 8) code = (code << 4) | (h & 0xf);
+					}
+					
+					if(in >= end || *in != '}') return 3;
+					in++;
+					
+					if(n > 6 || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff)) code = 0xfffd;
+				}
+				else if(end - in >= 4 && (code = decode_hex4(in)) >= 0) {
+					in += 4;
+					
+					if(code >= 0xd800 && code <= 0xdbff) { // high surrogate; the low half must follow
+						if(end - in >= 6 && in[0] == '\\' && in[1] == 'u' 
+							&& (low = decode_hex4(in + 2)) >= 0xdc00 && low <= 0xdfff
+						) {
+							code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+							in += 6;
+						}
+						else if(strict) return 5;
+						else code = 0xfffd;
+					}
+					else if(code >= 0xdc00 && code <= 0xdfff) { // lone low surrogate
+						if(strict) return 5;
+						code = 0xfffd;
+					}
+				}
+				else {
+					if(strict) return 4;
+					
+					// relaxed mode takes up to 4 digits
+					for(code = 0, n = 0; n < 4 && in < end && (h = lex_hex_table[(unsigned char)*in]); in++, n++) {
+						code = (code << 4) | (h & 0xf);
+					}
+				}
+				
+				o += utf8_encode(code, o);
+				break;
+				
+			default:
+				// pass-through
+				*o++ = in[-1];
+		}
+	}
+	
+	*o = '\0';
+	if(outLen) *outLen = o - out; 
+	
+	return 0;
+}
+
+
+
+
+///////////////////
+//    Parser     //
+///////////////////
+
+
+// GCC and clang can dispatch through a table of label addresses, which
+//   saves the bounds check and jump table load of a switch.
+#if !defined(JSON_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+	#define JSON_COMPUTED_GOTO 1
+#endif
+
+
+// 1-based column of the lexer head. only needed for error messages,
+//   so it is derived on demand rather than tracked per byte.
+static int lex_char_num(struct json_parser* jl) {
+	return (int)(jl->head - jl->line_start) + 1;
+}
+
+
+// returns erro code.
+static int lex_push_token_val(struct json_parser* jp, enum token_type t, struct json_value* val) {
+	
+	jp->cur_tok.tokenType = t;
+	jp->cur_tok.val = val;
+	jp->cur_tok.str = NULL;
+	jp->cur_tok.len = 0;
+	jp->cur_tok.src = jp->head;
+	jp->cur_tok.src_len = 1;
+	
+	dbg_printf("pushing token %d at %d, %d\n", t, jp->line_num, lex_char_num(jp));
+	
+	return 0;
+}
+
+
+
+// returns error code. val set to null
+static int lex_push_token(struct json_parser* jl, enum token_type t) {
+	return lex_push_token_val(jl, t, NULL);
+}
+
+// the token takes ownership of str
+static int lex_push_token_str(struct json_parser* jl, enum token_type t, char* str, size_t len) {
+	lex_push_token_val(jl, t, NULL);
+	jl->cur_tok.str = str;
+	jl->cur_tok.len = len;
+	jl->cur_tok.str_flags = 0;
+	return 0;
+}
+
+// literals don't allocate anything; the source text is used if it's needed as a key
+static int lex_push_token_literal(struct json_parser* jl, enum token_type t, size_t len) {
+	lex_push_token_val(jl, t, NULL);
+	jl->cur_tok.src_len = len;
+	return 0;
+}
+
+
+/*
+Token lexers are entered with jl->head on the first character of the token
+and leave it on the first character after the token. They set jl->error
+and return nonzero on failure.
+*/
+
+// returns the first character that needs a closer look: the delimiter, a backslash,
+//   or anything the mode doesn't allow raw. the high bits of every byte passed over
+//   are or'd into seen so the utf-8 check can be skipped for plain ascii strings.
+//   relaxed mode also notes raw control chars and '"' there as LEX_SEEN_CTRL.
+#define LEX_SEEN_CTRL 0x100
+static JSON_ALWAYS_INLINE char* lex_string_scan(char* se, char* end, char delim, int strict, unsigned* seen) {
+	unsigned char special = strict ? LEX_F_STR_STRICT : LEX_F_STR_SPECIAL;
+	unsigned na = 0;
+	unsigned char fl = 0;
+	
+#ifdef JSON_SSE2
+	__m128i q = _mm_set1_epi8(delim);
+	__m128i bs = _mm_set1_epi8('\\');
+	__m128i nl = _mm_set1_epi8('\n');
+	__m128i ctrl = _mm_set1_epi8(0x1f);
+	__m128i dq = _mm_set1_epi8('"');
+	__m128i zero = _mm_setzero_si128();
+	__m128i hi = zero;
+	
+	// only whole blocks before the end of the buffer are loaded
+	while(end - se >= 16) {
+		__m128i c = _mm_loadu_si128((__m128i*)se);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(c, q), _mm_cmpeq_epi8(c, bs));
+		__m128i lt = _mm_cmpeq_epi8(_mm_max_epu8(c, ctrl), ctrl); // c <= 0x1f
+		int mask, ltmask = 0;
+		
+		if(strict) m = _mm_or_si128(m, lt);
+		else {
+			m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(c, nl), _mm_cmpeq_epi8(c, zero)));
+			ltmask = _mm_movemask_epi8(_mm_or_si128(lt, _mm_cmpeq_epi8(c, dq)));
 		}
 		
-		if(*se == '\n') {
-			lines++;
-			char_num = 1;
+		// bytes past the stop get counted too. at worst that validates an ascii string.
+		hi = _mm_or_si128(hi, c);
+		
+		mask = _mm_movemask_epi8(m);
+		if(mask) {
+			// but not for control chars or quotes; a newline after the closing quote is normal
+			if(ltmask & ((mask & -mask) - 1)) fl = LEX_F_STR_STRICT;
+			se += __builtin_ctz(mask);
+			break;
 		}
+		if(ltmask) fl = LEX_F_STR_STRICT;
+		
+		se += 16;
+	}
+	
+	na = _mm_movemask_epi8(hi) ? 0x80 : 0;
+#endif
+	
+	while(1) {
+		unsigned char f = lex_char_flags[(unsigned char)*se];
+		if(f & special) break;
 		
-		char_num++;
+		na |= (unsigned char)*se;
+		if(!strict) fl |= f;
 		se++;
-	//	printf("%d.%d\n", jl->line_num + lines, char_num);
-		if(se > jl->end) {
-			jl->error = JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT;
+	}
+	
+	// anything strict mode stops on that got this far is a control char
+	*seen |= na | (fl & LEX_F_STR_STRICT ? LEX_SEEN_CTRL : 0);
+	return se;
+}
+
+
+// strict is always a constant; each mode gets its own copy with the other's checks compiled out
+static JSON_ALWAYS_INLINE int lex_string_token(struct json_parser* jl, int strict) {
+	size_t len;
+	char* str;
+	char delim = *jl->head;
+	char* se = jl->head + 1;
+	int has_escapes = 0;
+	int has_quote = 0; // raw '"' or newline in a relaxed string
+	unsigned seen = 0;
+	
+	// find len, count lines
+	while(1) {
+		// skip over ordinary characters
+		se = lex_string_scan(se, jl->end, delim, strict, &seen);
+		
+		if(*se == delim) break;
+		
+		if(strict && *se != '\\') {
+			jl->head = se;
+			jl->error = *se == '\0' && se >= jl->end ? JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT : JSON_LEX_ERROR_INVALID_STRING;
 			return 1;
 		}
+		
+		switch(*se) {
+			case '\\':
+				has_escapes = 1;
+				se++;
+				if(*se == '\0') continue; // reported below
+				if(*se == '\n') {
+					jl->line_num++;
+					jl->line_start = se + 1;
+				}
+				se++;
+				continue;
+			
+			case '\n':
+				has_quote = 1;
+				jl->line_num++;
+				jl->line_start = se + 1;
+				se++;
+				continue;
+			
+			case '\0':
+				jl->head = se;
+				jl->error = se >= jl->end ? JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT : JSON_LEX_ERROR_NULL_IN_STRING;
+				return 1;
+			
+			default: // the other quote characters
+				if(*se == '"') has_quote = 1;
+				se++;
+				continue;
+		}
 	}
 	
 	len = se - jl->head - 1;
 	
-	str = malloc(len+1);
+	// with escapes it's the decoded text that gets checked, below: \xff or a backslash
+	//   before a stray byte make bytes the scan never saw
+	if(jl->validate_utf8 && !has_escapes && (seen & 0x80) && json_utf8_validate(jl->head + 1, len)) {
+		jl->error = JSON_LEX_ERROR_INVALID_UTF8;
+		return 1;
+	}
+	
+	str = json_mem_alloc(len+1);
+	if(!str) {
+		jl->error = JSON_ERROR_OOM;
+		return 1;
+	}
 	
-	if(decode_c_escape_str(jl->head + 1, str, len, NULL)) {
+	if(!has_escapes) {
+		memcpy(str, jl->head + 1, len);
+		str[len] = 0;
+	}
+	else if(decode_c_escape_str(jl->head + 1, str, len, &len, strict)) {
+		json_mem_free(str);
 		jl->error = JSON_LEX_ERROR_INVALID_STRING;
 		return 1;
 	}
+	else if(jl->validate_utf8 && json_utf8_validate(str, len)) {
+		json_mem_free(str);
+		jl->error = JSON_LEX_ERROR_INVALID_UTF8;
+		return 1;
+	}
+	
+	lex_push_token_str(jl, TOKEN_STRING, str, len);
 	
-	// json value
-	val = calloc(1, sizeof(*val));
-	val->type = JSON_TYPE_STRING;
-	val->s = str;
+	// what the serializer would otherwise rescan for. escapes are assumed to need escaping again.
+	if(!has_escapes) {
+		if(!has_quote && !(seen & LEX_SEEN_CTRL)) jl->cur_tok.str_flags |= JSON_STR_CLEAN;
+		if(!(seen & 0x80)) jl->cur_tok.str_flags |= JSON_STR_ASCII;
+	}
 	
-	lex_push_token_val(jl, TOKEN_STRING, val);
+	// advance past the closing quote
+	jl->head = se + 1;
 	
-	// advance to the end of the string
-	jl->head = se;
-	jl->char_num = char_num + 1;
-	jl->line_num += lines;
+	return 0;
+}
+
+
+// RFC 8259 numbers only: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+// advances *sp to the end of the number, or to the offending char and returns 1
+static int lex_scan_number(char** sp, int* is_float) {
+	char* s = *sp;
+	int ret = 1;
+	
+	*is_float = 0;
+	
+	if(*s == '-') s++;
+	
+	if(*s == '0') {
+		s++;
+		// leading zeros would be mistaken for octal in relaxed mode
+		if(lex_is_digit(*s)) goto DONE;
+	}
+	else if(*s >= '1' && *s <= '9') {
+		while(lex_is_digit(*s)) s++;
+	}
+	else goto DONE;
+	
+	if(*s == '.') {
+		*is_float = 1;
+		s++;
+		if(!lex_is_digit(*s)) goto DONE;
+		while(lex_is_digit(*s)) s++;
+	}
+	
+	if(*s == 'e' || *s == 'E') {
+		*is_float = 1;
+		s++;
+		if(*s == '+' || *s == '-') s++;
+		if(!lex_is_digit(*s)) goto DONE;
+		while(lex_is_digit(*s)) s++;
+	}
+	
+	ret = 0;
+DONE:
+	*sp = s;
+	return ret;
+}
+
+
+// lazy_numbers: keep the text, convert on first access
+static int lex_push_number_span(struct json_parser* jl, char* start, char* end, int is_float) {
+	struct json_value* val;
+	
+	val = value_alloc();
+	if(!val) {
+		jl->error = JSON_ERROR_OOM;
+		return 1;
+	}
+	
+	val->type = is_float ? JSON_TYPE_DOUBLE : JSON_TYPE_INT;
+	val->base = is_float ? -1 : 10;
+	val->flags = JSON_NUM_SRC | JSON_NUM_LAZY;
+	val->refs = 0;
+	val->hash = 0;
+	val->len = end - start;
+	val->num.src = start;
 	
+	lex_push_token_val(jl, TOKEN_NUMBER, val);
+	jl->head = end;
 	
 	return 0;
 }
@@ -1023,6 +1954,19 @@ static int lex_number_token(struct json_parser* jl) {
 	int negate =0;
 	int base;
 	
+	if(jl->lazy_numbers) {
+		s = jl->head;
+		if(*s == '+') s++; // not kept in the span
+		start = s;
+		
+		// hex, octal, binary and other oddities fall through to strtol/strtod
+		if(!lex_scan_number(&s, &is_float) && !lex_is_ident(*s) && *s != '.') {
+			return lex_push_number_span(jl, start, s, is_float);
+		}
+		
+		is_float = 0;
+	}
+	
 	start = jl->head;
 	
 	if(*start == '-') negate = 1;
@@ -1035,7 +1979,7 @@ static int lex_number_token(struct json_parser* jl) {
 		if(*s == '.' || *s == 'e' || *s == 'E')
 			is_float = 1;
 		
-		if(*s < '0' || *s > '9') break;
+		if(!lex_is_digit(*s)) break;
 		
 		s++;
 	} 
@@ -1043,7 +1987,15 @@ static int lex_number_token(struct json_parser* jl) {
 	s = start;
 	
 	struct json_value* val;
-	val = malloc(sizeof(*val));
+	val = value_alloc();
+	if(!val) {
+		jl->error = JSON_ERROR_OOM;
+		return 1;
+	}
+	val->len = 0;
+	val->flags = 0;
+	val->refs = 0;
+	val->hash = 0;
 	
 	// read the value
 	if(is_float) {
@@ -1071,16 +2023,19 @@ static int lex_number_token(struct json_parser* jl) {
 		if(negate) val->n *= -1;
 	}
 	
+	// nothing was converted
+	if(e == s) {
+		value_free(val);
+		jl->error = JSON_LEX_ERROR_INVALID_CHAR;
+		return 1;
+	}
+	
 	val->base = base;
 	
 	lex_push_token_val(jl, TOKEN_NUMBER, val);
 	
-	// advance to the end of the string
-	jl->char_num += e - jl->head - 1;
-	jl->head = e - 1;
-	
-//	printf("head %c\n", *jl->head);
-//	printf("lc/line/char [%d/%d/%d]\n", jl->head - jl->source, jl->line_num, jl->char_num);
+	// advance to the end of the number
+	jl->head = e;
 	
 	return 0;
 }
@@ -1088,153 +2043,169 @@ static int lex_number_token(struct json_parser* jl) {
 
 static int lex_label_token(struct json_parser* jl) {
 	size_t len;
-	struct json_value* val;
 	char* str;
 	char* se = jl->head;
 	
-	int char_num = jl->char_num;
-
-	// check for boolean literals
-	// TODO: proper ident char checking
-	if(0 == strncasecmp(se, "true", strlen("true"))) {
-		if(!isalnum(se[strlen("true")]) && se[strlen("true")] != '_') {
-			lex_push_token_val(jl, TOKEN_TRUE, json_new_strn(se, strlen("true")));
-			jl->head += strlen("true") - 1;
-			jl->char_num += strlen("true") - 1;
-			return 0;
-		}
-	}
-	if(0 == strncasecmp(se, "false", strlen("false"))) {
-		if(!isalnum(se[strlen("false")]) && se[strlen("false")] != '_') {
-			lex_push_token_val(jl, TOKEN_FALSE, json_new_strn(se, strlen("false")));
-			jl->head += strlen("false") - 1;
-			jl->char_num += strlen("false") - 1;
-			return 0;
-		}
-	}
-	if(0 == strncasecmp(se, "null", strlen("null"))) {
-		if(!isalnum(se[strlen("null")]) && se[strlen("null")] != '_') {
-			lex_push_token_val(jl, TOKEN_NULL, json_new_strn(se, strlen("null")));
-			jl->head += strlen("null") - 1;
-			jl->char_num += strlen("null") - 1;
-			return 0;
-		}
-	}
-	if(0 == strncasecmp(se, "undefined", strlen("undefined"))) {
-		if(!isalnum(se[strlen("undefined")]) && se[strlen("undefined")] != '_') {
-			lex_push_token_val(jl, TOKEN_UNDEFINED, json_new_strn(se, strlen("undefined")));
-			jl->head += strlen("undefined") - 1;
-			jl->char_num += strlen("undefined") - 1;
-			return 0;
-		}
-	}
-	if(0 == strncasecmp(se, "infinity", strlen("infinity"))) {
-		if(!isalnum(se[strlen("infinity")]) && se[strlen("infinity")] != '_') {
-			lex_push_token_val(jl, TOKEN_INFINITY, json_new_strn(se, strlen("infinity")));
-			jl->head += strlen("infinity") - 1;
-			jl->char_num += strlen("infinity") - 1;
-			return 0;
-		}
-	}
-	
-	//printf("error: %d\n", jl->error);
-	// find len, count lines
-	while(1) {
-		if(!((*se >= 'a' && *se <= 'z')
-			|| (*se >= 'A' && *se <= 'Z')
-			|| (*se >= '0' && *se <= '9')
-			|| *se == '_' || *se == '$')
-		) break;
-		
-		char_num++;
-		se++;
-		//printf("%d.%d\n", jl->line_num, char_num);
-		if(se > jl->end) {
-			jl->error = JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT;
-			return 1;
-		}
-	}
+	// find len
+	while(lex_is_ident(*se)) se++;
 	
 	len = se - jl->head;
-	// TODO: check for null, infinity, undefined, nan
 	
-	str = malloc(len+1);
-	strncpy(str, jl->head, len);
-	str[len] = 0;
+	// check for literals
+#define LITERAL(kw, tok) \
+	if(lex_keyword_eq(jl->head, len, kw, sizeof(kw) - 1)) { \
+		lex_push_token_literal(jl, tok, len); \
+		jl->head = se; \
+		return 0; \
+	}
 	
-	// json value
-	val = calloc(1, sizeof(*val));
-	val->type = JSON_TYPE_STRING;
-	val->s = str;
+	switch(len) {
+		case 4:
+			LITERAL("true", TOKEN_TRUE)
+			LITERAL("null", TOKEN_NULL)
+			break;
+		case 5: LITERAL("false", TOKEN_FALSE) break;
+		case 8: LITERAL("infinity", TOKEN_INFINITY) break;
+		case 9: LITERAL("undefined", TOKEN_UNDEFINED) break;
+	}
+#undef LITERAL
 	
-	lex_push_token_val(jl, TOKEN_LABEL, val);
+	str = json_mem_alloc(len+1);
+	if(!str) {
+		jl->error = JSON_ERROR_OOM;
+		return 1;
+	}
+	memcpy(str, jl->head, len);
+	str[len] = 0;
 	
-	// advance to the end of the string
-	jl->head = se - 1;
-	jl->char_num = char_num - 1;
+	lex_push_token_str(jl, TOKEN_LABEL, str, len);
+	jl->cur_tok.str_flags = JSON_STR_CLEAN | JSON_STR_ASCII | JSON_STR_IDENT;
 	
-	//printf("head %c\n", *jl->head);
-	//printf("lc/line/char [%d/%d/%d]\n", jl->head - jl->source, jl->line_num, jl->char_num);
+	// advance to the end of the label
+	jl->head = se;
 	
 	return 0;
 }
 
 
 
-static int lex_comment_token(struct json_parser* jl) {
-	char* start, *se, *str;
-	char delim;
-	size_t len;
-	int lines, char_num;
+// strict mode numbers
+static int lex_number_token_strict(struct json_parser* jl) {
+	char* s = jl->head;
+	char* digits;
+	int is_float;
+	uint64_t n = 0;
 	struct json_value* val;
 	
-	lex_next_char(jl);
+	if(lex_scan_number(&s, &is_float)) {
+		jl->head = s;
+		jl->error = JSON_LEX_ERROR_INVALID_CHAR;
+		return 1;
+	}
 	
-	start = se = jl->head + 1; 
-	delim = *jl->head;
+	if(jl->lazy_numbers) {
+		return lex_push_number_span(jl, jl->head, s, is_float);
+	}
 	
-	lines = 0;
-	char_num = jl->char_num;
+	val = value_alloc();
+	if(!val) {
+		jl->error = JSON_ERROR_OOM;
+		return 1;
+	}
+	val->len = 0;
+	val->flags = 0;
+	val->refs = 0;
+	val->hash = 0;
 	
-	if(delim == '/') { // single line comment
-		// look for a linebreak;
-		while(1) {
-			if(se[0] == '\n') break;
-			if(*se == '\0') {
-				jl->error = JSON_LEX_ERROR_NULL_BYTE;
-				return 1;
+	if(is_float) {
+		val->type = JSON_TYPE_DOUBLE;
+		val->base = -1;
+		val->d = strtod(jl->head, NULL);
+	}
+	else {
+		val->type = JSON_TYPE_INT;
+		val->base = 10;
+		
+		digits = jl->head + (*jl->head == '-');
+		
+		// 18 digits can't overflow
+		if(s - digits <= 18) {
+			for(; digits < s; digits++) n = n * 10 + (*digits - '0');
+			val->n = *jl->head == '-' ? -(int64_t)n : (int64_t)n;
+		}
+		else val->n = strtoll(jl->head, NULL, 10);
+	}
+	
+	lex_push_token_val(jl, TOKEN_NUMBER, val);
+	jl->head = s;
+	
+	return 0;
+}
+
+
+// strict mode has no labels, just three case-sensitive literals
+static int lex_literal_token_strict(struct json_parser* jl) {
+	char* se = jl->head;
+	size_t len;
+	
+	while(lex_is_ident(*se)) se++;
+	len = se - jl->head;
+	
+	if(len == 4 && !memcmp(jl->head, "true", 4)) lex_push_token_literal(jl, TOKEN_TRUE, len);
+	else if(len == 4 && !memcmp(jl->head, "null", 4)) lex_push_token_literal(jl, TOKEN_NULL, len);
+	else if(len == 5 && !memcmp(jl->head, "false", 5)) lex_push_token_literal(jl, TOKEN_FALSE, len);
+	else {
+		jl->error = JSON_LEX_ERROR_INVALID_CHAR;
+		return 1;
+	}
+	
+	jl->head = se;
+	
+	return 0;
+}
+
+
+// comments are discarded; no token is pushed
+static int lex_comment_token(struct json_parser* jl) {
+	char* se;
+	char delim;
+	
+	delim = jl->head[1];
+	se = jl->head + 2; 
+	
+	if(delim == '/') { // single line comment
+		// the linebreak is left for the whitespace handler
+		while(*se != '\n') {
+			if(*se == '\0') {
+				if(se >= jl->end) break;
+				
+				jl->head = se;
+				jl->error = JSON_LEX_ERROR_NULL_BYTE;
+				return 1;
 			}
 			
-			char_num++;
 			se++;
-			
-			if(se > jl->end) {
-				jl->error = JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT;
-				return 1;
-			}
 		}
 	}
 	else if(delim == '*') { // multline
-		// find len, count lines
 		while(1) {
 			if(se[0] == '*' && se[1] == '/') break;
+			
 			if(*se == '\0') {
-				jl->error = JSON_LEX_ERROR_NULL_BYTE;
+				jl->head = se;
+				jl->error = se >= jl->end ? JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT : JSON_LEX_ERROR_NULL_BYTE;
 				return 1;
 			}
 			
 			if(*se == '\n') {
-				lines++;
-				char_num = 1;
+				jl->line_num++;
+				jl->line_start = se + 1;
 			}
-			char_num++;
-			se++;
 			
-			if(se > jl->end) {
-				jl->error = JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT;
-				return 1;
-			}
+			se++;
 		}
+		
+		se += 2;
 	}
 	else {
 		//printf("JSON: broken comment\n");
@@ -1242,108 +2213,151 @@ static int lex_comment_token(struct json_parser* jl) {
 		return 1;
 	}
 	
-	len = se - jl->head - 1;
-	
-#if JSON_DISCARD_COMMENTS == 0
-	
-	str = malloc(len+1);
-	check_oom(str)
-	
-//	printf("error: %d\n", jl->error);
-	
-	strncpy(str, start, len);
-	
-	
-//printf("error: %d\n", jl->error);
-	// json value
-	val = calloc(1, sizeof(*val));
-	check_oom(val)
-//	printf("error: %d\n", jl->error);
-	val->type = delim == '*' ? JSON_TYPE_COMMENT_MULTI : JSON_TYPE_COMMENT_SINGLE;
-	val->v.str = str;
-	
-	lex_push_token_val(jl, TOKEN_COMMENT, val);
-	
-#endif // JSON_DISCARD_COMMENTS
-	
-	// advance to the end of the string
+	// advance to the end of the comment
 	jl->head = se;
-	jl->char_num = char_num;
-	jl->line_num += lines;
-
-	if(delim == '*') lex_next_char(jl);
-	
-//	printf("--head %c\n", *jl->head);
-//	printf("lc/line/char [%d/%d/%d]\n", jl->head - jl->source, jl->line_num, jl->char_num);
 	
 	return 0;
 }
 
-// returns false when there is no more input
 
-//       formerly lex_nibble()
+// returns false when there is no more input
+// errors are only checked once per token, on the way out
+// strict mode gets its own dispatch table, so the JSON5 handlers are never reached
 static int lex_next_token(struct json_parser* jl) {
+	char* h;
+	
+#ifdef JSON_COMPUTED_GOTO
+	static const void* const relaxed[LEX_CC_MAXVALUE] = {
+		[LEX_CC_INVALID] = &&INVALID,
+		[LEX_CC_END] = &&END,
+		[LEX_CC_SPACE] = &&SPACE,
+		[LEX_CC_SPACE_EXT] = &&SPACE,
+		[LEX_CC_NEWLINE] = &&NEWLINE,
+		[LEX_CC_OBJ_START] = &&OBJ_START,
+		[LEX_CC_OBJ_END] = &&OBJ_END,
+		[LEX_CC_ARRAY_START] = &&ARRAY_START,
+		[LEX_CC_ARRAY_END] = &&ARRAY_END,
+		[LEX_CC_COMMA] = &&COMMA,
+		[LEX_CC_COLON] = &&COLON,
+		[LEX_CC_SLASH] = &&SLASH,
+		[LEX_CC_QUOTE] = &&QUOTE,
+		[LEX_CC_NUMBER] = &&NUMBER,
+		[LEX_CC_IDENT] = &&IDENT,
+	};
+	
+	static const void* const strict[LEX_CC_MAXVALUE] = {
+		[LEX_CC_INVALID] = &&INVALID,
+		[LEX_CC_END] = &&END,
+		[LEX_CC_SPACE] = &&SPACE,
+		[LEX_CC_SPACE_EXT] = &&INVALID,
+		[LEX_CC_NEWLINE] = &&NEWLINE,
+		[LEX_CC_OBJ_START] = &&OBJ_START,
+		[LEX_CC_OBJ_END] = &&OBJ_END,
+		[LEX_CC_ARRAY_START] = &&ARRAY_START,
+		[LEX_CC_ARRAY_END] = &&ARRAY_END,
+		[LEX_CC_COMMA] = &&COMMA,
+		[LEX_CC_COLON] = &&COLON,
+		[LEX_CC_SLASH] = &&INVALID,
+		[LEX_CC_QUOTE] = &&STRICT_QUOTE,
+		[LEX_CC_NUMBER] = &&STRICT_NUMBER,
+		[LEX_CC_IDENT] = &&STRICT_IDENT,
+	};
+	
+	const void* const* dispatch = jl->strict ? strict : relaxed;
+	
+	#define DISPATCH() goto *dispatch[lex_char_class[(unsigned char)*jl->head]]
+#else
+	#define DISPATCH() goto SWITCH
+#endif
+
+#define SINGLE(tok) lex_push_token(jl, tok); jl->head++; goto DONE;
 	
+	DISPATCH();
 	
-	jl->gotToken = 0;
+#ifndef JSON_COMPUTED_GOTO
+SWITCH:
+	switch(lex_char_class[(unsigned char)*jl->head]) {
+		default:
+		case LEX_CC_INVALID: goto INVALID;
+		case LEX_CC_END: goto END;
+		case LEX_CC_SPACE: goto SPACE;
+		case LEX_CC_SPACE_EXT: if(jl->strict) goto INVALID; goto SPACE;
+		case LEX_CC_NEWLINE: goto NEWLINE;
+		case LEX_CC_OBJ_START: goto OBJ_START;
+		case LEX_CC_OBJ_END: goto OBJ_END;
+		case LEX_CC_ARRAY_START: goto ARRAY_START;
+		case LEX_CC_ARRAY_END: goto ARRAY_END;
+		case LEX_CC_COMMA: goto COMMA;
+		case LEX_CC_COLON: goto COLON;
+		case LEX_CC_SLASH: if(jl->strict) goto INVALID; goto SLASH;
+		case LEX_CC_QUOTE: if(jl->strict) goto STRICT_QUOTE; goto QUOTE;
+		case LEX_CC_NUMBER: if(jl->strict) goto STRICT_NUMBER; goto NUMBER;
+		case LEX_CC_IDENT: if(jl->strict) goto STRICT_IDENT; goto IDENT;
+	}
+#endif
 	
-	while(!jl->gotToken) {
-		char c = *jl->head;
+SPACE:
+	h = jl->head + 1;
+	while(lex_char_class[(unsigned char)*h] == LEX_CC_SPACE) h++;
+	jl->head = h;
+	DISPATCH();
+	
+NEWLINE:
+	jl->line_num++;
+	jl->line_start = ++jl->head;
+	DISPATCH();
+	
+OBJ_START: SINGLE(TOKEN_OBJ_START)
+OBJ_END: SINGLE(TOKEN_OBJ_END)
+ARRAY_START: SINGLE(TOKEN_ARRAY_START)
+ARRAY_END: SINGLE(TOKEN_ARRAY_END)
+COMMA: SINGLE(TOKEN_COMMA)
+COLON: SINGLE(TOKEN_COLON)
+	
+SLASH:
+	if(lex_comment_token(jl)) goto DONE;
+	DISPATCH();
+	
+QUOTE:
+	lex_string_token(jl, 0);
+	goto DONE;
+	
+NUMBER:
+	lex_number_token(jl);
+	goto DONE;
+	
+IDENT:
+	lex_label_token(jl);
+	goto DONE;
+	
+STRICT_QUOTE:
+	if(*jl->head != '"') goto INVALID;
+	lex_string_token(jl, 1);
+	goto DONE;
+	
+STRICT_NUMBER:
+	lex_number_token_strict(jl);
+	goto DONE;
+	
+STRICT_IDENT:
+	lex_literal_token_strict(jl);
+	goto DONE;
+	
+END: // the source is terminated with a null byte
+	lex_push_token(jl, TOKEN_NONE);
+	jl->eoi = 1;
+	return 1;
 	
-		switch(c) {
-			case '{': lex_push_token(jl, TOKEN_OBJ_START); break;
-			case '}': lex_push_token(jl, TOKEN_OBJ_END); break;
-			case '[': lex_push_token(jl, TOKEN_ARRAY_START); break;
-			case ']': lex_push_token(jl, TOKEN_ARRAY_END); break;
-			case ',': lex_push_token(jl, TOKEN_COMMA); break;
-			case ':': lex_push_token(jl, TOKEN_COLON); break;
-			
-			case '/': lex_comment_token(jl); break;
-			
-			case '\'':
-			case '"':
-			case '`':
-				lex_string_token(jl);
-				break;
-			
-			case '0': case '1': case '2': case '3': case '4': 
-			case '5': case '6': case '7': case '8': case '9':
-			case '-': case '+': case '.':
-				lex_number_token(jl);
-				break;
-			
-			case ' ':
-			case '\t':
-			case '\r':
-			case '\f':
-			case '\v':
-			case '\n':
-				break;
-				
-			default:
-				if(isalpha(c) || c == '_' || c == '$') {
-					lex_label_token(jl);
-					break;
-				}
-				
-				if(c == 0) {
-					lex_push_token(jl, TOKEN_NONE);
-					return 1; // end of file
-				}
-				
-				// lex error
-//				printf("Lexed invalid char: '%c'\n", c);
-				lex_push_token(jl, TOKEN_NONE);
-				jl->error = JSON_LEX_ERROR_INVALID_CHAR;
-				return 1;
-		}
-		
-		//printf("lol\n");
-		
-		lex_next_char(jl);
-	}
+INVALID:
+//	printf("Lexed invalid char: '%c'\n", c);
+	lex_push_token(jl, TOKEN_NONE);
+	jl->error = JSON_LEX_ERROR_INVALID_CHAR;
+	return 1;
+
+#undef SINGLE
+#undef DISPATCH
 	
-	//printf("token %d:%d ", jl->line_num, jl->char_num);
+DONE:
 	dbg_print_token(&jl->cur_tok);
 	
 	jl->eoi = jl->head >= jl->end;
@@ -1352,6 +2366,7 @@ static int lex_next_token(struct json_parser* jl) {
 	return jl->eoi;
 }
 
+
 static int parser_indent_level = 0;
 static void dbg_parser_indent(void) { return;
 	int i;
@@ -1361,8 +2376,11 @@ static void dbg_parser_indent(void) { return;
 }
 
 
-static void parser_push(struct json_parser* jp, struct json_value* v) {
+// the new container becomes the current frame. it has already been
+//   appended to its parent, so nothing needs to happen when it closes.
+static void parser_push(struct json_parser* jp, struct json_value* container) {
 	void* tmp;
+	struct json_parse_frame* f;
 	
 	int alloc = jp->stack_alloc;
 	int cnt = jp->stack_cnt;
@@ -1371,7 +2389,7 @@ static void parser_push(struct json_parser* jp, struct json_value* v) {
 	if(cnt >= alloc) {
 		if(alloc == 0) alloc = 16;
 		alloc *= 2;
-		tmp = realloc(jp->stack, alloc * sizeof(*(jp->stack)));
+		tmp = json_mem_realloc(jp->stack, alloc * sizeof(*(jp->stack)));
 		if(!tmp) {
 			jp->error = JSON_ERROR_OOM;
 			return;
@@ -1381,10 +2399,13 @@ static void parser_push(struct json_parser* jp, struct json_value* v) {
 		jp->stack_alloc = alloc;
 	}
 	
-	jp->stack[cnt] = v;
+	f = &jp->stack[cnt];
+	f->container = container;
+	f->key = NULL;
 	jp->stack_cnt++;
 }
 
+// returns the container of the new top frame, or NULL when the root was closed
 static struct json_value* parser_pop(struct json_parser* jp) {
 	
 	if(jp->stack_cnt <= 0) {
@@ -1392,483 +2413,394 @@ static struct json_value* parser_pop(struct json_parser* jp) {
 		return NULL;
 	}
 	
-	return jp->stack[--jp->stack_cnt];
+	jp->stack_cnt--;
+	
+	if(jp->stack_cnt == 0) return NULL;
+	return jp->stack[jp->stack_cnt - 1].container;
 }
 
-static void parser_push_new_array(struct json_parser* jp) {
-	
-	struct json_value* val;
+
+// appends v straight into the current container, using the pending key for objects
+static void parser_append(struct json_parser* jp, struct json_value* v) {
+	struct json_parse_frame* f;
+	struct json_value* old;
 	
-	val = malloc(sizeof(*val));
-	if(!val) {
+	if(!v) {
 		jp->error = JSON_ERROR_OOM;
 		return;
 	}
 	
-	val->type = JSON_TYPE_ARRAY;
-	val->len = 0;
-	val->base = 0;
-	val->arr.head = NULL;
-	val->arr.tail = NULL;
-	
-	parser_push(jp, val);
-}
-
-static void parser_push_new_object(struct json_parser* jp) {
+	if(jp->stack_cnt == 0) {
+		jp->root = v;
+		return;
+	}
 	
-	struct json_value* val;
+	f = &jp->stack[jp->stack_cnt - 1];
 	
-	val = json_new_object(8);
-	if(!val) {
-		jp->error = JSON_ERROR_OOM;
+	if(f->container->type == JSON_TYPE_ARRAY) {
+		if(json_array_push_tail(f->container, v)) {
+			json_free(v);
+			jp->error = JSON_ERROR_OOM;
+		}
 		return;
 	}
 	
+	if(!f->key) {
+		json_free(v);
+		jp->error = JSON_PARSER_ERROR_CORRUPT_STACK;
+		return;
+	}
 	
-// 	printf("vt: %d\n", val);
-	dbg_dump_stack(jp, 3);
-	parser_push(jp, val);
-	dbg_dump_stack(jp, 4);
-}
-
-
-// not used atm. comments will probably be moved to a side channel
-static void consume_comments(struct json_parser* jp) {
-	while(1) {
-		if(jp->cur_tok.tokenType != TOKEN_COMMENT) break;
-		
-		parser_push(jp, jp->cur_tok.val);
-		lex_next_token(jp);
+	// the object takes ownership of the key. the last of duplicate keys wins.
+	if(obj_set_key_flags(f->container, f->key, f->key_len, f->key_flags, v, &old)) {
+		json_mem_free(f->key);
+		json_free(v);
+		jp->error = JSON_ERROR_OOM;
 	}
+	else json_free(old);
+	f->key = NULL;
 }
 
-static void consume_commas(struct json_parser* jp) {
-//	lex_next_token(jp);
-	while(jp->cur_tok.tokenType == TOKEN_COMMA) lex_next_token(jp);
-}
 
-static void reduce_array(struct json_parser* jp) {
-	/* what the stack should look like now
-	  ...
-	1 array
-	0 any value
+// takes ownership of the current token's string, or copies the literal text
+static char* parser_take_str(struct json_parser* jp, size_t* len) {
+	char* s = jp->cur_tok.str;
 	
-	*/
-	
-	if(jp->stack_cnt < 2) {
-		dbg_printf("stack too short in reduce_array: %d \n", jp->stack_cnt);
-		jp->error = JSON_PARSER_ERROR_STACK_EXHAUSTED;
-		return;
+	if(s) {
+		jp->cur_tok.str = NULL;
+		*len = jp->cur_tok.len;
+		return s;
 	}
 	
-	struct json_value** st = jp->stack + jp->stack_cnt - 1; 
-	struct json_value* v = st[0];
-	struct json_value* arr = st[-1];
+	*len = jp->cur_tok.src_len;
+	return json_memdup(jp->cur_tok.src, jp->cur_tok.src_len);
+}
+
+
+// JSON_STR_* for the current token as an object key. only keys care about IDENT.
+static unsigned int parser_key_flags(struct json_parser* jp) {
+	struct token* t = &jp->cur_tok;
+	unsigned int flags;
+	size_t i;
 	
-	if(arr == ROOT_VALUE) return;
+	// labels and literals are identifiers already
+	if(t->tokenType != TOKEN_STRING) return JSON_STR_CLEAN | JSON_STR_ASCII | JSON_STR_IDENT;
 	
-	if(arr->type != JSON_TYPE_ARRAY) {
-		jp->error = JSON_PARSER_ERROR_CORRUPT_STACK;
-		return;
+	flags = t->str_flags;
+	if((flags & JSON_STR_CLEAN) && t->len > 0 && !lex_is_digit(t->str[0])) {
+		for(i = 0; i < t->len && lex_is_ident(t->str[i]); i++);
+		if(i == t->len) flags |= JSON_STR_IDENT;
 	}
-	// append v to arr
-	json_array_push_tail(arr, v);
 	
-	jp->stack_cnt--;
+	return flags;
 }
 
-static void reduce_object(struct json_parser* jp) {
-	/* what the stack should look like now
-	  ...
-	2 object
-	1 label
-	0 any value
-	
-	*/
-	if(jp->stack_cnt < 3) {
-		jp->error = JSON_PARSER_ERROR_STACK_EXHAUSTED;
-		return;
-	}
-	
-	struct json_value** st = jp->stack + jp->stack_cnt - 1; 
-	struct json_value* v = st[0];
-	struct json_value* l = st[-1];
-	struct json_value* obj = st[-2];
-	
-	if(obj == ROOT_VALUE) return;
+
+// creates a value out of a scalar token. returns NULL if the token is not a scalar.
+static struct json_value* parser_scalar_value(struct json_parser* jp) {
+	struct json_value* v;
 	
-	// TODO: check label type
-	dbg_dump_stack(jp, 10);
-	if(obj->type != JSON_TYPE_OBJ) {// printf("invalid obj\n");
+	switch(jp->cur_tok.tokenType) {
+		case TOKEN_STRING:
+			v = value_alloc();
+			if(!v) return NULL;
+			v->type = JSON_TYPE_STRING;
+			v->base = 0;
+			v->flags = jp->cur_tok.str_flags;
+			v->refs = 0;
+			v->hash = 0;
+			v->s = parser_take_str(jp, &v->len);
+			if(!v->s) {
+				value_free(v);
+				return NULL;
+			}
+			return v;
 		
+		case TOKEN_NUMBER:
+			v = jp->cur_tok.val;
+			jp->cur_tok.val = NULL;
+			return v;
 		
-		dbg_printf("0 type: %d \n", v->type);
-		dbg_printf("1 type: %d \n", l->type);
-		dbg_printf("2 type: %d \n", obj->type);
-		dbg_printf("3 type: %d \n", st[-3]->type);
+		case TOKEN_TRUE: return json_new_true();
+		case TOKEN_FALSE: return json_new_false();
+		case TOKEN_NULL: return json_new_null();
+		case TOKEN_UNDEFINED: return json_new_undefined();
+		case TOKEN_INFINITY: return json_new_double(INFINITY);
+		case TOKEN_NAN: return json_new_double(NAN);
 		
-		jp->error = JSON_PARSER_ERROR_CORRUPT_STACK;
-		return;
+		default:
+			return NULL;
 	}
-	
-	// insert l:v into obj
-	json_obj_set_key_nodup(obj, l->s, v);
-	free(l);
-	
-	jp->stack_cnt -= 2;
 }
 
 
-static struct json_parser* parse_token_stream(char* source, size_t len) {
-	
+static void consume_commas(struct json_parser* jp) {
+	while(jp->cur_tok.tokenType == TOKEN_COMMA) lex_next_token(jp);
+}
+
+
+static void parser_cleanup_failed(struct json_parser* jp) {
 	int i;
-	struct json_parser* jp;
 	
-	jp = calloc(1, sizeof(*jp));
-	if(!jp) {
-		return NULL;
+	// every open container has already been linked into the root
+	for(i = 0; i < jp->stack_cnt; i++) {
+		if(jp->stack[i].key) json_mem_free(jp->stack[i].key);
 	}
+	jp->stack_cnt = 0;
 	
-	jp->source = source;
-	jp->end = source + len;
-	jp->source_len = len;
-	
-	jp->head = source;
-	jp->line_num = 1; // these are 1-based
-	jp->char_num = 1;
+	if(jp->cur_tok.str) json_mem_free(jp->cur_tok.str);
+	if(jp->cur_tok.val) json_free(jp->cur_tok.val);
+	jp->cur_tok.str = NULL;
+	jp->cur_tok.val = NULL;
 	
-	i = 0;
+	json_free(jp->root);
+	jp->root = NULL;
+}
 
-#define next() lex_next_token(jp); //) goto UNEXPECTED_EOI;
-#define is_end() if(jp->eoi) goto UNEXPECTED_EOI;
 
-	// the root value sentinel helps a few algorithms and marks a proper end of input
-	parser_push(jp, ROOT_VALUE);
+/*
+The stack holds one frame per open container. Every value, including
+new containers, is appended to the container in the top frame as soon
+as it is seen; closing a container just pops its frame.
+
+strict is always a constant. Relaxed mode tolerates missing, repeated
+and trailing commas; strict mode follows the RFC 8259 grammar exactly.
+*/
+static JSON_ALWAYS_INLINE void parse_token_stream_impl(struct json_parser* jp, int strict) {
 	
+	struct json_value* v;
+
+#define next() do { lex_next_token(jp); if(jp->error) goto ERROR; } while(0)
+
 	// get the first token
-	lex_next_token(jp);
-	if(jp->cur_tok.tokenType == TOKEN_OBJ_START) {
-		parser_push_new_object(jp);
-		next();
-		goto PARSE_OBJ;
-	} else if(jp->cur_tok.tokenType == TOKEN_ARRAY_START) {
-		parser_push_new_array(jp);
-		next();
-		goto PARSE_ARRAY;
-	}
-	
-	PARSE_ARRAY: // not actually starting with an array; this is just the type probing code
-		dbg_parser_indent();
-		dbg_printf("\nparse_array l:%d, c:%d \n", jp->line_num, jp->char_num);
-		
-		
-		// if(jp->eoi) goto CHECK_END;
-		if(jp->cur_tok.tokenType == TOKEN_ARRAY_END) {
-			dbg_parser_indent();dbg_printf("array- TOKEN_ARR_END l:%d, c:%d \n", jp->line_num, jp->char_num);
-			parser_indent_level--;
-			/* what the stack should look like now
-				...
-				3 parent container 
-				2 ? possibly a label ?
-				1 -- resume sentinel --
-				0 array to be closed
-			*/
-			{
-				// TODO check stack depth
-				struct json_value* closed = parser_pop(jp);
-				struct json_value* sentinel = parser_pop(jp);
-				
-				// put the closed array back on the stack then reduce it appropriately
-				parser_push(jp, closed);
-				if(sentinel == RESUME_ARRAY) {
-					reduce_array(jp);
-					
-					next();
-//					consume_commas(jp);
-					goto PARSE_ARRAY;
-				}
-				else if(sentinel == RESUME_OBJ) {
-					reduce_object(jp);
-					
-					next();
-//					consume_commas(jp);
-					goto PARSE_OBJ;
-				}
-				else if(sentinel == ROOT_VALUE) {
-					// proper finish
-					goto END;
-				}
-				else {
-					goto INVALID_SENTINEL;
-				}
-			}
-			
-			dbg_printf("ending array in begining of array\n");
-			goto UNEXPECTED_TOKEN;
-		}
+	next();
 	
-		// cycle: val, comma
+	PARSE_VALUE: // cur_tok must be a value
 		switch(jp->cur_tok.tokenType) {
-		
-			case TOKEN_ARRAY_START: dbg_parser_indent();dbg_printf("TOKEN_ARRAY_START l:%d, c:%d \n", jp->line_num, jp->char_num);
+			case TOKEN_ARRAY_START: dbg_parser_indent();dbg_printf("TOKEN_ARRAY_START l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
 				parser_indent_level++;
-				parser_push(jp, RESUME_ARRAY);
-				parser_push_new_array(jp);
+				v = json_new_array();
+				parser_append(jp, v);
+				if(jp->error) goto ERROR;
+				parser_push(jp, v);
 				next();
 				goto PARSE_ARRAY;
-				
-			case TOKEN_ARRAY_END: dbg_parser_indent();dbg_printf("TOKEN_ARRAY_END l:%d, c:%d \n", jp->line_num, jp->char_num);
-			parser_indent_level--;
-				/* what the stack should look like now
-					...
-					3 parent container 
-					2 ? possibly a label ?
-					1 -- resume sentinel --
-					0 array to be closed
-				*/
-				{
-					// TODO check stack depth
-					struct json_value* closed = parser_pop(jp);
-					struct json_value* sentinel = parser_pop(jp);
-					
-					// put the closed array back on the stack then reduce it appropriately
-					parser_push(jp, closed);
-					
-					if(sentinel == RESUME_ARRAY) {
-						reduce_array(jp);
-						
-//						consume_commas(jp);
-						next();
-						goto PARSE_ARRAY;
-					}
-					else if(sentinel == RESUME_OBJ) {
-						reduce_object(jp);
-						
-//						consume_commas(jp);
-						next();
-						goto PARSE_OBJ;
-					}
-					else if(sentinel == ROOT_VALUE) {
-						// proper finish
-						goto END;
-					}
-					else {
-						goto INVALID_SENTINEL;
-					}
-				}
-//				consume_commas(jp);
-//				next();
-				break;
 			
-			case TOKEN_OBJ_START: dbg_parser_indent();dbg_printf("PARSE_OBJ l:%d, c:%d \n", jp->line_num, jp->char_num);
+			case TOKEN_OBJ_START: dbg_parser_indent();dbg_printf("TOKEN_OBJ_START l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
 				parser_indent_level++;
-				parser_push(jp, RESUME_ARRAY);
-				parser_push_new_object(jp);
+				v = json_new_object(8);
+				parser_append(jp, v);
+				if(jp->error) goto ERROR;
+				parser_push(jp, v);
 				next();
 				goto PARSE_OBJ;
-				
-			case TOKEN_STRING:
-			case TOKEN_NUMBER:
-			case TOKEN_NULL:
-			case TOKEN_UNDEFINED: dbg_parser_indent();dbg_printf("PARSE VALUE l:%d, c:%d \n", jp->line_num, jp->char_num);
-				parser_push(jp, jp->cur_tok.val);
-				reduce_array(jp);
-				
-//				consume_commas(jp);
-				next();
-				
-				goto PARSE_ARRAY;
-		
-			case TOKEN_OBJ_END: dbg_parser_indent();dbg_printf("BRACKET_MISMATCH l:%d, c:%d \n", jp->line_num, jp->char_num);
-				goto BRACKET_MISMATCH;
 			
-			case TOKEN_COMMA:
-				next();
-				goto PARSE_ARRAY;
+			case TOKEN_ARRAY_END: goto BRACE_MISMATCH;
+			case TOKEN_OBJ_END: goto BRACKET_MISMATCH;
 			
 			case TOKEN_NONE:
-			case TOKEN_LABEL:
-			case TOKEN_COLON: 
-			default: dbg_printf("UNEXPECTED_TOKEN l:%d, c:%d \n", jp->line_num, jp->char_num);
-				// invalid
-				goto UNEXPECTED_TOKEN;
+				goto UNEXPECTED_EOI;
+			
+			default: dbg_parser_indent();dbg_printf("PARSE VALUE l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
+				v = parser_scalar_value(jp);
+				if(!v) goto UNEXPECTED_TOKEN;
+				
+				parser_append(jp, v);
+				if(jp->error) goto ERROR;
+				
+				// a scalar root value is the whole document
+				if(jp->stack_cnt == 0) goto ROOT_DONE;
+				
+				goto CONTAINER_NEXT;
 		}
 	
-		return NULL;
-	
-	PARSE_OBJ:
-		dbg_parser_indent();dbg_printf("\nparse_obj l:%d, c:%d \n", jp->line_num, jp->char_num);
-	// cycle: label, colon, val, comma
-		consume_commas(jp);
-	
-		if(jp->cur_tok.tokenType == TOKEN_OBJ_END) {
-			dbg_parser_indent();dbg_printf("obj- TOKEN_OBJ_END l:%d, c:%d \n", jp->line_num, jp->char_num);
-			parser_indent_level--;
-			/* what the stack should look like now
-				...
-				3 parent container 
-				2 ? possibly a label ?
-				1 -- resume sentinel --
-				0 object to be closed
-			*/
-			{
-				// TODO check stack depth
-				struct json_value* closed = parser_pop(jp);
-				struct json_value* sentinel = parser_pop(jp);
-				
-				// put the closed array back on the stack then reduce it appropriately
-				parser_push(jp, closed);
-				if(sentinel == RESUME_ARRAY) {
-					reduce_array(jp);
-					
-					next();
-//					consume_commas(jp);
-					goto PARSE_ARRAY;
-				}
-				else if(sentinel == RESUME_OBJ) {
-					reduce_object(jp);
-					
-					next();
-//					consume_commas(jp);
-					goto PARSE_OBJ;
-				}
-				else if(sentinel == ROOT_VALUE) {
-					// proper finish
-					goto END;
-				}
-				else {
-					goto INVALID_SENTINEL;
-				}
-			}
-			
-			dbg_printf("ending obj in begining of obj\n");
-			goto UNEXPECTED_TOKEN;
+	PARSE_ARRAY: // first element, or any element in relaxed mode
+		dbg_parser_indent();dbg_printf("\nparse_array l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
+		if(!strict) {
+			consume_commas(jp);
+			if(jp->error) goto ERROR;
 		}
 		
+		if(jp->cur_tok.tokenType == TOKEN_ARRAY_END) goto CLOSE_CONTAINER;
+		if(jp->cur_tok.tokenType == TOKEN_OBJ_END) goto BRACKET_MISMATCH;
+		
+		goto PARSE_VALUE;
+	
+	PARSE_OBJ: // cycle: label, colon, val, comma
+		dbg_parser_indent();dbg_printf("\nparse_obj l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
+		if(!strict) {
+			consume_commas(jp);
+			if(jp->error) goto ERROR;
+		}
 		
 		switch(jp->cur_tok.tokenType) {
+			case TOKEN_OBJ_END: 
+				goto CLOSE_CONTAINER;
+			
 			case TOKEN_LABEL:
-			case TOKEN_STRING:
 			case TOKEN_TRUE:
 			case TOKEN_FALSE:
 			case TOKEN_INFINITY:
 			case TOKEN_NULL:
 			case TOKEN_UNDEFINED:
 			case TOKEN_NAN:
-				parser_push(jp, jp->cur_tok.val);
+				if(strict) goto UNEXPECTED_TOKEN;
+				// fall through
+			case TOKEN_STRING:
+				jp->stack[jp->stack_cnt - 1].key_flags = parser_key_flags(jp);
+				jp->stack[jp->stack_cnt - 1].key = parser_take_str(jp, &jp->stack[jp->stack_cnt - 1].key_len);
+				if(!jp->stack[jp->stack_cnt - 1].key) {
+					jp->error = JSON_ERROR_OOM;
+					goto ERROR;
+				}
 				break;
 			
+			case TOKEN_ARRAY_END:
+				goto BRACE_MISMATCH;
+			
+			case TOKEN_NONE:
+				goto UNEXPECTED_EOI;
+			
 			default:
-				// error
 				dbg_printf("!!!missing label\n");
 				goto UNEXPECTED_TOKEN;
 		}
-		dbg_dump_stack(jp, 5);
 		next();
 		
 		if(jp->cur_tok.tokenType != TOKEN_COLON) {
-			// error
 			dbg_printf("!!!missing colon\n");
 			goto UNEXPECTED_TOKEN;
 		}
 		next();
-
+		
+		goto PARSE_VALUE;
 	
-		switch(jp->cur_tok.tokenType) {
+	CONTAINER_NEXT: // a value was just added to the top container
+		next();
 		
-			case TOKEN_ARRAY_START: dbg_parser_indent();dbg_printf("obj- TOKEN_ARRAY_START l:%d, c:%d \n", jp->line_num, jp->char_num);
-				parser_indent_level++;
-				parser_push(jp, RESUME_OBJ);
-				parser_push_new_array(jp);
-				next();
-				goto PARSE_ARRAY;
-				
-			case TOKEN_OBJ_END: dbg_parser_indent();dbg_printf("obj- !!!TOKEN_OBJ_END in value slot l:%d, c:%d \n", jp->line_num, jp->char_num);
-
-				
-				 dbg_printf("!!! escaped sentinel block\n");
-				break;
+		if(!strict) {
+			if(jp->stack[jp->stack_cnt - 1].container->type == JSON_TYPE_OBJ) goto PARSE_OBJ;
+			goto PARSE_ARRAY;
+		}
+		
+		if(jp->stack[jp->stack_cnt - 1].container->type == JSON_TYPE_OBJ) {
+			if(jp->cur_tok.tokenType == TOKEN_OBJ_END) goto CLOSE_CONTAINER;
+			if(jp->cur_tok.tokenType == TOKEN_ARRAY_END) goto BRACE_MISMATCH;
+			if(jp->cur_tok.tokenType == TOKEN_NONE) goto UNEXPECTED_EOI;
+			if(jp->cur_tok.tokenType != TOKEN_COMMA) goto UNEXPECTED_TOKEN;
 			
-			case TOKEN_OBJ_START: dbg_parser_indent();dbg_printf("obj- TOKEN_OBJ_START l:%d, c:%d \n", jp->line_num, jp->char_num);
-				parser_indent_level++;
-				parser_push(jp, RESUME_OBJ);
-				parser_push_new_object(jp); // BUG
-				next();
-				goto PARSE_OBJ;
-				
-			case TOKEN_STRING:
-			case TOKEN_NUMBER:
-			case TOKEN_TRUE:
-			case TOKEN_FALSE:
-			case TOKEN_INFINITY:
-			case TOKEN_NULL:
-			case TOKEN_UNDEFINED: dbg_parser_indent();dbg_printf("obj- TOKEN VALUE l:%d, c:%d \n", jp->line_num, jp->char_num);
-				parser_push(jp, jp->cur_tok.val);
-				reduce_object(jp);
-				
-				next();
-				consume_commas(jp);
-				
-				goto PARSE_OBJ;
+			next();
+			if(jp->cur_tok.tokenType == TOKEN_OBJ_END) goto UNEXPECTED_TOKEN; // trailing comma
+			goto PARSE_OBJ;
+		}
+		else {
+			if(jp->cur_tok.tokenType == TOKEN_ARRAY_END) goto CLOSE_CONTAINER;
+			if(jp->cur_tok.tokenType == TOKEN_OBJ_END) goto BRACKET_MISMATCH;
+			if(jp->cur_tok.tokenType == TOKEN_NONE) goto UNEXPECTED_EOI;
+			if(jp->cur_tok.tokenType != TOKEN_COMMA) goto UNEXPECTED_TOKEN;
+			
+			next();
+			if(jp->cur_tok.tokenType == TOKEN_ARRAY_END) goto UNEXPECTED_TOKEN; // trailing comma
+			goto PARSE_VALUE;
+		}
+	
+	CLOSE_CONTAINER:
+		dbg_parser_indent();dbg_printf("close container l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
+		parser_indent_level--;
 		
-			case TOKEN_ARRAY_END: dbg_parser_indent();dbg_printf("obj- BRACE_MISMATCH l:%d, c:%d \n", jp->line_num, jp->char_num);
-				goto BRACE_MISMATCH;
-
-			case TOKEN_COMMA: dbg_parser_indent();dbg_printf("obj- eating comma l:%d, c:%d \n", jp->line_num, jp->char_num);
-				next();
-				goto PARSE_OBJ;
-							
-			case TOKEN_NONE:
-			case TOKEN_LABEL:
-			case TOKEN_COLON:
-			default: dbg_printf("obj- UNEXPECTED_TOKEN l:%d, c:%d \n", jp->line_num, jp->char_num);
-				// invalid
-				goto UNEXPECTED_TOKEN;
+		v = parser_pop(jp);
+		if(!v) {
+			// proper finish
+			if(jp->error) goto ERROR;
+			goto ROOT_DONE;
 		}
+		
+		goto CONTAINER_NEXT;
 	
-	dbg_parser_indent();dbg_printf("end of obj\n");
+	ROOT_DONE:
+		// only whitespace may follow the root value
+		if(strict) {
+			next();
+			if(jp->cur_tok.tokenType != TOKEN_NONE) goto UNEXPECTED_TOKEN;
+		}
+		goto END;
 
-	return NULL;
-	
-CHECK_END:  dbg_parser_indent();dbg_printf("!!! CHECK_END l:%d, c:%d \n", jp->line_num, jp->char_num);
-	if(jp->stack_cnt == 2) {
-		// check root value sentinel
-		// good, fall through to END
-	}
-	else if(jp->stack_cnt == 1) {
-		// the file is empty
-		goto UNEXPECTED_EOI;
-	}
-	else {
-		// stuff is left on the stack
-		goto UNEXPECTED_EOI;
-	}
-	//i = *((int*)0);
-END:  dbg_printf("!!! END l:%d, c:%d \n", jp->line_num, jp->char_num);
-	if(jp->error) dbg_printf("parsing error: %d\n", jp->error);
-	return jp;
+#undef next
+
+END:  dbg_printf("!!! END l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
+	return;
 UNEXPECTED_EOI: // end of input
-	dbg_printf("!!! UNEXPECTED_EOI l:%d, c:%d \n", jp->line_num, jp->char_num);
+	dbg_printf("!!! UNEXPECTED_EOI l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
 	jp->error = JSON_PARSER_ERROR_UNEXPECTED_EOI;
-	return jp;
-UNEXPECTED_TOKEN: dbg_printf("!!! UNEXPECTED_TOKEN l:%d, c:%d \n", jp->line_num, jp->char_num);
+	goto ERROR;
+UNEXPECTED_TOKEN: dbg_printf("!!! UNEXPECTED_TOKEN l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
 	jp->error = JSON_PARSER_ERROR_UNEXPECTED_TOKEN;
-	return jp;
-BRACE_MISMATCH: dbg_printf("!!! BRACE_MISMATCH l:%d, c:%d \n", jp->line_num, jp->char_num);
+	goto ERROR;
+BRACE_MISMATCH: dbg_printf("!!! BRACE_MISMATCH l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
 	jp->error = JSON_PARSER_ERROR_BRACE_MISMATCH;
-	return jp;
-BRACKET_MISMATCH: dbg_printf("!!! BRACKET_MISMATCH l:%d, c:%d \n", jp->line_num, jp->char_num);
+	goto ERROR;
+BRACKET_MISMATCH: dbg_printf("!!! BRACKET_MISMATCH l:%d, c:%d \n", jp->line_num, lex_char_num(jp));
 	jp->error = JSON_PARSER_ERROR_BRACKET_MISMATCH;
-	return jp;
-INVALID_SENTINEL: dbg_printf("!!! INVALID_SENTINEL l:%d, c:%d \n", jp->line_num, jp->char_num);
-	jp->error = JSON_PARSER_ERROR_CORRUPT_STACK;
-	return jp;
+	goto ERROR;
+ERROR: 
+	if(jp->error) dbg_printf("parsing error: %d\n", jp->error);
+	parser_cleanup_failed(jp);
+}
+
+static void parse_token_stream_strict(struct json_parser* jp) {
+	parse_token_stream_impl(jp, 1);
+}
+
+static void parse_token_stream_relaxed(struct json_parser* jp) {
+	parse_token_stream_impl(jp, 0);
+}
+
+
+// readies jp for a new parse. the stack is kept from the last one.
+static void parser_reset(struct json_parser* jp, char* source, size_t len, struct json_parse_options* opts) {
+	struct json_parse_frame* stack = jp->stack;
+	int stack_alloc = jp->stack_alloc;
+	
+	if(jp->err_str) json_mem_free(jp->err_str);
+	
+	memset(jp, 0, sizeof(*jp));
+	jp->stack = stack;
+	jp->stack_alloc = stack_alloc;
+	
+	jp->source = source;
+	jp->end = source + len;
+	jp->source_len = len;
+	
+	jp->head = source;
+	jp->line_num = 1; // 1-based
+	jp->line_start = source;
+	
+	jp->strict = opts && opts->strict;
+	jp->validate_utf8 = opts && opts->validate_utf8;
+	jp->lazy_numbers = opts && opts->lazy_numbers;
+}
+
+static void parse_token_stream(struct json_parser* jp, char* source, size_t len, struct json_parse_options* opts) {
+	parser_reset(jp, source, len, opts);
+	
+	if(jp->strict) parse_token_stream_strict(jp);
+	else parse_token_stream_relaxed(jp);
 }
 
 
+
+static struct json_file* parse_string(struct json_parser* jp, char* source, size_t len, struct json_parse_options* opts, void* retained);
+static struct json_file* parse_string_owned(struct json_parser* jp, char* source, size_t len, struct json_parse_options* opts);
+static struct json_file* parse_string_opts(struct json_parser* jp, char* source, size_t len, struct json_parse_options* opts);
+
+
 #ifndef JSON_NO_STDIO
 
 struct json_file* json_load_path(char* path) {
+	return json_load_path_opts(path, NULL);
+}
+
+struct json_file* json_load_path_opts(char* path, struct json_parse_options* opts) {
 	struct json_file* jf;
 	FILE* f;
 	
@@ -1878,7 +2810,7 @@ struct json_file* json_load_path(char* path) {
 		return NULL;
 	}
 	
-	jf = json_read_file(f);
+	jf = json_read_file_opts(f, opts);
 	
 	fclose(f);
 	
@@ -1886,59 +2818,120 @@ struct json_file* json_load_path(char* path) {
 }
 
 struct json_file* json_read_file(FILE* f) {
+	return json_read_file_opts(f, NULL);
+}
+
+struct json_file* json_read_file_opts(FILE* f, struct json_parse_options* opts) {
+	struct json_allocator* prev = NULL;
+	struct json_file* jf = NULL;
 	size_t fsz;
 	char* contents;
-	struct json_file* jf;
 	size_t nr;
 	
+	if(opts && opts->allocator) prev = json_set_thread_allocator(opts->allocator);
+	
 	// check file size
 	fseek(f, 0, SEEK_END);
 	fsz = ftell(f);
 	fseek(f, 0, SEEK_SET);
 	
-	contents = malloc(fsz+1);
-	contents[fsz] = 0; // some crt functions might read past the end otherwise
-	
-	nr = fread(contents, 1, fsz, f);
-
-	jf = json_parse_string(contents, fsz);
+	contents = json_mem_alloc(fsz+1);
+	if(contents) {
+		nr = fread(contents, 1, fsz, f);
+		contents[nr] = 0; // some crt functions might read past the end otherwise
 		
-	free(contents);
+		// the buffer is handed over rather than copied again for lazy_numbers
+		jf = parse_string_owned(NULL, contents, nr, opts);
+	}
+	
+	if(opts && opts->allocator) json_set_thread_allocator(prev);
 	
 	return jf;
 }
 #endif
 
 struct json_file* json_parse_string(char* source, size_t len) {
-	struct json_lexer* jl;
-	struct json_parser* jp;
+	return json_parse_string_opts(source, len, NULL);
+}
+
+struct json_file* json_parse_string_opts(char* source, size_t len, struct json_parse_options* opts) {
+	return parse_string_opts(NULL, source, len, opts);
+}
+
+// jp is a parser to reuse, or NULL
+static struct json_file* parse_string_opts(struct json_parser* jp, char* source, size_t len, struct json_parse_options* opts) {
+	struct json_allocator* prev = NULL;
+	struct json_file* jf = NULL;
+	char* copy;
+	
+	if(opts && opts->allocator) prev = json_set_thread_allocator(opts->allocator);
+	
+	if(!opts || !opts->lazy_numbers) {
+		jf = parse_string(jp, source, len, opts, NULL);
+	}
+	// lazy numbers point into the source, so the json_file needs its own
+	else if((copy = json_mem_alloc(len + 1))) {
+		memcpy(copy, source, len);
+		copy[len] = 0;
+		
+		jf = parse_string_owned(jp, copy, len, opts);
+	}
+	
+	if(opts && opts->allocator) json_set_thread_allocator(prev);
+	
+	return jf;
+}
+
+// takes ownership of source
+static struct json_file* parse_string_owned(struct json_parser* jp, char* source, size_t len, struct json_parse_options* opts) {
 	struct json_file* jf;
 	
-	jp = parse_token_stream(source, len);
-	if(!jp) {
-		//printf("JSON: failed to parse token stream \n");
-		return NULL;
+	// only lazy numbers need the source after parsing
+	if(!opts || !opts->lazy_numbers) {
+		jf = parse_string(jp, source, len, opts, NULL);
+		json_mem_free(source);
+		return jf;
 	}
 	
-	jf = calloc(1, sizeof(*jf));
-	if(!jf) return NULL;
+	jf = parse_string(jp, source, len, opts, source);
+	if(!jf) json_mem_free(source);
+	
+	return jf;
+}
+
+static struct json_file* parse_string(struct json_parser* jp, char* source, size_t len, struct json_parse_options* opts, void* retained) {
+	struct json_parser local = {0};
+	struct json_file* jf;
+	
+	if(!jp) jp = &local;
 	
+	parse_token_stream(jp, source, len, opts);
 	
-	if(jp->stack_cnt == 1) {	
-		jf->root = jp->stack[1];
-		//printf("JSON: failed to parse token stream (2)\n");	
+	jf = json_mem_calloc(1, sizeof(*jf));
+	if(!jf) {
+		json_free(jp->root);
+		jp->root = NULL;
+		if(jp == &local) json_parser_free(jp);
+		return NULL;
 	}
-	// else some sort of error. probably EOI
+	
+	jf->lex_info = retained;
+	jf->allocator = opts ? opts->allocator : NULL;
+	
+	
+	// NULL on error. partial trees are freed by the parser
+	jf->root = jp->root;
+	if(jf->root && opts && opts->intern) jf->root = json_intern(opts->intern, jf->root);
 	
 	jf->error = jp->error;
 	if(jf->error) {
 		jf->error_line_num = jp->line_num;
-		jf->error_char_num = jp->char_num;
+		jf->error_char_num = lex_char_num(jp);
 		jf->error_str = json_get_err_str(jf->error);
 	}
 	
-	json_parser_free(jp);
-	free(jp);
+	jp->root = NULL;
+	if(jp == &local) json_parser_free(jp);
 	
 	//json_dump_value(*jp->stack, 0, 10);
 	//json_dump_value(jf->root, 0, 10);
@@ -1946,6 +2939,83 @@ struct json_file* json_parse_string(char* source, size_t len) {
 }
 
 
+struct json_parser_ctx {
+	struct json_parse_options opts;
+	struct json_parser jp; // kept between parses for its stack
+	
+	enum json_error error;
+	long error_line_num;
+	long error_char_num;
+};
+
+struct json_parser_ctx* json_parser_ctx_new(struct json_parse_options* opts) {
+	struct json_allocator* prev = NULL;
+	struct json_parser_ctx* ctx;
+	
+	if(opts && opts->allocator) prev = json_set_thread_allocator(opts->allocator);
+	
+	ctx = json_mem_calloc(1, sizeof(*ctx));
+	if(ctx && opts) ctx->opts = *opts;
+	
+	if(opts && opts->allocator) json_set_thread_allocator(prev);
+	
+	return ctx;
+}
+
+void json_parser_ctx_free(struct json_parser_ctx* ctx) {
+	struct json_allocator* a, *prev = NULL;
+	
+	if(!ctx) return;
+	
+	if((a = ctx->opts.allocator)) prev = json_set_thread_allocator(a);
+	
+	json_parser_free(&ctx->jp);
+	json_mem_free(ctx);
+	
+	if(a) json_set_thread_allocator(prev);
+}
+
+struct json_file* json_parser_ctx_parse(struct json_parser_ctx* ctx, char* source, size_t len) {
+	struct json_file* jf;
+	
+	jf = parse_string_opts(&ctx->jp, source, len, &ctx->opts);
+	
+	ctx->error = jf ? jf->error : JSON_ERROR_OOM;
+	ctx->error_line_num = jf ? jf->error_line_num : 0;
+	ctx->error_char_num = jf ? jf->error_char_num : 0;
+	
+	return jf;
+}
+
+int json_parser_ctx_parse_value(struct json_parser_ctx* ctx, char* source, size_t len, struct json_value** out) {
+	struct json_parser* jp = &ctx->jp;
+	struct json_allocator* a = ctx->opts.allocator, *prev = NULL;
+	
+	if(a) prev = json_set_thread_allocator(a);
+	
+	parse_token_stream(jp, source, len, &ctx->opts);
+	
+	*out = jp->root;
+	jp->root = NULL;
+	if(*out && ctx->opts.intern) *out = json_intern(ctx->opts.intern, *out);
+	
+	ctx->error = jp->error;
+	ctx->error_line_num = jp->error ? jp->line_num : 0;
+	ctx->error_char_num = jp->error ? lex_char_num(jp) : 0;
+	
+	if(a) json_set_thread_allocator(prev);
+	
+	return ctx->error;
+}
+
+enum json_error json_parser_ctx_error(struct json_parser_ctx* ctx, long* line_num, long* char_num) {
+	if(line_num) *line_num = ctx->error_line_num;
+	if(char_num) *char_num = ctx->error_char_num;
+	
+	return ctx->error;
+}
+
+
 static void free_array(struct json_value* arr) {
 	
 	struct json_link* n, *p;
@@ -1958,7 +3028,7 @@ static void free_array(struct json_value* arr) {
 		p = n;
 		n = n->next;
 		
-		free(p);
+		link_free(p);
 	}
 }
 
@@ -1973,25 +3043,23 @@ static void free_obj(struct json_value* o) {
 		b = &o->obj.buckets[i];
 		if(b->key == NULL) continue;
 		
-		free(b->key);
+		json_mem_free(b->key);
 		json_free(b->value);
 		
 		freed++;
 	}
 	
-	free(o->obj.buckets);
+	buckets_free(o->obj.buckets, o->obj.alloc_size);
 }
 
 
-// must manage v's memory manually
-void json_free(struct json_value* v) {
-	if(!v) return;
-	
+// releases what v points to, but not v itself
+static void free_contents(struct json_value* v) {
 	switch(v->type) {
 		case JSON_TYPE_STRING:
 		case JSON_TYPE_COMMENT_SINGLE:
 		case JSON_TYPE_COMMENT_MULTI:
-			free(v->s);
+			json_mem_free(v->s);
 			break;
 		
 		case JSON_TYPE_OBJ:
@@ -2002,17 +3070,32 @@ void json_free(struct json_value* v) {
 			free_array(v);
 			break;
 	}
+}
+
+// must manage v's memory manually
+void json_free(struct json_value* v) {
+	if(!v) return;
+	
+	// a shared value just loses an owner
+	if(json_atomic_load(&v->refs) && json_atomic_dec(&v->refs) > 0) return;
 	
-	free(v);
+	free_contents(v);
+	value_free(v);
 }
 
 
 void json_file_free(struct json_file* jsf){
+	struct json_allocator* a = jsf->allocator, *prev = NULL;
+	
+	if(a) prev = json_set_thread_allocator(a);
+	
 	json_free(jsf->root);
 	if(jsf->lex_info) {
-		free(jsf->lex_info);
+		json_mem_free(jsf->lex_info);
 	}
-	free(jsf);
+	json_mem_free(jsf);
+	
+	if(a) json_set_thread_allocator(prev);
 }
 
 
@@ -2026,13 +3109,13 @@ static void dbg_print_token(struct token* ts) {
 		tcl(TOKEN_ARRAY_END)
 		tcl(TOKEN_OBJ_START)
 		tcl(TOKEN_OBJ_END)
-		tc(TOKEN_STRING, "%s", ts->val->s)
+		tc(TOKEN_STRING, "%s", ts->str)
 		tc(TOKEN_NUMBER, "%d", (int)ts->val->n)
 		tcl(TOKEN_NULL)
 		tcl(TOKEN_INFINITY)
 		tcl(TOKEN_UNDEFINED)
 		tcl(TOKEN_NAN)
-		tc(TOKEN_LABEL, "%s", ts->val->s)
+		tc(TOKEN_LABEL, "%s", ts->str)
 		tcl(TOKEN_COMMA)
 		tcl(TOKEN_COLON)
 		tc(TOKEN_COMMENT, "%s", ts->val->s)
@@ -2041,25 +3124,13 @@ static void dbg_print_token(struct token* ts) {
 
 
 static void dbg_print_value(struct json_value* v) {
-	if(v == ROOT_VALUE) {
-		dbg_printf("ROOT_VALUE sentinel\n");
-		return;
-	}
-	if(v == RESUME_ARRAY) {
-		dbg_printf("RESUME_ARRAY sentinel\n");
-		return;
-	}
-	if(v == RESUME_OBJ) {
-		dbg_printf("RESUME_OBJ sentinel\n");
-		return;
-	}
-	
 	switch(v->type) {
 		case JSON_TYPE_UNDEFINED: dbg_printf("undefined\n"); break;
 		case JSON_TYPE_NULL: dbg_printf("null\n"); break;
 		case JSON_TYPE_INT: dbg_printf("int: %d\n", (int)v->n); break;
 		case JSON_TYPE_DOUBLE: dbg_printf("double %f\n", v->d); break;
 		case JSON_TYPE_STRING: dbg_printf("string: \"%s\"\n", v->s); break;
+		case JSON_TYPE_BOOL: dbg_printf("bool: %s\n", v->n ? "true" : "false"); break;
 		case JSON_TYPE_OBJ: dbg_printf("object [%d]\n", (int)v->len); break;
 		case JSON_TYPE_ARRAY: dbg_printf("array [%d]\n", (int)v->len); break;
 		case JSON_TYPE_COMMENT_SINGLE: dbg_printf("comment, single\n"); break;
@@ -2069,16 +3140,6 @@ static void dbg_print_value(struct json_value* v) {
 	}
 }
 
-static void dbg_dump_stack(struct json_parser* jp, int depth) {
-	int i = 0;
-	return;
-	for(i = 0; i < depth && i < jp->stack_cnt; i++) {
-		dbg_parser_indent();
-		dbg_printf("%d: ", i);
-		dbg_print_value(jp->stack[jp->stack_cnt - i - 1]);
-	}
-}
-
 char* json_get_type_str(enum json_type t) {
 	switch(t) {
 		case JSON_TYPE_UNDEFINED: return "undefined";
@@ -2086,6 +3147,7 @@ char* json_get_type_str(enum json_type t) {
 		case JSON_TYPE_INT: return "integer";
 		case JSON_TYPE_DOUBLE: return "double";
 		case JSON_TYPE_STRING: return "string";
+		case JSON_TYPE_BOOL: return "boolean";
 		case JSON_TYPE_OBJ: return "object";
 		case JSON_TYPE_ARRAY: return "array";
 		case JSON_TYPE_COMMENT_SINGLE: return "single-line comment";
@@ -2104,6 +3166,7 @@ char* json_get_err_str(enum json_error e) {
 		case JSON_LEX_ERROR_INVALID_STRING: return "Invalid string";
 		case JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT: return "Unexpected end of input in lexer";
 		case JSON_LEX_ERROR_INVALID_CHAR: return "Invalid character code";
+		case JSON_LEX_ERROR_INVALID_UTF8: return "Invalid UTF-8 in string";
 		
 		case JSON_PARSER_ERROR_CORRUPT_STACK: return "Parser stack corrupted";
 		case JSON_PARSER_ERROR_STACK_EXHAUSTED: return "Parser stack prematurely exhausted";
@@ -2111,6 +3174,14 @@ char* json_get_err_str(enum json_error e) {
 		case JSON_PARSER_ERROR_UNEXPECTED_TOKEN: return "Unexpected token";
 		case JSON_PARSER_ERROR_BRACE_MISMATCH: return "Brace mismatch";
 		case JSON_PARSER_ERROR_BRACKET_MISMATCH: return "Bracket mismatch";
+		
+		case JSON_CBOR_ERROR_INVALID: return "Malformed CBOR";
+		case JSON_CBOR_ERROR_UNSUPPORTED: return "CBOR item has no JSON equivalent";
+		case JSON_CBOR_ERROR_TOO_DEEP: return "CBOR nested too deeply";
+		
+		case JSON_PATCH_ERROR_INVALID: return "Malformed JSON Patch";
+		case JSON_PATCH_ERROR_PATH: return "JSON Patch path does not exist";
+		case JSON_PATCH_ERROR_TEST_FAILED: return "JSON Patch test failed";
 		default: return "Invalid Error Code";
 	}
 }
@@ -2118,15 +3189,35 @@ char* json_get_err_str(enum json_error e) {
 struct json_value* json_deep_copy(struct json_value* v) {
 	struct json_value* c;
 
-	c = malloc(sizeof(*c));
+	c = value_alloc();
 	c->type = v->type;
+	c->flags = 0;
+	c->refs = 0;
+	c->hash = 0;
 
 	switch(v->type) {
 		default:
 		case JSON_TYPE_INT:
 		case JSON_TYPE_DOUBLE:
+			// the copy can outlive the source text, so it gets the decoded value
+			json_number_decode(v);
 			c->n = v->n;
 			c->base = v->base;
+			c->len = 0;
+			break;
+		
+		case JSON_TYPE_STRING:
+			c->s = json_memdup(v->s, v->len);
+			c->len = v->len;
+			c->base = v->base;
+			c->flags = v->flags & (JSON_STR_CLEAN | JSON_STR_ASCII | JSON_STR_IDENT);
+			break;
+		
+		case JSON_TYPE_COMMENT_SINGLE:
+		case JSON_TYPE_COMMENT_MULTI:
+			c->s = json_strdup(v->s);
+			c->len = v->len;
+			c->base = v->base;
 			break;
 
 		case JSON_TYPE_ARRAY:
@@ -2144,7 +3235,7 @@ struct json_value* json_deep_copy(struct json_value* v) {
 				vl = v->arr.head;
 				
 				while(vl) {
-					cl = malloc(sizeof(*cl));
+					cl = link_alloc();
 
 					cl->prev = cl_last;
 					if(cl_last) {
@@ -2170,12 +3261,14 @@ struct json_value* json_deep_copy(struct json_value* v) {
 			c->obj.alloc_size = v->obj.alloc_size;
 			c->len = v->len;
 
-			c->obj.buckets = calloc(1, sizeof(c->obj.buckets) * c->obj.alloc_size);
+			c->obj.buckets = buckets_alloc(c->obj.alloc_size);
 
 			for(size_t i = 0, j = 0; j < v->len && i < v->obj.alloc_size; i++) {
 				if(v->obj.buckets[i].key) { 
-					c->obj.buckets[i].key = strdup(v->obj.buckets[i].key);	
+					c->obj.buckets[i].key = json_memdup(v->obj.buckets[i].key, v->obj.buckets[i].key_len);
+					c->obj.buckets[i].key_len = v->obj.buckets[i].key_len;
 					c->obj.buckets[i].hash = v->obj.buckets[i].hash;
+					c->obj.buckets[i].flags = v->obj.buckets[i].flags;
 					c->obj.buckets[i].value = json_deep_copy(v->obj.buckets[i].value);
 					j++;
 				}
@@ -2188,46 +3281,174 @@ struct json_value* json_deep_copy(struct json_value* v) {
 }
 
 
+///////////////////
+//    Sharing    //
+///////////////////
+
+struct json_value* json_retain(struct json_value* v) {
+	if(v) json_atomic_inc(&v->refs);
+	return v;
+}
+
+// fills c with v's contents. containers get their own links or buckets and keys, but
+//   the children are retained rather than copied. returns nonzero on failure.
+static int json_shallow_copy(struct json_value* c, struct json_value* v) {
+	struct json_link* l;
+	struct json_obj_field* f, *cf;
+	size_t i;
+	
+	// field by field, since other owners may be changing v->refs
+	c->type = v->type;
+	c->base = v->base;
+	c->flags = v->flags;
+	c->refs = 0;
+	c->hash = 0;
+	c->len = v->len;
+	c->num = v->num; // the whole union
+	
+	switch(v->type) {
+		case JSON_TYPE_INT:
+		case JSON_TYPE_DOUBLE:
+			// decoded in the copy; v may be shared
+			json_number_decode(c);
+			c->flags &= ~JSON_NUM_SRC;
+			if(v->flags & JSON_NUM_SRC) c->len = 0;
+			break;
+		
+		case JSON_TYPE_STRING:
+			c->s = json_memdup(v->s, v->len);
+			if(!c->s) return 1;
+			break;
+		
+		case JSON_TYPE_COMMENT_SINGLE:
+		case JSON_TYPE_COMMENT_MULTI:
+			c->s = json_strdup(v->s);
+			if(!c->s) return 1;
+			break;
+		
+		case JSON_TYPE_ARRAY:
+			c->arr.head = c->arr.tail = NULL;
+			c->len = 0;
+			
+			for(l = v->arr.head; l; l = l->next) {
+				if(json_array_push_tail(c, json_retain(l->v))) {
+					json_free(l->v);
+					free_array(c);
+					return 1;
+				}
+			}
+			break;
+		
+		case JSON_TYPE_OBJ:
+			c->obj.buckets = buckets_alloc(v->obj.alloc_size);
+			if(!c->obj.buckets) return 1;
+			c->len = 0;
+			
+			// same size, so every key lands in the same bucket
+			for(i = 0; i < v->obj.alloc_size; i++) {
+				f = &v->obj.buckets[i];
+				if(!f->key) continue;
+				
+				cf = &c->obj.buckets[i];
+				*cf = *f;
+				cf->key = json_memdup(f->key, f->key_len);
+				if(!cf->key) {
+					free_obj(c);
+					return 1;
+				}
+				
+				json_retain(cf->value);
+				c->len++;
+			}
+			break;
+		
+		default:
+			break;
+	}
+	
+	return 0;
+}
+
+struct json_value* json_unshare(struct json_value* v) {
+	struct json_value* c;
+	
+	if(!v || !json_atomic_load(&v->refs)) return v;
+	
+	c = value_alloc();
+	if(!c) return NULL;
+	
+	if(json_shallow_copy(c, v)) {
+		value_free(c);
+		return NULL;
+	}
+	
+	// the caller's reference moves to the copy
+	json_free(v);
+	
+	return c;
+}
+
+struct json_value* json_obj_get_mut(struct json_value* obj, char* key) {
+	return json_obj_get_mut_n(obj, key, strlen(key));
+}
+
+struct json_value* json_obj_get_mut_n(struct json_value* obj, char* key, size_t len) {
+	struct json_obj_field* f;
+	struct json_value* v;
+	int64_t bi;
+	
+	bi = find_bucket(obj, hash_key(key, len), key, len);
+	if(bi < 0 || !obj->obj.buckets[bi].key) return NULL;
+	
+	f = &obj->obj.buckets[bi];
+	v = json_unshare(f->value);
+	if(v) f->value = v;
+	
+	return v;
+}
+
+
+
+// a copy of v for into: its own, or one sharing v's children
+static int merge_copy(struct json_value* c, struct json_value* v, int share) {
+	struct json_value* dc;
+	
+	if(share) return json_shallow_copy(c, v);
+	
+	dc = json_deep_copy(v);
+	if(!dc) return 1;
+	
+	*c = *dc;
+	value_free(dc);
+	return 0;
+}
+
 // scalar and disparate types take the value of from
 // appends arrays
 // recursively merges objects
-void json_merge(struct json_value* into, struct json_value* from) {
+static void merge(struct json_value* into, struct json_value* from, int share) {
+	struct json_value tmp;
+	struct json_value* fv;
 	
 	// append two arrays
 	if(into->type == JSON_TYPE_ARRAY && from->type == JSON_TYPE_ARRAY) {
 		struct json_link* fl;
 
-		fl = from->arr.head;
-		while(fl) {
-			json_array_push_tail(into, json_deep_copy(fl->v));
+		for(fl = from->arr.head; fl; fl = fl->next) {
+			fv = share ? json_retain(fl->v) : json_deep_copy(fl->v);
+			if(fv && json_array_push_tail(into, fv)) json_free(fv);
 		}
 
 		return;
 	}
 	
-	// disparate or scalar types
+	// disparate or scalar types. into becomes a copy of from.
 	if(into->type != JSON_TYPE_OBJ || from->type != JSON_TYPE_OBJ) {
+		if(merge_copy(&tmp, from, share)) return;
 		
-		// clean out into first
-		if(into->type == JSON_TYPE_ARRAY) {
-			free_array(into);
-		}
-		else if(into->type == JSON_TYPE_OBJ) {
-			free_obj(into);
-		}
-
-		// deep-copy an array or obect from value
-		if(from->type == JSON_TYPE_ARRAY || from->type == JSON_TYPE_OBJ) {
-			struct json_value* tmp;
-			tmp = json_deep_copy(from);
-			memcpy(into, tmp, sizeof(*into));
-			free(tmp);
-
-			return;
-		}
-		
-		// simple copy of scalars
-		memcpy(into, from, sizeof(*into));
+		tmp.refs = into->refs;
+		free_contents(into);
+		*into = tmp;
 
 		return;
 	}
@@ -2235,351 +3456,3238 @@ void json_merge(struct json_value* into, struct json_value* from) {
 	// merge objects
 	void* fi = NULL;
 	char* key;
-	struct json_value* fv;
+	size_t key_len;
 
-	while(json_obj_next(from, &fi, &key, &fv)) {
+	while(json_obj_next_n(from, &fi, &key, &key_len, &fv)) {
 		struct json_value* iv;
 
-		if(json_obj_get_key(into, key, &iv)) {
-			json_obj_set_key(into, key, json_deep_copy(fv));
+		if(json_obj_get_key_n(into, key, key_len, &iv)) {
+			iv = share ? json_retain(fv) : json_deep_copy(fv);
+			if(iv && json_obj_set_key_n(into, key, key_len, iv)) json_free(iv);
 		}
-		else { // key exists in into
-			json_merge(iv, fv);
+		else { // key exists in into, and its value may be shared
+			iv = json_obj_get_mut_n(into, key, key_len);
+			if(iv) merge(iv, fv, share);
 		}
 	}
-	
 }
 
+void json_merge(struct json_value* into, struct json_value* from) {
+	merge(into, from, 0);
+}
 
-
-static void spaces(int depth, int w) {
-	int i;
-	for(i = 0; i < depth * w; i++) dbg_printf(" ");
+void json_merge_shared(struct json_value* into, struct json_value* from) {
+	merge(into, from, 1);
 }
 
-// shitty recursive fn for debugging
-void json_dump_value(struct json_value* root, int cur_depth, int max_depth) {
+
+
+// into takes over from's contents and from's node is freed. neither may be shared.
+static void move_contents(struct json_value* into, struct json_value* from) {
+	unsigned int refs = into->refs;
 	
-	void* iter;
-	char* key;
-	struct json_value* v;
+	free_contents(into);
+	*into = *from;
+	into->refs = refs;
 	
-	//printf("-----------------------------------\n\n\n");
+	value_free(from);
+}
+
+// into's value under field f's key becomes f's value, or is merged with it.
+//   takes f's key and value.
+static void merge_move_field(struct json_value* into, struct json_obj_field* f, int patch) {
+	struct json_obj_field* b;
+	struct json_value* iv;
+	int64_t bi;
+	
+	bi = find_bucket(into, f->hash, f->key, f->key_len);
+	b = bi >= 0 ? &into->obj.buckets[bi] : NULL;
+	
+	// rfc 7396: null removes the key
+	if(patch && f->value->type == JSON_TYPE_NULL) {
+		if(b && b->key) json_obj_delete_key_n(into, f->key, f->key_len);
+		json_mem_free(f->key);
+		json_free(f->value);
+		return;
+	}
+	
+	if(!b || !b->key) {
+		// a patch object has its nulls applied to an empty object rather than kept
+		if(patch && f->value->type == JSON_TYPE_OBJ) {
+			iv = json_new_object(8);
+			if(!iv || obj_set_key_hashed(into, f->hash, f->key, f->key_len, f->flags, iv, NULL)) {
+				json_free(iv);
+				json_mem_free(f->key);
+				json_free(f->value);
+				return;
+			}
+			json_merge_patch(iv, f->value);
+			return;
+		}
+		
+		// the key and value move over as they are
+		if(obj_set_key_hashed(into, f->hash, f->key, f->key_len, f->flags, f->value, NULL)) {
+			json_mem_free(f->key);
+			json_free(f->value);
+		}
+		return;
+	}
+	
+	json_mem_free(f->key);
+	
+	// containers of the same kind merge. a patch object always applies to what's
+	//   there, which turns anything but an object into an empty one first.
+	if(patch ? f->value->type == JSON_TYPE_OBJ : b->value->type == f->value->type && (
+		f->value->type == JSON_TYPE_ARRAY || f->value->type == JSON_TYPE_OBJ
+	)) {
+		iv = json_unshare(b->value);
+		if(!iv) {
+			json_free(f->value);
+			return;
+		}
+		b->value = iv;
+		
+		if(patch) json_merge_patch(iv, f->value);
+		else json_merge_move(iv, f->value);
+		return;
+	}
+	
+	// everything else is replaced
+	json_free(b->value);
+	b->value = f->value;
+}
+
+void json_merge_move(struct json_value* into, struct json_value* from) {
+	struct json_link* fl;
+	size_t i;
+	
+	// only an unshared from can be taken apart
+	from = json_unshare(from);
+	if(!from) return;
+	
+	// the lists are spliced together
+	if(into->type == JSON_TYPE_ARRAY && from->type == JSON_TYPE_ARRAY) {
+		if((fl = from->arr.head)) {
+			if(into->arr.tail) into->arr.tail->next = fl;
+			else into->arr.head = fl;
+			
+			fl->prev = into->arr.tail;
+			into->arr.tail = from->arr.tail;
+			into->len += from->len;
+		}
+		
+		value_free(from);
+		return;
+	}
+	
+	if(into->type != JSON_TYPE_OBJ || from->type != JSON_TYPE_OBJ) {
+		// the source text may go away with from's json_file
+		json_number_decode(from);
+		if(from->flags & JSON_NUM_SRC) {
+			from->flags &= ~JSON_NUM_SRC;
+			from->len = 0;
+		}
+		
+		move_contents(into, from);
+		return;
+	}
+	
+	for(i = 0; i < from->obj.alloc_size; i++) {
+		if(from->obj.buckets[i].key) merge_move_field(into, &from->obj.buckets[i], 0);
+	}
+	
+	buckets_free(from->obj.buckets, from->obj.alloc_size);
+	value_free(from);
+}
+
+void json_merge_patch(struct json_value* target, struct json_value* patch) {
+	struct json_value* t;
+	size_t i;
+	
+	patch = json_unshare(patch);
+	if(!patch) return;
+	
+	// a patch that isn't an object replaces the target
+	if(patch->type != JSON_TYPE_OBJ) {
+		json_number_decode(patch);
+		if(patch->flags & JSON_NUM_SRC) {
+			patch->flags &= ~JSON_NUM_SRC;
+			patch->len = 0;
+		}
+		
+		move_contents(target, patch);
+		return;
+	}
+	
+	if(target->type != JSON_TYPE_OBJ) {
+		t = json_new_object(8);
+		if(!t) {
+			json_free(patch);
+			return;
+		}
+		move_contents(target, t);
+	}
+	
+	for(i = 0; i < patch->obj.alloc_size; i++) {
+		if(patch->obj.buckets[i].key) merge_move_field(target, &patch->obj.buckets[i], 1);
+	}
+	
+	buckets_free(patch->obj.buckets, patch->obj.alloc_size);
+	value_free(patch);
+}
+
+
+
+///////////////////
+//   Equality    //
+///////////////////
+
+static uint64_t hash_mix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// how containers fold in their members' hashes. img_write builds the same ones.
+static uint64_t hash_elem(uint64_t h, unsigned int eh) {
+	return hash_mix(h * 31 + eh);
+}
+
+static uint64_t hash_member(uint64_t key_hash, unsigned int vh) {
+	return hash_mix(key_hash ^ vh);
+}
+
+static uint64_t hash_obj_end(uint64_t sum, size_t len) {
+	return hash_mix(sum ^ ((uint64_t)JSON_TYPE_OBJ << 56) ^ len);
+}
+
+// *out = d if d is exactly an int64. the range goes first: casting one out of range
+//   or a nan is undefined.
+static int double_as_int(double d, int64_t* out) {
+	if(!(d >= -9223372036854775808.0 && d < 9223372036854775808.0)) return 0;
+	
+	*out = (int64_t)d;
+	return (double)*out == d;
+}
+
+static unsigned int hash_fold(uint64_t h) {
+	unsigned int r = (unsigned int)(h ^ (h >> 32));
+	return r ? r : 1;
+}
+
+unsigned int json_hash(struct json_value* v) {
+	struct json_link* l;
+	struct json_obj_field* f;
+	uint64_t h;
+	unsigned int r;
+	int64_t n;
+	double d;
+	size_t i;
+	
+	if((r = json_atomic_peek(&v->hash))) return r;
+	
+	switch(v->type) {
+		case JSON_TYPE_DOUBLE:
+			// whole doubles hash like the ints they're equal to
+			d = json_as_double(v);
+			if(!double_as_int(d, &n)) {
+				memcpy(&h, &d, sizeof(h));
+				h = hash_mix(h ^ 0x6e756d);
+				break;
+			}
+			h = hash_mix((uint64_t)n ^ 0x6e756d);
+			break;
+			
+		case JSON_TYPE_INT:
+			h = hash_mix((uint64_t)json_as_int(v) ^ 0x6e756d);
+			break;
+		
+		case JSON_TYPE_STRING:
+			h = hash_key(v->s, v->len);
+			break;
+		
+		case JSON_TYPE_COMMENT_SINGLE:
+		case JSON_TYPE_COMMENT_MULTI:
+			h = hash_key(v->s, strlen(v->s)) ^ v->type;
+			break;
+		
+		case JSON_TYPE_BOOL:
+			h = hash_mix(((uint64_t)JSON_TYPE_BOOL << 56) ^ !!v->n);
+			break;
+		
+		case JSON_TYPE_ARRAY:
+			h = JSON_TYPE_ARRAY;
+			for(l = v->arr.head; l; l = l->next) {
+				h = hash_elem(h, json_hash(l->v));
+			}
+			break;
+		
+		case JSON_TYPE_OBJ:
+			// members are summed, so the order they went in doesn't matter
+			h = 0;
+			for(i = 0; i < v->obj.alloc_size; i++) {
+				f = &v->obj.buckets[i];
+				if(f->key) h += hash_member(f->hash, json_hash(f->value));
+			}
+			h = hash_obj_end(h, v->len);
+			break;
+		
+		default: // null and undefined
+			h = hash_mix((uint64_t)v->type << 56);
+			break;
+	}
+	
+	// never stored here: nothing would clear it when a descendant changes
+	return hash_fold(h);
+}
+
+// only cached hashes are cheap enough to check first, and only frozen values have them
+static int hash_differs(struct json_value* a, struct json_value* b) {
+	unsigned int ah = json_atomic_peek(&a->hash), bh = json_atomic_peek(&b->hash);
+	return ah && bh && ah != bh;
+}
+
+int json_equal(struct json_value* a, struct json_value* b) {
+	struct json_link* al, *bl;
+	struct json_obj_field* f;
+	int64_t bi, n;
+	size_t i;
+	
+	if(a == b) return 1;
+	
+	// exact, the way json_hash sees them: an int only equals a double that is exactly it
+	if((a->type == JSON_TYPE_INT || a->type == JSON_TYPE_DOUBLE) &&
+		(b->type == JSON_TYPE_INT || b->type == JSON_TYPE_DOUBLE)) {
+		if(a->type == JSON_TYPE_INT && b->type == JSON_TYPE_INT) return json_as_int(a) == json_as_int(b);
+		if(a->type == JSON_TYPE_DOUBLE && b->type == JSON_TYPE_DOUBLE) return json_as_double(a) == json_as_double(b);
+		if(a->type == JSON_TYPE_INT) return double_as_int(json_as_double(b), &n) && n == json_as_int(a);
+		return double_as_int(json_as_double(a), &n) && n == json_as_int(b);
+	}
+	
+	if(a->type != b->type) return 0;
+	
+	switch(a->type) {
+		case JSON_TYPE_STRING:
+			return a->len == b->len && !memcmp(a->s, b->s, a->len);
+		
+		case JSON_TYPE_ARRAY:
+			if(a->len != b->len || hash_differs(a, b)) return 0;
+			
+			for(al = a->arr.head, bl = b->arr.head; al; al = al->next, bl = bl->next) {
+				if(!json_equal(al->v, bl->v)) return 0;
+			}
+			return 1;
+		
+		case JSON_TYPE_OBJ:
+			if(a->len != b->len || hash_differs(a, b)) return 0;
+			
+			// the stored key hashes probe b directly
+			for(i = 0; i < a->obj.alloc_size; i++) {
+				f = &a->obj.buckets[i];
+				if(!f->key) continue;
+				
+				bi = find_bucket(b, f->hash, f->key, f->key_len);
+				if(bi < 0 || !b->obj.buckets[bi].key) return 0;
+				if(!json_equal(f->value, b->obj.buckets[bi].value)) return 0;
+			}
+			return 1;
+		
+		case JSON_TYPE_COMMENT_SINGLE:
+		case JSON_TYPE_COMMENT_MULTI:
+			return !strcmp(a->s, b->s);
+		
+		case JSON_TYPE_BOOL:
+			return !a->n == !b->n;
+		
+		default:
+			return 1;
+	}
+}
+
+
+
+///////////////////
+//     Patch     //
+///////////////////
+
+// a container's json_hash, remembered for the length of one diff
+struct diff_fp {
+	struct json_value* v;
+	unsigned int hash;
+};
+
+struct diff_ctx {
+	struct json_value* ops;
+	char* path;
+	size_t len, alloc;
+	int err;
+	
+	struct diff_fp* fps; // open addressing, keyed by node
+	size_t fp_len, fp_alloc;
+};
+
+// appends "/token" to the path, escaped per rfc 6901
+static int diff_push(struct diff_ctx* dc, char* tok, size_t len) {
+	size_t i, need;
+	char* p;
+	
+	need = dc->len + 2 + len * 2;
+	if(need > dc->alloc) {
+		p = json_mem_realloc(dc->path, need * 2);
+		if(!p) return dc->err = 1;
+		dc->path = p;
+		dc->alloc = need * 2;
+	}
+	
+	dc->path[dc->len++] = '/';
+	for(i = 0; i < len; i++) {
+		if(tok[i] == '~' || tok[i] == '/') {
+			dc->path[dc->len++] = '~';
+			dc->path[dc->len++] = tok[i] == '~' ? '0' : '1';
+		}
+		else dc->path[dc->len++] = tok[i];
+	}
+	
+	return 0;
+}
+
+static int diff_push_index(struct diff_ctx* dc, size_t i) {
+	char buf[24];
+	
+	return diff_push(dc, buf, snprintf(buf, sizeof(buf), "%zu", i));
+}
+
+// takes v, even on failure
+static int op_set(struct json_value* o, char* key, size_t len, struct json_value* v) {
+	if(!v) return 1;
+	
+	if(json_obj_set_key_n(o, key, len, v)) {
+		json_free(v);
+		return 1;
+	}
+	
+	return 0;
+}
+
+// value is retained, so the patch shares b's subtrees
+static void diff_op(struct diff_ctx* dc, char* op, struct json_value* value) {
+	struct json_value* o;
+	
+	if(dc->err) return;
+	
+	o = json_new_object(4);
+	if(!o
+		|| op_set(o, "op", 2, json_new_str(op))
+		|| op_set(o, "path", 4, json_new_strn(dc->len ? dc->path : "", dc->len))
+		|| (value && op_set(o, "value", 5, json_retain(value)))
+		|| json_array_push_tail(dc->ops, o)
+	) {
+		json_free(o);
+		dc->err = 1;
+	}
+}
+
+static void diff_value(struct diff_ctx* dc, struct json_value* a, struct json_value* b);
+static unsigned int diff_fingerprint(struct diff_ctx* dc, struct json_value* v);
+
+static int diff_same(struct diff_ctx* dc, struct json_value* a, struct json_value* b) {
+	return a == b || (diff_fingerprint(dc, a) == diff_fingerprint(dc, b) && json_equal(a, b));
+}
+
+static void diff_obj(struct diff_ctx* dc, struct json_value* a, struct json_value* b) {
+	struct json_obj_field* f;
+	int64_t bi;
+	size_t i, len = dc->len;
+	
+	// the stored hashes probe the other table directly; nothing is rehashed
+	for(i = 0; i < a->obj.alloc_size && !dc->err; i++) {
+		f = &a->obj.buckets[i];
+		if(!f->key) continue;
+		
+		if(diff_push(dc, f->key, f->key_len)) return;
+		
+		bi = find_bucket(b, f->hash, f->key, f->key_len);
+		if(bi < 0 || !b->obj.buckets[bi].key) diff_op(dc, "remove", NULL);
+		else diff_value(dc, f->value, b->obj.buckets[bi].value);
+		
+		dc->len = len;
+	}
+	
+	for(i = 0; i < b->obj.alloc_size && !dc->err; i++) {
+		f = &b->obj.buckets[i];
+		if(!f->key) continue;
+		
+		bi = find_bucket(a, f->hash, f->key, f->key_len);
+		if(bi >= 0 && a->obj.buckets[bi].key) continue;
+		
+		if(diff_push(dc, f->key, f->key_len)) return;
+		diff_op(dc, "add", f->value);
+		dc->len = len;
+	}
+}
+
+// equal runs at either end are trimmed. what's left in the middle is diffed pairwise,
+//   then the longer side's tail is removed or added.
+static void diff_array(struct diff_ctx* dc, struct json_value* a, struct json_value* b) {
+	struct json_value** av, **bv;
+	struct json_link* l;
+	size_t n = a->len, m = b->len, i, p, s, len = dc->len;
+	
+	av = json_mem_alloc((n + m) * sizeof(*av) + 1);
+	if(!av) {
+		dc->err = 1;
+		return;
+	}
+	bv = av + n;
+	
+	for(i = 0, l = a->arr.head; l; l = l->next) av[i++] = l->v;
+	for(i = 0, l = b->arr.head; l; l = l->next) bv[i++] = l->v;
+	
+	for(p = 0; p < n && p < m && diff_same(dc, av[p], bv[p]); p++);
+	for(s = 0; s < n - p && s < m - p && diff_same(dc, av[n - 1 - s], bv[m - 1 - s]); s++);
+	n -= s;
+	m -= s;
+	
+	for(i = p; i < n && i < m && !dc->err; i++) {
+		if(diff_push_index(dc, i)) break;
+		diff_value(dc, av[i], bv[i]);
+		dc->len = len;
+	}
+	
+	// from the back, so the earlier indices stay put
+	for(i = n; i > m && !dc->err; i--) {
+		if(diff_push_index(dc, i - 1)) break;
+		diff_op(dc, "remove", NULL);
+		dc->len = len;
+	}
+	
+	for(i = n; i < m && !dc->err; i++) {
+		if(diff_push_index(dc, i)) break;
+		diff_op(dc, "add", bv[i]);
+		dc->len = len;
+	}
+	
+	json_mem_free(av);
+}
+
+static struct diff_fp* fp_slot(struct diff_fp* fps, size_t alloc, struct json_value* v) {
+	size_t i;
+	
+	for(i = hash_mix((uintptr_t)v) & (alloc - 1); fps[i].v && fps[i].v != v; i = (i + 1) & (alloc - 1));
+	return &fps[i];
+}
+
+static int fp_grow(struct diff_ctx* dc) {
+	struct diff_fp* fps;
+	size_t alloc = dc->fp_alloc ? dc->fp_alloc * 2 : 64, i;
+	
+	fps = json_mem_calloc(alloc, sizeof(*fps));
+	if(!fps) return dc->err = 1;
+	
+	for(i = 0; i < dc->fp_alloc; i++) {
+		if(dc->fps[i].v) *fp_slot(fps, alloc, dc->fps[i].v) = dc->fps[i];
+	}
+	
+	json_mem_free(dc->fps);
+	dc->fps = fps;
+	dc->fp_alloc = alloc;
+	return 0;
+}
+
+// json_hash, built bottom-up once per node, since a mutable tree has no cache of
+//   its own. both trees together cost one pass however deep the diff goes.
+static unsigned int diff_fingerprint(struct diff_ctx* dc, struct json_value* v) {
+	struct diff_fp* e;
+	struct json_link* l;
+	struct json_obj_field* f;
+	unsigned int r;
+	uint64_t h;
+	size_t i;
+	
+	if(v->type != JSON_TYPE_ARRAY && v->type != JSON_TYPE_OBJ) return json_hash(v);
+	if((r = json_atomic_peek(&v->hash))) return r;
+	
+	if(dc->fp_alloc) {
+		e = fp_slot(dc->fps, dc->fp_alloc, v);
+		if(e->v) return e->hash;
+	}
+	
+	if(v->type == JSON_TYPE_ARRAY) {
+		h = JSON_TYPE_ARRAY;
+		for(l = v->arr.head; l; l = l->next) h = hash_elem(h, diff_fingerprint(dc, l->v));
+	}
+	else {
+		h = 0;
+		for(i = 0; i < v->obj.alloc_size; i++) {
+			f = &v->obj.buckets[i];
+			if(f->key) h += hash_member(f->hash, diff_fingerprint(dc, f->value));
+		}
+		h = hash_obj_end(h, v->len);
+	}
+	r = hash_fold(h);
+	
+	// a failed grow ends the diff; the hash is still right
+	if((dc->fp_len + 1) * 4 >= dc->fp_alloc * 3 && fp_grow(dc)) return r;
+	
+	e = fp_slot(dc->fps, dc->fp_alloc, v);
+	e->v = v;
+	e->hash = r;
+	dc->fp_len++;
+	
+	return r;
+}
+
+static void diff_value(struct diff_ctx* dc, struct json_value* a, struct json_value* b) {
+	// shared subtrees are identical
+	if(a == b || dc->err) return;
+	
+	if(a->type != b->type) {
+		diff_op(dc, "replace", b);
+		return;
+	}
+	
+	// unchanged subtrees are skipped whole. differing fingerprints reject in O(1),
+	//   so only the topmost equal subtree of each branch gets compared in full.
+	if(diff_fingerprint(dc, a) == diff_fingerprint(dc, b) && json_equal(a, b)) return;
+	
+	switch(a->type) {
+		case JSON_TYPE_OBJ: diff_obj(dc, a, b); break;
+		case JSON_TYPE_ARRAY: diff_array(dc, a, b); break;
+		default: diff_op(dc, "replace", b); break;
+	}
+}
+
+struct json_value* json_diff(struct json_value* a, struct json_value* b) {
+	struct diff_ctx dc = {0};
+	
+	dc.ops = json_new_array();
+	if(!dc.ops) return NULL;
+	
+	diff_value(&dc, a, b);
+	
+	json_mem_free(dc.path);
+	json_mem_free(dc.fps);
+	if(dc.err) {
+		json_free(dc.ops);
+		return NULL;
+	}
+	
+	return dc.ops;
+}
+
+
+
+// decodes the next reference token of a json pointer into tok. returns the rest of
+//   the pointer, or NULL if it's malformed.
+static char* ptr_next(char* p, char* end, char* tok, size_t* len) {
+	size_t n = 0;
+	
+	if(*p != '/') return NULL;
+	
+	for(p++; p < end && *p != '/'; p++) {
+		if(*p == '~') {
+			if(++p == end || (*p != '0' && *p != '1')) return NULL;
+			tok[n++] = *p == '0' ? '~' : '/';
+		}
+		else tok[n++] = *p;
+	}
+	
+	*len = n;
+	return p;
+}
+
+// array indices are decimal without leading zeros. "-" is one past the end.
+static int ptr_index(struct json_value* arr, char* tok, size_t len, int dash, size_t* out) {
+	size_t i, n = 0;
+	
+	if(dash && len == 1 && tok[0] == '-') {
+		*out = arr->len;
+		return 0;
+	}
+	
+	if(len == 0 || len > 19 || (len > 1 && tok[0] == '0')) return 1;
+	
+	for(i = 0; i < len; i++) {
+		if(tok[i] < '0' || tok[i] > '9') return 1;
+		n = n * 10 + tok[i] - '0';
+	}
+	
+	if(n > arr->len || (n == arr->len && !dash)) return 1;
+	
+	*out = n;
+	return 0;
+}
+
+static struct json_link* array_link(struct json_value* arr, size_t i) {
+	struct json_link* l;
+	
+	for(l = arr->arr.head; i--; l = l->next);
+	
+	return l;
+}
+
+// the child of c named by tok, or NULL
+static struct json_value* ptr_child(struct json_value* c, char* tok, size_t len, struct json_value*** slot) {
+	struct json_link* l;
+	int64_t bi;
+	size_t i;
+	
+	if(c->type == JSON_TYPE_OBJ) {
+		bi = find_bucket(c, hash_key(tok, len), tok, len);
+		if(bi < 0 || !c->obj.buckets[bi].key) return NULL;
+		
+		*slot = &c->obj.buckets[bi].value;
+		return **slot;
+	}
+	
+	if(c->type == JSON_TYPE_ARRAY) {
+		if(ptr_index(c, tok, len, 0, &i)) return NULL;
+		
+		l = array_link(c, i);
+		*slot = &l->v;
+		return l->v;
+	}
+	
+	return NULL;
+}
+
+// walks to the container that path's last token points into. with mut, every
+//   container on the way is unshared so the last one can be modified.
+static int ptr_walk(struct json_value* root, char* path, size_t plen, int mut, char* tok, size_t* len, struct json_value** parent) {
+	struct json_value* c = root, **slot;
+	char* p = path, *end = path + plen;
+	
+	for(;;) {
+		p = ptr_next(p, end, tok, len);
+		if(!p) return JSON_PATCH_ERROR_INVALID;
+		if(p == end) break;
+		
+		c = ptr_child(c, tok, *len, &slot);
+		if(!c) return JSON_PATCH_ERROR_PATH;
+		
+		if(mut) {
+			c = json_unshare(c);
+			if(!c) return JSON_ERROR_OOM;
+			*slot = c;
+		}
+	}
+	
+	*parent = c;
+	return 0;
+}
+
+static int ptr_get(struct json_value* root, char* path, size_t plen, char* tok, struct json_value** out) {
+	struct json_value* c, **slot;
+	size_t len;
+	int err;
+	
+	if(plen == 0) {
+		*out = root;
+		return 0;
+	}
+	
+	if((err = ptr_walk(root, path, plen, 0, tok, &len, &c))) return err;
+	
+	*out = ptr_child(c, tok, len, &slot);
+	return *out ? 0 : JSON_PATCH_ERROR_PATH;
+}
+
+// takes v, even on failure
+static int patch_add(struct json_value** doc, char* path, size_t plen, char* tok, struct json_value* v) {
+	struct json_value* c;
+	struct json_link* l, *node;
+	size_t len, i;
+	int err;
+	
+	if(plen == 0) {
+		json_free(*doc);
+		*doc = v;
+		return 0;
+	}
+	
+	if((err = ptr_walk(*doc, path, plen, 1, tok, &len, &c))) goto FAIL;
+	
+	if(c->type == JSON_TYPE_OBJ) {
+		if(json_obj_set_key_n(c, tok, len, v)) { err = JSON_ERROR_OOM; goto FAIL; }
+		return 0;
+	}
+	
+	err = JSON_PATCH_ERROR_PATH;
+	if(c->type != JSON_TYPE_ARRAY || ptr_index(c, tok, len, 1, &i)) goto FAIL;
+	
+	if(i == c->len) {
+		if(json_array_push_tail(c, v)) { err = JSON_ERROR_OOM; goto FAIL; }
+		return 0;
+	}
+	
+	node = link_alloc();
+	if(!node) { err = JSON_ERROR_OOM; goto FAIL; }
+	
+	// in front of the current i'th element
+	l = array_link(c, i);
+	node->v = v;
+	node->next = l;
+	node->prev = l->prev;
+	if(l->prev) l->prev->next = node;
+	else c->arr.head = node;
+	l->prev = node;
+	c->len++;
+	
+	return 0;
+	
+FAIL:
+	json_free(v);
+	return err;
+}
+
+// detaches the value at path and hands it to the caller
+static int patch_take(struct json_value** doc, char* path, size_t plen, char* tok, struct json_value** out) {
+	struct json_value* c, **slot;
+	struct json_link* l;
+	size_t len, i;
+	int err;
+	
+	if(plen == 0) return JSON_PATCH_ERROR_PATH;
+	
+	if((err = ptr_walk(*doc, path, plen, 1, tok, &len, &c))) return err;
+	
+	if(c->type == JSON_TYPE_OBJ) {
+		if(!ptr_child(c, tok, len, &slot)) return JSON_PATCH_ERROR_PATH;
+		
+		// the delete drops the table's reference, leaving ours
+		*out = json_retain(*slot);
+		json_obj_delete_key_n(c, tok, len);
+		return 0;
+	}
+	
+	if(c->type != JSON_TYPE_ARRAY || ptr_index(c, tok, len, 0, &i)) return JSON_PATCH_ERROR_PATH;
+	
+	l = array_link(c, i);
+	if(l->prev) l->prev->next = l->next;
+	else c->arr.head = l->next;
+	if(l->next) l->next->prev = l->prev;
+	else c->arr.tail = l->prev;
+	c->len--;
+	
+	*out = l->v;
+	link_free(l);
+	
+	return 0;
+}
+
+static struct json_value* op_member(struct json_value* op, char* key, size_t len, enum json_type type) {
+	struct json_value* v = json_obj_get_val_n(op, key, len);
+	
+	if(v && type != JSON_TYPE_UNDEFINED && v->type != type) return NULL;
+	return v;
+}
+
+#define op_is(name) (o->len == sizeof(name) - 1 && !memcmp(o->s, name, sizeof(name) - 1))
+
+static int patch_op(struct json_value** doc, struct json_value* op, char* tok) {
+	struct json_value* o, *path, *from = NULL, *value = NULL, *v;
+	int err;
+	
+	if(op->type != JSON_TYPE_OBJ) return JSON_PATCH_ERROR_INVALID;
+	
+	o = op_member(op, "op", 2, JSON_TYPE_STRING);
+	path = op_member(op, "path", 4, JSON_TYPE_STRING);
+	if(!o || !path) return JSON_PATCH_ERROR_INVALID;
+	
+	if(op_is("add") || op_is("replace") || op_is("test")) {
+		value = op_member(op, "value", 5, JSON_TYPE_UNDEFINED);
+		if(!value) return JSON_PATCH_ERROR_INVALID;
+	}
+	else if(op_is("move") || op_is("copy")) {
+		from = op_member(op, "from", 4, JSON_TYPE_STRING);
+		if(!from) return JSON_PATCH_ERROR_INVALID;
+	}
+	else if(!op_is("remove")) return JSON_PATCH_ERROR_INVALID;
+	
+	// everything below modifies the document in place
+	if(!op_is("test")) {
+		v = json_unshare(*doc);
+		if(!v) return JSON_ERROR_OOM;
+		*doc = v;
+	}
+	
+	if(op_is("add")) {
+		return patch_add(doc, path->s, path->len, tok, json_retain(value));
+	}
+	
+	if(op_is("remove") || op_is("replace")) {
+		if(path->len == 0 && value) {
+			json_free(*doc);
+			*doc = json_retain(value);
+			return 0;
+		}
+		
+		if((err = patch_take(doc, path->s, path->len, tok, &v))) return err;
+		json_free(v);
+		
+		if(!value) return 0;
+		return patch_add(doc, path->s, path->len, tok, json_retain(value));
+	}
+	
+	if(op_is("test")) {
+		if((err = ptr_get(*doc, path->s, path->len, tok, &v))) return err;
+		return json_equal(v, value) ? 0 : JSON_PATCH_ERROR_TEST_FAILED;
+	}
+	
+	if(op_is("copy")) {
+		if((err = ptr_get(*doc, from->s, from->len, tok, &v))) return err;
+		return patch_add(doc, path->s, path->len, tok, json_retain(v));
+	}
+	
+	// move. a value can't be moved into its own children.
+	if(from->len == path->len && !memcmp(from->s, path->s, from->len)) {
+		return ptr_get(*doc, from->s, from->len, tok, &v);
+	}
+	if(from->len < path->len && path->s[from->len] == '/' && !memcmp(from->s, path->s, from->len)) {
+		return JSON_PATCH_ERROR_INVALID;
+	}
+	
+	if((err = patch_take(doc, from->s, from->len, tok, &v))) return err;
+	return patch_add(doc, path->s, path->len, tok, v);
+}
+
+#undef op_is
+
+int json_patch_apply(struct json_value** doc, struct json_value* patch) {
+	struct json_value* w, *p, *f;
+	struct json_link* l;
+	size_t max = 0;
+	char* tok;
+	int err = 0;
+	
+	if(patch->type != JSON_TYPE_ARRAY) return JSON_PATCH_ERROR_INVALID;
+	
+	// a token is never longer than the pointer it came from
+	for(l = patch->arr.head; l; l = l->next) {
+		if(l->v->type != JSON_TYPE_OBJ) return JSON_PATCH_ERROR_INVALID;
+		p = json_obj_get_val_n(l->v, "path", 4);
+		f = json_obj_get_val_n(l->v, "from", 4);
+		if(p && p->type == JSON_TYPE_STRING && p->len > max) max = p->len;
+		if(f && f->type == JSON_TYPE_STRING && f->len > max) max = f->len;
+	}
+	
+	tok = json_mem_alloc(max + 1);
+	if(!tok) return JSON_ERROR_OOM;
+	
+	// the ops work on a copy, unsharing only what they touch. if one fails the
+	//   copy is dropped and doc is left as it was.
+	w = json_retain(*doc);
+	
+	for(l = patch->arr.head; l && !err; l = l->next) {
+		err = patch_op(&w, l->v, tok);
+	}
+	
+	json_mem_free(tok);
+	
+	if(err) {
+		json_free(w);
+		return err;
+	}
+	
+	json_free(*doc);
+	*doc = w;
+	
+	return 0;
+}
+
+
+
+///////////////////
+//   Interning   //
+///////////////////
+
+struct intern_entry {
+	unsigned int hash;
+	struct json_value* v; // holds a reference
+};
+
+struct json_intern_pool {
+	struct intern_entry* table; // open addressing by json_hash
+	size_t alloc_size, len;
+};
+
+struct json_intern_pool* json_intern_pool_new(void) {
+	struct json_intern_pool* p;
+	
+	p = json_mem_calloc(1, sizeof(*p));
+	if(!p) return NULL;
+	
+	p->alloc_size = 64;
+	p->table = json_mem_calloc(1, sizeof(*p->table) * p->alloc_size);
+	if(!p->table) {
+		json_mem_free(p);
+		return NULL;
+	}
+	
+	return p;
+}
+
+void json_intern_pool_free(struct json_intern_pool* p) {
+	size_t i;
+	
+	if(!p) return;
+	
+	// out of the pool they can be changed again, so their hashes can't stay
+	for(i = 0; i < p->alloc_size; i++) {
+		if(!p->table[i].v) continue;
+		json_atomic_set(&p->table[i].v->hash, 0);
+		json_free(p->table[i].v);
+	}
+	
+	json_mem_free(p->table);
+	json_mem_free(p);
+}
+
+// stricter than json_equal: 1 and 1.0, or 0.0 and -0.0, print differently.
+//   children are canonical already, so containers compare them by pointer.
+static int intern_same(struct json_value* a, struct json_value* b) {
+	struct json_link* al, *bl;
+	struct json_obj_field* f;
+	int64_t bi;
+	size_t i;
+	
+	if(a == b) return 1;
+	if(a->type != b->type) return 0;
+	
+	switch(a->type) {
+		case JSON_TYPE_INT:
+		case JSON_TYPE_DOUBLE:
+			return a->u == b->u;
+		
+		case JSON_TYPE_STRING:
+			return a->len == b->len && !memcmp(a->s, b->s, a->len);
+		
+		case JSON_TYPE_COMMENT_SINGLE:
+		case JSON_TYPE_COMMENT_MULTI:
+			return !strcmp(a->s, b->s);
+		
+		case JSON_TYPE_BOOL:
+			return !a->n == !b->n;
+		
+		case JSON_TYPE_ARRAY:
+			if(a->len != b->len) return 0;
+			
+			for(al = a->arr.head, bl = b->arr.head; al; al = al->next, bl = bl->next) {
+				if(al->v != bl->v) return 0;
+			}
+			return 1;
+		
+		case JSON_TYPE_OBJ:
+			if(a->len != b->len) return 0;
+			
+			for(i = 0; i < a->obj.alloc_size; i++) {
+				f = &a->obj.buckets[i];
+				if(!f->key) continue;
+				
+				bi = find_bucket(b, f->hash, f->key, f->key_len);
+				if(bi < 0 || !b->obj.buckets[bi].key || b->obj.buckets[bi].value != f->value) return 0;
+			}
+			return 1;
+		
+		default:
+			return 1;
+	}
+}
+
+static int intern_grow(struct json_intern_pool* p) {
+	struct intern_entry* old = p->table;
+	size_t old_size = p->alloc_size, i, j;
+	
+	p->table = json_mem_calloc(1, sizeof(*p->table) * old_size * 2);
+	if(!p->table) {
+		p->table = old;
+		return 1;
+	}
+	p->alloc_size = old_size * 2;
+	
+	for(i = 0; i < old_size; i++) {
+		if(!old[i].v) continue;
+		
+		for(j = old[i].hash % p->alloc_size; p->table[j].v; j = (j + 1) % p->alloc_size);
+		p->table[j] = old[i];
+	}
+	
+	json_mem_free(old);
+	return 0;
+}
+
+// the pool's slot for v: its canonical twin, or the empty slot it would go in
+static struct intern_entry* intern_slot(struct json_intern_pool* p, struct json_value* v, unsigned int h) {
+	struct intern_entry* e;
+	size_t i;
+	
+	for(i = h % p->alloc_size; (e = &p->table[i])->v; i = (i + 1) % p->alloc_size) {
+		if(e->hash == h && intern_same(e->v, v)) break;
+	}
+	
+	return e;
+}
+
+// takes v and returns a reference to its canonical copy
+static struct json_value* intern_value(struct json_intern_pool* p, struct json_value* v) {
+	struct intern_entry* e;
+	struct json_value* c;
+	struct json_link* l;
+	size_t i;
+	unsigned int h;
+	
+	if(v->type == JSON_TYPE_ARRAY || v->type == JSON_TYPE_OBJ) {
+		// already canonical, or in use elsewhere and copied before its slots change
+		if(json_atomic_load(&v->refs)) {
+			h = json_hash(v);
+			if(v->len <= JSON_INTERN_MAX_LEN && intern_slot(p, v, h)->v == v) return v;
+			
+			c = json_unshare(v);
+			if(!c) return v;
+			v = c;
+		}
+		
+		if(v->type == JSON_TYPE_ARRAY) {
+			for(l = v->arr.head; l; l = l->next) l->v = intern_value(p, l->v);
+		}
+		else {
+			for(i = 0; i < v->obj.alloc_size; i++) {
+				if(v->obj.buckets[i].key) v->obj.buckets[i].value = intern_value(p, v->obj.buckets[i].value);
+			}
+		}
+		
+		// big ones are rarely repeated whole; their members still are
+		if(v->len > JSON_INTERN_MAX_LEN) return v;
+	}
+	else if(v->type == JSON_TYPE_INT || v->type == JSON_TYPE_DOUBLE) {
+		// pooled numbers can't point into a json_file's source
+		json_number_decode(v);
+		if(v->flags & JSON_NUM_SRC) {
+			if(json_atomic_load(&v->refs)) return v;
+			v->flags &= ~JSON_NUM_SRC;
+			v->len = 0;
+		}
+	}
+	
+	h = json_hash(v);
+	e = intern_slot(p, v, h);
+	
+	if(e->v) {
+		c = json_retain(e->v);
+		json_free(v);
+		return c;
+	}
+	
+	e->hash = h;
+	e->v = json_retain(v);
+	p->len++;
+	
+	// canonical containers can't change while pooled, so their hash stays good
+	if(v->type == JSON_TYPE_ARRAY || v->type == JSON_TYPE_OBJ) json_atomic_set(&v->hash, h);
+	
+	// a failed grow just leaves the table fuller
+	if(p->len * 4 >= p->alloc_size * 3) intern_grow(p);
+	
+	return v;
+}
+
+struct json_value* json_intern(struct json_intern_pool* p, struct json_value* v) {
+	if(!v) return NULL;
+	return intern_value(p, v);
+}
+
+
+
+static void spaces(int depth, int w) {
+	int i;
+	for(i = 0; i < depth * w; i++) dbg_printf(" ");
+}
+
+// shitty recursive fn for debugging
+void json_dump_value(struct json_value* root, int cur_depth, int max_depth) {
+	
+	void* iter;
+	char* key;
+	struct json_value* v;
+	
+	//printf("-----------------------------------\n\n\n");
 	
 	if(root->type == JSON_TYPE_ARRAY) {
 		spaces(cur_depth, 4);
 		dbg_printf("[\n");
 		
-		// do shit
+		// do shit
+		
+		spaces(cur_depth, 4);
+		dbg_printf("]\n");
+	}
+	else if(root->type == JSON_TYPE_OBJ) {
+		dbg_printf("{\n");
+		
+		// do shit
+		iter = NULL;
+		while(json_obj_next(root, &iter, &key, &v)) {
+			//printf("looping\n;");
+			spaces(cur_depth, 4);
+			dbg_printf("%s: ", key);
+			json_dump_value(v, cur_depth+1, max_depth);
+		}
+		
+		spaces(cur_depth, 4);
+		dbg_printf("}\n");
+	}
+	else {
+		//printf("here");
+		dbg_print_value(root);
+		dbg_printf("\n");
+	}
+	
+	
+}
+
+
+
+
+// JSON output
+
+static void sb_cat_escaped(struct json_write_context* ctx, char* str, size_t len, char qc);
+static int str_is_clean(struct json_write_context* ctx, unsigned int flags, char qc);
+static void json_obj_to_string(struct json_write_context* sb, struct json_value* obj);
+static void json_arr_to_string(struct json_write_context* sb, struct json_value* arr);
+
+struct json_string_buffer* json_string_buffer_create(size_t initSize) {
+	struct json_string_buffer* b;
+	b = json_mem_alloc(sizeof(*b));
+	if(!b) return NULL;
+	
+	b->length = 0;
+	b->alloc = initSize;
+	b->buf = json_mem_alloc(initSize * sizeof(*b->buf));
+	if(!b->buf) {
+		json_mem_free(b);
+		return NULL;
+	}
+	b->buf[0] = 0;
+	b->line_len = 0;
+	
+	b->sink = NULL;
+	b->sink_user = NULL;
+	b->sink_error = 0;
+	
+	b->iov = NULL;
+	b->iov_cnt = 0;
+	b->iov_alloc = 0;
+	b->iov_mark = 0;
+	
+	return b;
+}
+
+struct json_string_buffer* json_string_buffer_create_iov(size_t initSize) {
+	struct json_string_buffer* b;
+	
+	b = json_string_buffer_create(initSize);
+	if(!b) return NULL;
+	
+	b->iov_alloc = 16;
+	b->iov = json_mem_alloc(sizeof(*b->iov) * b->iov_alloc);
+	if(!b->iov) {
+		json_string_buffer_free(b);
+		json_mem_free(b);
+		return NULL;
+	}
+	
+	return b;
+}
+
+struct json_string_buffer* json_string_buffer_create_sink(size_t bufSize, json_sink_fn sink, void* user) {
+	struct json_string_buffer* b;
+	
+	b = json_string_buffer_create(bufSize);
+	if(!b) return NULL;
+	
+	b->sink = sink;
+	b->sink_user = user;
+	
+	return b;
+}
+
+void json_string_buffer_free(struct json_string_buffer* sb) {
+	json_mem_free(sb->buf);
+	sb->buf = NULL;
+	sb->length = 0;
+	sb->alloc = 0;
+	
+	json_mem_free(sb->iov);
+	sb->iov = NULL;
+	sb->iov_cnt = 0;
+	sb->iov_alloc = 0;
+}
+
+// hands len bytes to the sink. nothing more is written after an error.
+static void sb_sink_write(struct json_string_buffer* sb, char* buf, size_t len) {
+	if(sb->sink_error || !len) return;
+	sb->sink_error = sb->sink(sb->sink_user, buf, len);
+}
+
+int json_string_buffer_flush(struct json_string_buffer* sb) {
+	if(sb->sink) {
+		sb_sink_write(sb, sb->buf, sb->length);
+		sb->length = 0;
+	}
+	
+	return sb->sink_error;
+}
+
+#ifndef JSON_NO_STDIO
+int json_sink_file(void* user, char* buf, size_t len) {
+	return fwrite(buf, 1, len, (FILE*)user) != len;
+}
+#endif
+
+int json_sink_fd(void* user, char* buf, size_t len) {
+	int fd = (intptr_t)user;
+	
+	while(len > 0) {
+#ifdef _WIN32
+		int n = _write(fd, buf, len > INT_MAX ? INT_MAX : (unsigned int)len);
+		if(n < 0) return 1;
+#else
+		ssize_t n = write(fd, buf, len);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return 1;
+		}
+#endif
+		buf += n;
+		len -= n;
+	}
+	
+	return 0;
+}
+
+// makes room for more bytes plus a terminator. nonzero means there isn't any, now
+//   or ever again: the error sticks, like a sink's, and writers stop there.
+static int sb_check(struct json_string_buffer* sb, size_t more) {
+	char* tmp;
+	
+	if(sb->sink_error) return 1;
+	if(sb->length + 1 + more <= sb->alloc) return 0;
+	
+	// streaming buffers only grow for a single reservation bigger than they are
+	if(sb->sink) {
+		if(json_string_buffer_flush(sb)) return 1;
+		if(1 + more <= sb->alloc) return 0;
+	}
+	
+	size_t na = sb->alloc < 16 ? 16 : sb->alloc;
+	while(sb->length + 1 + more > na) na *= 2;
+	
+	tmp = json_mem_realloc(sb->buf, na);
+	if(!tmp) {
+		sb->sink_error = JSON_ERROR_OOM;
+		return 1;
+	}
+	
+	sb->buf = tmp;
+	sb->alloc = na;
+	return 0;
+}
+
+// checks size and concatenates len bytes of str
+// does not check for newlines re: line_len
+static void sb_catn(struct json_string_buffer* sb, char* str, size_t len) {
+	// big spans go straight to the sink rather than through the staging area
+	if(sb->sink && len >= sb->alloc / 2) {
+		json_string_buffer_flush(sb);
+		sb_sink_write(sb, str, len);
+		sb->line_len += len;
+		return;
+	}
+	
+	if(sb_check(sb, len)) return;
+	memcpy(sb->buf + sb->length, str, len);
+	sb->length += len;
+	sb->line_len += len; 
+}
+
+// a NULL base stands for the next len bytes of buf. buf can still move,
+//   so the real pointers are only filled in by json_string_buffer_iov.
+static int sb_iov_push(struct json_string_buffer* sb, char* base, size_t len) {
+	if(!len) return 0;
+	
+	if(sb->iov_cnt >= sb->iov_alloc) {
+		struct json_iovec* tmp = json_mem_realloc(sb->iov, sizeof(*sb->iov) * sb->iov_alloc * 2);
+		if(!tmp) return 1;
+		
+		sb->iov = tmp;
+		sb->iov_alloc *= 2;
+	}
+	
+	sb->iov[sb->iov_cnt].iov_base = base;
+	sb->iov[sb->iov_cnt].iov_len = len;
+	sb->iov_cnt++;
+	
+	return 0;
+}
+
+// concatenates len bytes of str, by reference if this is an iovec buffer.
+//   str must stay put until the list has been written.
+static void sb_cat_ref(struct json_string_buffer* sb, char* str, size_t len) {
+	if(sb->sink_error) return;
+	
+	if(!sb->iov || sb->sink || len < JSON_IOV_MIN_REF) {
+		sb_catn(sb, str, len);
+		return;
+	}
+	
+	// close off what's in buf so far. the list only grows, so a failure copies instead.
+	if(sb_iov_push(sb, NULL, sb->length - sb->iov_mark)) {
+		sb_catn(sb, str, len);
+		return;
+	}
+	sb->iov_mark = sb->length;
+	
+	if(sb_iov_push(sb, str, len)) {
+		sb_catn(sb, str, len);
+		return;
+	}
+	
+	sb->line_len += len;
+}
+
+struct json_iovec* json_string_buffer_iov(struct json_string_buffer* sb, int* count) {
+	size_t off = 0;
+	int i;
+	
+	if(!sb->iov || sb->sink_error) return NULL;
+	
+	if(sb_iov_push(sb, NULL, sb->length - sb->iov_mark)) return NULL;
+	sb->iov_mark = sb->length;
+	
+	// buf has stopped moving
+	for(i = 0; i < sb->iov_cnt; i++) {
+		if(sb->iov[i].iov_base) continue;
+		
+		sb->iov[i].iov_base = sb->buf + off;
+		off += sb->iov[i].iov_len;
+	}
+	
+	*count = sb->iov_cnt;
+	return sb->iov;
+}
+
+// checks size and concatenates string
+// does not check for newlines re: line_len
+static void sb_cat(struct json_string_buffer* sb, char* str) {
+	sb_catn(sb, str, strlen(str));
+}
+
+// checks size and concatenates a single char
+static void sb_putc(struct json_string_buffer* sb, int c) {
+	// TODO: optimize
+	if(sb_check(sb, 1)) return;
+	sb->buf[sb->length] = c;
+//	sb->buf[sb->length + 1] = 0;
+	sb->length++;
+	sb->line_len = (c == '\n') ? 0 : (sb->line_len + 1); 
+}
+
+// where to write more bytes, or NULL once the buffer has failed
+static char* sb_tail_check(struct json_string_buffer* sb, size_t more) {
+	if(sb_check(sb, more)) return NULL;
+	return sb->buf + sb->length;
+}
+
+// commits len bytes written through sb_tail_check
+static void sb_advance(struct json_string_buffer* sb, size_t len) {
+	sb->length += len;
+	sb->line_len += len;
+}
+
+#define sb_tail_catf(sb, fmt, ...) \
+do { \
+	size_t _len = snprintf(NULL, 0, fmt, __VA_ARGS__); \
+	char* _d = sb_tail_check(sb, _len); \
+	if(!_d) break; \
+	snprintf(_d, _len + 1, fmt, __VA_ARGS__); \
+	sb->length += _len; \
+	sb->line_len += _len; \
+} while(0);
+
+///////////////////
+//    Numbers    //
+///////////////////
+
+static const char fmt_digit_pairs[201] = 
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+
+// writes n into buf without a terminator. returns the length, at most 20.
+static int fmt_int(char* buf, int64_t n) {
+	char tmp[20];
+	char* e = tmp + sizeof(tmp);
+	char* p = e;
+	uint64_t u = n < 0 ? -(uint64_t)n : (uint64_t)n;
+	int len;
+	
+	// two digits at a time, from the right
+	while(u >= 100) {
+		unsigned int i = (u % 100) * 2;
+		u /= 100;
+		p -= 2;
+		p[0] = fmt_digit_pairs[i];
+		p[1] = fmt_digit_pairs[i + 1];
+	}
+	
+	if(u >= 10) {
+		p -= 2;
+		p[0] = fmt_digit_pairs[u * 2];
+		p[1] = fmt_digit_pairs[u * 2 + 1];
+	}
+	else {
+		*--p = '0' + u;
+	}
+	
+	len = 0;
+	if(n < 0) buf[len++] = '-';
+	
+	memcpy(buf + len, p, e - p);
+	return len + (e - p);
+}
+
+
+// Grisu2, from Florian Loitsch's "Printing Floating-Point Numbers Quickly 
+//   and Accurately with Integers". always round-trips, and gives the 
+//   shortest digits for all but a tiny fraction of doubles.
+
+struct diy_fp {
+	uint64_t f;
+	int e;
+};
+
+// normalized 10^k for k = -348, -340, ..., 340
+static const uint64_t grisu_pow10_f[87] = {
+	0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76, 0xcf42894a5dce35ea,
+	0x9a6bb0aa55653b2d, 0xe61acf033d1a45df, 0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f,
+	0xbe5691ef416bd60c, 0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+	0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57, 0xc21094364dfb5637,
+	0x9096ea6f3848984f, 0xd77485cb25823ac7, 0xa086cfcd97bf97f4, 0xef340a98172aace5,
+	0xb23867fb2a35b28e, 0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+	0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126, 0xb5b5ada8aaff80b8,
+	0x87625f056c7c4a8b, 0xc9bcff6034c13053, 0x964e858c91ba2655, 0xdff9772470297ebd,
+	0xa6dfbd9fb8e5b88f, 0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+	0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06, 0xaa242499697392d3,
+	0xfd87b5f28300ca0e, 0xbce5086492111aeb, 0x8cbccc096f5088cc, 0xd1b71758e219652c,
+	0x9c40000000000000, 0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+	0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068, 0x9f4f2726179a2245,
+	0xed63a231d4c4fb27, 0xb0de65388cc8ada8, 0x83c7088e1aab65db, 0xc45d1df942711d9a,
+	0x924d692ca61be758, 0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+	0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d, 0x952ab45cfa97a0b3,
+	0xde469fbd99a05fe3, 0xa59bc234db398c25, 0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece,
+	0x88fcf317f22241e2, 0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+	0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410, 0x8bab8eefb6409c1a,
+	0xd01fef10a657842c, 0x9b10a4e5e9913129, 0xe7109bfba19c0c9d, 0xac2820d9623bf429,
+	0x80444b5e7aa7cf85, 0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+	0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b,
+};
+
+static const short grisu_pow10_e[87] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+	-901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+	-582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+	-263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+	56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+	694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+	1013, 1039, 1066,
+};
+
+static const uint32_t grisu_pow10_u32[10] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+
+static struct diy_fp diy_fp_mul(struct diy_fp x, struct diy_fp y) {
+	struct diy_fp r;
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 p = (unsigned __int128)x.f * y.f;
+	r.f = (uint64_t)(p >> 64) + (((uint64_t)p >> 63) & 1); // rounded
+#else
+	uint64_t m32 = 0xffffffffull;
+	uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32) + (1ull << 31); // rounded
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+#endif
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+static struct diy_fp diy_fp_normalize(struct diy_fp x) {
+	while(!(x.f & (1ull << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+
+// rounds the last digit towards w while staying inside the boundaries
+static void grisu_round(char* buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+	while(rest < wp_w && delta - rest >= ten_kappa 
+		&& (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+
+static int grisu_digit_gen(struct diy_fp w, struct diy_fp mp, uint64_t delta, char* buf, int* K) {
+	int shift = -mp.e;
+	uint64_t one = 1ull << shift;
+	uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = mp.f >> shift;
+	uint64_t p2 = mp.f & (one - 1);
+	int kappa = 1;
+	int len = 0;
+	
+	while(kappa < 10 && p1 >= grisu_pow10_u32[kappa]) kappa++;
+	
+	// integral digits
+	while(kappa > 0) {
+		uint32_t d = p1 / grisu_pow10_u32[kappa - 1];
+		p1 %= grisu_pow10_u32[kappa - 1];
+		
+		if(d || len) buf[len++] = '0' + d;
+		kappa--;
+		
+		uint64_t rest = ((uint64_t)p1 << shift) + p2;
+		if(rest <= delta) {
+			*K += kappa;
+			grisu_round(buf, len, delta, rest, (uint64_t)grisu_pow10_u32[kappa] << shift, wp_w);
+			return len;
+		}
+	}
+	
+	// fractional digits
+	while(1) {
+		p2 *= 10;
+		delta *= 10;
+		
+		char d = p2 >> shift;
+		if(d || len) buf[len++] = '0' + d;
+		
+		p2 &= one - 1;
+		kappa--;
+		
+		if(p2 < delta) {
+			*K += kappa;
+			grisu_round(buf, len, delta, p2, one, -kappa < 10 ? wp_w * grisu_pow10_u32[-kappa] : 0);
+			return len;
+		}
+	}
+}
+
+
+// d must be finite and positive. writes the digits; the value is digits * 10^K
+static int grisu2(double d, char* buf, int* K) {
+	struct diy_fp v, w, mp, mm, c;
+	uint64_t bits;
+	int biased_e;
+	int k, i;
+	double dk;
+	
+	memcpy(&bits, &d, sizeof(bits));
+	biased_e = (bits >> 52) & 0x7ff;
+	v.f = bits & ((1ull << 52) - 1);
+	
+	if(biased_e) {
+		v.f += 1ull << 52;
+		v.e = biased_e - 1075;
+	}
+	else {
+		v.e = -1074;
+	}
+	
+	// the neighbors halfway to the next doubles up and down
+	mp.f = (v.f << 1) + 1;
+	mp.e = v.e - 1;
+	mp = diy_fp_normalize(mp);
+	
+	if(v.f == (1ull << 52)) {
+		// the gap below a power of two is half as wide
+		mm.f = (v.f << 2) - 1;
+		mm.e = v.e - 2;
+	}
+	else {
+		mm.f = (v.f << 1) - 1;
+		mm.e = v.e - 1;
+	}
+	mm.f <<= mm.e - mp.e;
+	mm.e = mp.e;
+	
+	// cached power of ten that brings the exponent into [-60, -32]
+	dk = (-61 - mp.e) * 0.30102999566398114 + 347;
+	k = (int)dk;
+	if(dk - k > 0.0) k++;
+	i = (k >> 3) + 1;
+	*K = -(-348 + i * 8);
+	c.f = grisu_pow10_f[i];
+	c.e = grisu_pow10_e[i];
+	
+	w = diy_fp_mul(diy_fp_normalize(v), c);
+	mp = diy_fp_mul(mp, c);
+	mm = diy_fp_mul(mm, c);
+	
+	// stay strictly inside the rounding interval
+	mm.f++;
+	mp.f--;
+	
+	return grisu_digit_gen(w, mp, mp.f - mm.f, buf, K);
+}
+
+
+// writes d in the shortest form that reads back to the same double.
+//   integral values keep a ".0" so they parse as doubles again. non-finite
+//   values have no JSON form and are written as null. returns the length, 
+//   at most 25, with no terminator.
+static int fmt_double(char* buf, double d) {
+	char* b = buf;
+	int len, K, kk, i;
+	
+	if(!isfinite(d)) {
+		memcpy(buf, "null", 4);
+		return 4;
+	}
+	
+	if(signbit(d)) {
+		*b++ = '-';
+		d = -d;
+	}
+	
+	if(d == 0.0) {
+		memcpy(b, "0.0", 3);
+		return b - buf + 3;
+	}
+	
+	len = grisu2(d, b, &K);
+	kk = len + K; // 10^(kk-1) <= d < 10^kk
+	
+	if(K >= 0 && kk <= 21) {
+		// 1234e7 -> 12340000000.0
+		for(i = len; i < kk; i++) b[i] = '0';
+		b[kk] = '.';
+		b[kk + 1] = '0';
+		b += kk + 2;
+	}
+	else if(kk > 0 && kk <= 21) {
+		// 1234e-2 -> 12.34
+		memmove(b + kk + 1, b + kk, len - kk);
+		b[kk] = '.';
+		b += len + 1;
+	}
+	else if(kk > -6 && kk <= 0) {
+		// 1234e-6 -> 0.001234
+		int off = 2 - kk;
+		memmove(b + off, b, len);
+		b[0] = '0';
+		b[1] = '.';
+		for(i = 2; i < off; i++) b[i] = '0';
+		b += len + off;
+	}
+	else {
+		// 1234e30 -> 1.234e33
+		if(len > 1) {
+			memmove(b + 2, b + 1, len - 1);
+			b[1] = '.';
+			b += len + 1;
+		}
+		else b++;
+		
+		*b++ = 'e';
+		b += fmt_int(b, kk - 1);
+	}
+	
+	return b - buf;
+}
+
+
+
+static void json_compact_value(struct json_write_context* ctx, struct json_value* v);
+static void json_compact_elems(struct json_write_context* ctx, struct json_link* l, size_t count);
+
+void json_stringify(struct json_write_context* ctx, struct json_value* v) {
+	struct json_string_buffer* sb = ctx->sb;
+	char qc, *d;
+	
+	if(!v) {
+		//fprintf(stderr, "NULL value passed to %s()\n", __func__);
+		return;
+	}
+	
+	if(ctx->fmt.minify) {
+		json_compact_value(ctx, v);
+		return;
+	}
+	
+	switch(v->type) {
+		case JSON_TYPE_UNDEFINED:
+			sb_cat(sb, "undefined");
+			break;
+			
+		case JSON_TYPE_NULL: 
+			sb_cat(sb, "null"); 
+			break;
+			
+		case JSON_TYPE_BOOL:
+			sb_cat(sb, v->n ? "true" : "false"); 
+			break;
+			
+		case JSON_TYPE_INT: // 2
+			if(v->flags & JSON_NUM_SRC) sb_catn(sb, v->num.src, v->len);
+			else if((d = sb_tail_check(sb, 20))) sb_advance(sb, fmt_int(d, v->n)); // TODO: handle bases
+			break;
+			
+		case JSON_TYPE_DOUBLE: 
+			if(v->flags & JSON_NUM_SRC) sb_catn(sb, v->num.src, v->len);
+			else if(ctx->fmt.floatFormat && isfinite(v->d)) {
+				sb_tail_catf(sb, ctx->fmt.floatFormat, v->d);
+			}
+			else if((d = sb_tail_check(sb, 25))) sb_advance(sb, fmt_double(d, v->d));
+			break;
+			
+		case JSON_TYPE_STRING:
+			qc = ctx->fmt.useSingleQuotes ? '\'' : '"';
+			sb_putc(sb, qc);
+			if(str_is_clean(ctx, v->flags, qc)) sb_cat_ref(sb, v->s, v->len);
+			else sb_cat_escaped(ctx, v->s, v->len, qc); 
+			sb_putc(sb, qc);
+			break;
+			
+		case JSON_TYPE_OBJ: 
+			json_obj_to_string(ctx, v);
+			break;
+			
+		case JSON_TYPE_ARRAY: // 6
+			json_arr_to_string(ctx, v);
+			break;
+			
+		case JSON_TYPE_COMMENT_SINGLE: // TODO: handle linebreaks in the comment string
+			sb_tail_catf(sb, "//%s\n", v->s);
+			break;
+			
+		case JSON_TYPE_COMMENT_MULTI: // TODO: clean "*/" out of the comment string
+			sb_tail_catf(sb, "/* %s */\n", v->s);
+			break;
+			
+		// default:
+			// fprintf(stderr, "c_json: unknown type in json_value_to_string\n");
+	}
+}
+
+
+
+// caller memory as a sink. counts everything, keeps what fits.
+struct sink_mem {
+	char* buf;
+	size_t cap;
+	size_t total;
+};
+
+static int sink_mem_write(void* user, char* buf, size_t len) {
+	struct sink_mem* m = user;
+	
+	if(m->total < m->cap) {
+		size_t n = m->cap - m->total;
+		memcpy(m->buf + m->total, buf, len < n ? len : n);
+	}
+	
+	m->total += len;
+	return 0;
+}
+
+// runs the real writer, so the length is exact for every format option.
+//   the output is staged through a small buffer and never reallocated.
+static size_t stringify_to_mem(struct sink_mem* m, struct json_value* v, struct json_output_format* fmt) {
+	struct json_write_context ctx = {0};
+	
+	if(fmt) ctx.fmt = *fmt;
+	else ctx.fmt.minify = 1;
+	
+	ctx.sb = json_string_buffer_create_sink(4096, sink_mem_write, m);
+	if(!ctx.sb) return 0;
+	
+	json_stringify(&ctx, v);
+	if(json_string_buffer_flush(ctx.sb)) m->total = 0;
+	
+	json_string_buffer_free(ctx.sb);
+	json_mem_free(ctx.sb);
+	
+	return m->total;
+}
+
+size_t json_stringify_measure(struct json_value* v, struct json_output_format* fmt) {
+	struct sink_mem m = {0};
+	return stringify_to_mem(&m, v, fmt);
+}
+
+size_t json_stringify_to(char* buf, size_t cap, struct json_value* v, struct json_output_format* fmt) {
+	struct sink_mem m = {0};
+	size_t len;
+	
+	// room for the terminator is held back
+	m.buf = buf;
+	m.cap = cap ? cap - 1 : 0;
+	
+	len = stringify_to_mem(&m, v, fmt);
+	if(cap) buf[len < cap ? len : cap - 1] = 0;
+	
+	return len;
+}
+
+
+
+
+static void ctx_indent(struct json_write_context* ctx) {
+	int i = 0; 
+	int len = ctx->fmt.indentAmt * ctx->depth;
+	
+	char* c = sb_tail_check(ctx->sb, len);
+	if(!c) return;
+	
+	for(i = 0; i < len; i++) {
+		c[i] = ctx->fmt.indentChar;
+	}
+	
+	c[len] = 0;
+	ctx->sb->length += len;
+	
+	ctx->sb->line_len += len;
+}
+
+static int line_too_long(struct json_write_context* ctx) {
+	if(ctx->fmt.maxLineLength < 0) return 0;
+	if(ctx->sb->line_len <= ctx->fmt.maxLineLength) return 0;
+	return 1;
+}
+
+
+
+// returns the first byte at or after s that can't be written raw between qc quotes:
+//   the quote, a backslash, a control char, or with high = 0x80 anything non-ascii
+static JSON_ALWAYS_INLINE char* esc_scan(char* s, char* end, char qc, unsigned char high) {
+#ifdef JSON_SSE2
+	__m128i q = _mm_set1_epi8(qc);
+	__m128i bs = _mm_set1_epi8('\\');
+	__m128i ctrl = _mm_set1_epi8(0x1f);
+	
+	while(end - s >= 16) {
+		__m128i c = _mm_loadu_si128((__m128i*)s);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(c, q), _mm_cmpeq_epi8(c, bs));
+		int mask;
+		
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(c, ctrl), ctrl)); // c <= 0x1f
+		
+		mask = _mm_movemask_epi8(m);
+		if(high) mask |= _mm_movemask_epi8(c);
+		if(mask) return s + __builtin_ctz(mask);
+		
+		s += 16;
+	}
+#endif
+	
+	for(; s < end; s++) {
+		unsigned char c = *s;
+		if(c < 0x20 || c == qc || c == '\\' || (c & high)) break;
+	}
+	
+	return s;
+}
+
+
+static const char esc_short[128] = {
+	['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r', ['\t'] = 't',
+	['"'] = '"', ['\''] = '\'', ['\\'] = '\\',
+};
+
+static const char esc_hex[16] = "0123456789abcdef";
+
+
+// writes \uXXXX. d needs 6 bytes.
+static void esc_u16(char* d, unsigned int u) {
+	d[0] = '\\';
+	d[1] = 'u';
+	d[2] = esc_hex[(u >> 12) & 0xf];
+	d[3] = esc_hex[(u >> 8) & 0xf];
+	d[4] = esc_hex[(u >> 4) & 0xf];
+	d[5] = esc_hex[u & 0xf];
+}
+
+
+// decodes one utf-8 sequence for escapeNonAscii. bad bytes become U+FFFD one at a time.
+static int esc_utf8_decode(unsigned char* s, unsigned char* end, uint32_t* cp) {
+	uint32_t c = s[0];
+	int n, i;
+	
+	if(c >= 0xc2 && c <= 0xdf) { n = 2; c &= 0x1f; }
+	else if(c >= 0xe0 && c <= 0xef) { n = 3; c &= 0x0f; }
+	else if(c >= 0xf0 && c <= 0xf4) { n = 4; c &= 0x07; }
+	else goto BAD;
+	
+	if(end - s < n) goto BAD;
+	
+	for(i = 1; i < n; i++) {
+		if((s[i] & 0xc0) != 0x80) goto BAD;
+		c = (c << 6) | (s[i] & 0x3f);
+	}
+	
+	// overlong, surrogate, or past U+10FFFF
+	if((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10ffff)) || (c >= 0xd800 && c <= 0xdfff)) {
+		goto BAD;
+	}
+	
+	*cp = c;
+	return n;
+	
+BAD:
+	*cp = 0xfffd;
+	return 1;
+}
+
+
+// whether a string with these JSON_STR_* flags can go between qc quotes as it is
+static int str_is_clean(struct json_write_context* ctx, unsigned int flags, char qc) {
+	if(!(flags & JSON_STR_CLEAN) || qc != '"') return 0;
+	return !ctx->fmt.escapeNonAscii || (flags & JSON_STR_ASCII);
+}
+
+
+// RFC 8259 escaping for the inside of a qc-quoted string. clean runs are
+//   found 16 bytes at a time and copied in bulk.
+static void sb_cat_escaped(struct json_write_context* ctx, char* str, size_t len, char qc) {
+	struct json_string_buffer* sb = ctx->sb;
+	unsigned char high = ctx->fmt.escapeNonAscii ? 0x80 : 0;
+	char* s = str;
+	char* end = str + len;
+	char* run;
+	char* d;
+	
+	while(1) {
+		run = s;
+		s = esc_scan(s, end, qc, high);
+		if(s > run) sb_cat_ref(sb, run, s - run);
+		
+		if(s >= end) break;
+		
+		unsigned char c = *s;
+		d = sb_tail_check(sb, 12);
+		if(!d) return;
+		
+		if(c >= 0x80) {
+			uint32_t cp;
+			s += esc_utf8_decode((unsigned char*)s, (unsigned char*)end, &cp);
+			
+			if(cp >= 0x10000) {
+				cp -= 0x10000;
+				esc_u16(d, 0xd800 + (cp >> 10));
+				esc_u16(d + 6, 0xdc00 + (cp & 0x3ff));
+				sb_advance(sb, 12);
+			}
+			else {
+				esc_u16(d, cp);
+				sb_advance(sb, 6);
+			}
+			continue;
+		}
+		
+		if(esc_short[c]) {
+			d[0] = '\\';
+			d[1] = esc_short[c];
+			sb_advance(sb, 2);
+		}
+		else {
+			esc_u16(d, c);
+			sb_advance(sb, 6);
+		}
+		
+		s++;
+	}
+}
+
+
+// writes up to count elements starting at n, with their separators. the last one
+//   written only gets the final-element treatment if it's the end of the array.
+static void json_arr_elems_to_string(struct json_write_context* ctx, struct json_link* n, size_t count, int multiline) {
+	struct json_string_buffer* sb = ctx->sb;
+	
+	while(n && count--) {
+		
+		if(multiline) ctx_indent(ctx);
+		
+		json_stringify(ctx, n->v);
+		
+		n = n->next;
+		
+		if(n) {
+			sb_putc(sb, ',');
+			if(!multiline) sb_putc(sb, ' ');
+		}
+		else if(ctx->fmt.trailingComma && multiline) sb_putc(sb, ',');
+		
+		if(multiline) sb_putc(sb, '\n');
+		if(line_too_long(ctx)) {
+			sb_putc(sb, '\n');
+			ctx_indent(ctx);
+		}
+	}
+}
+
+
+static void json_arr_to_string(struct json_write_context* ctx, struct json_value* arr) {
+	struct json_string_buffer* sb = ctx->sb;
+	
+	int multiline = arr->len >= (size_t)ctx->fmt.minArraySzExpand;
+	
+	sb_putc(sb, '[');
+	
+	if(multiline) sb_putc(sb, '\n');
+	
+	ctx->depth++;
+	
+	json_arr_elems_to_string(ctx, arr->arr.head, SIZE_MAX, multiline);
+	
+	ctx->depth--;
+	
+	if(multiline) ctx_indent(ctx);
+	
+	sb_putc(sb, ']');
+}
+
+
+static int key_must_have_quotes(char* key, size_t len) {
+	return !(json_str_flags(key, len) & JSON_STR_IDENT);
+}
+
+
+static void json_obj_to_string(struct json_write_context* ctx, struct json_value* obj) {
+	size_t i;
+	struct json_obj_field* f;
+	struct json_string_buffer* sb = ctx->sb;
+	
+	int multiline = obj->len >= (size_t)ctx->fmt.minObjSzExpand;
+	int noquotes = ctx->fmt.noQuoteKeys;
+	char quoteChar = ctx->fmt.useSingleQuotes ? '\'' : '"';
+	
+	sb_putc(sb, '{');
+	
+	if(multiline) sb_putc(sb, '\n');
+	
+	ctx->depth++;
+	
+	size_t n = obj->len;
+	for(i = 0; i < obj->obj.alloc_size; i++) {
+		f = &obj->obj.buckets[i];
+		if(f->key == NULL) continue;
+		
+		if(multiline) ctx_indent(ctx);
 		
-		spaces(cur_depth, 4);
-		dbg_printf("]\n");
-	}
-	else if(root->type == JSON_TYPE_OBJ) {
-		dbg_printf("{\n");
+		if(!noquotes || (!(f->flags & JSON_STR_IDENT) && key_must_have_quotes(f->key, f->key_len))) {
+			sb_putc(sb, quoteChar);
+			if(str_is_clean(ctx, f->flags, quoteChar)) sb_catn(sb, f->key, f->key_len);
+			else sb_cat_escaped(ctx, f->key, f->key_len, quoteChar);
+			sb_putc(sb, quoteChar);
+		}
+		else sb_catn(sb, f->key, f->key_len);
 		
-		// do shit
-		iter = NULL;
-		while(json_obj_next(root, &iter, &key, &v)) {
-			//printf("looping\n;");
-			spaces(cur_depth, 4);
-			dbg_printf("%s: ", key);
-			json_dump_value(v, cur_depth+1, max_depth);
+		
+		sb_putc(sb, ':');
+		if(ctx->fmt.objColonSpace) sb_putc(sb, ' ');
+		
+		
+		json_stringify(ctx, f->value);
+		
+		if(n-- > 1) {
+			sb_putc(sb, ',');
+			if(!multiline) sb_putc(sb, ' ');
 		}
+		else if(ctx->fmt.trailingComma && multiline) sb_putc(sb, ',');
 		
-		spaces(cur_depth, 4);
-		dbg_printf("}\n");
-	}
-	else {
-		//printf("here");
-		dbg_print_value(root);
-		dbg_printf("\n");
+		if(multiline) sb_putc(sb, '\n');
+		if(line_too_long(ctx)) {
+			sb_putc(sb, '\n');
+			ctx_indent(ctx);
+		}
 	}
 	
+	ctx->depth--;
 	
+	if(multiline) ctx_indent(ctx);
+	sb_putc(sb, '}');
 }
 
 
+///////////////////
+//   Minified    //
+///////////////////
 
+// stores to space already reserved with sb_tail_check
+#define sb_put_unchecked(sb, c) ((sb)->buf[(sb)->length++] = (c))
+#define sb_cat_unchecked(sb, str, n) \
+do { \
+	memcpy((sb)->buf + (sb)->length, (str), (n)); \
+	(sb)->length += (n); \
+} while(0)
 
-// JSON output
-
-static void sb_cat_escaped(struct json_write_context* ctx, char* str);
-static void json_obj_to_string(struct json_write_context* sb, struct json_value* obj);
-static void json_arr_to_string(struct json_write_context* sb, struct json_value* arr);
 
-struct json_string_buffer* json_string_buffer_create(size_t initSize) {
-	struct json_string_buffer* b;
-	b = malloc(sizeof(*b));
+// quotes s in a single reservation when nothing in it needs escaping. flags are
+//   its JSON_STR_*; a clean string isn't even scanned.
+static void sb_cat_quoted(struct json_write_context* ctx, char* s, size_t len, unsigned int flags) {
+	struct json_string_buffer* sb = ctx->sb;
+	unsigned char high = ctx->fmt.escapeNonAscii ? 0x80 : 0;
+	char* d;
+	size_t clean;
+	
+	// a streaming buffer shouldn't grow to hold one big string, and 
+	//   an iovec buffer would rather reference it
+	if((sb->sink && len + 2 >= sb->alloc / 2) || (sb->iov && len >= JSON_IOV_MIN_REF)) {
+		sb_putc(sb, '"');
+		sb_cat_escaped(ctx, s, len, '"');
+		sb_putc(sb, '"');
+		return;
+	}
 	
-	b->length = 0;
-	b->alloc = initSize;
-	b->buf = malloc(initSize * sizeof(*b->buf));
-	b->buf[0] = 0;
+	d = sb_tail_check(sb, len + 2);
+	if(!d) return;
+	clean = str_is_clean(ctx, flags, '"') ? len : (size_t)(esc_scan(s, s + len, '"', high) - s);
 	
-	return b;
+	d[0] = '"';
+	memcpy(d + 1, s, clean);
+	
+	if(clean == len) {
+		d[len + 1] = '"';
+		sb->length += len + 2;
+		return;
+	}
+	
+	// something needs escaping. keep what was copied and finish the slow way.
+	sb->length += 1 + clean;
+	sb_cat_escaped(ctx, s + clean, len - clean, '"');
+	sb_putc(sb, '"');
 }
 
-void json_string_buffer_free(struct json_string_buffer* sb) {
-	free(sb->buf);
-	sb->buf = NULL;
-	sb->length = 0;
-	sb->alloc = 0;
+
+// up to count array elements starting at l, comma-separated
+static void json_compact_elems(struct json_write_context* ctx, struct json_link* l, size_t count) {
+	for(; l && count--; l = l->next) {
+		json_compact_value(ctx, l->v);
+		
+		if(l->next) {
+			if(!sb_tail_check(ctx->sb, 1)) return;
+			sb_put_unchecked(ctx->sb, ',');
+		}
+	}
 }
 
-static void sb_check(struct json_string_buffer* sb, size_t more) {
-	char* tmp;
 
-	if(sb->length + 1 + more > sb->alloc) {
-		tmp = realloc(sb->buf, sb->alloc * 2); // BUG: guarantee sufficient size 
-		if(tmp) {
-			sb->buf = tmp;
-			sb->alloc *= 2;
-		}
-		else {
-			//fprintf(stderr, "c_json: Memory allocation failed\n");
-		}
-	} 
+// plain RFC 8259 output with no whitespace. only floatFormat is honored;
+//   the quoting and layout options are ignored. line_len is not tracked.
+static void json_compact_value(struct json_write_context* ctx, struct json_value* v) {
+	struct json_string_buffer* sb = ctx->sb;
+	struct json_obj_field* f;
+	size_t i, n;
+	char* d;
+	
+	switch(v->type) {
+		case JSON_TYPE_UNDEFINED: // not JSON; null, like non-finite doubles
+		case JSON_TYPE_NULL:
+			if(!sb_tail_check(sb, 4)) return;
+			sb_cat_unchecked(sb, "null", 4);
+			break;
+			
+		case JSON_TYPE_BOOL:
+			if(!sb_tail_check(sb, 5)) return;
+			if(v->n) sb_cat_unchecked(sb, "true", 4);
+			else sb_cat_unchecked(sb, "false", 5);
+			break;
+			
+		case JSON_TYPE_INT:
+			if(v->flags & JSON_NUM_SRC) sb_catn(sb, v->num.src, v->len);
+			else if((d = sb_tail_check(sb, 20))) sb->length += fmt_int(d, v->n);
+			break;
+			
+		case JSON_TYPE_DOUBLE:
+			if(v->flags & JSON_NUM_SRC) sb_catn(sb, v->num.src, v->len);
+			else if(ctx->fmt.floatFormat && isfinite(v->d)) {
+				sb_tail_catf(sb, ctx->fmt.floatFormat, v->d);
+			}
+			else if((d = sb_tail_check(sb, 25))) sb->length += fmt_double(d, v->d);
+			break;
+			
+		case JSON_TYPE_STRING:
+			sb_cat_quoted(ctx, v->s, v->len, v->flags);
+			break;
+			
+		case JSON_TYPE_ARRAY:
+			if(!sb_tail_check(sb, 1)) return;
+			sb_put_unchecked(sb, '[');
+			
+			json_compact_elems(ctx, v->arr.head, SIZE_MAX);
+			
+			if(!sb_tail_check(sb, 1)) return;
+			sb_put_unchecked(sb, ']');
+			break;
+			
+		case JSON_TYPE_OBJ:
+			if(!sb_tail_check(sb, 2)) return;
+			sb_put_unchecked(sb, '{');
+			
+			n = v->len;
+			for(i = 0; n && i < v->obj.alloc_size; i++) {
+				f = &v->obj.buckets[i];
+				if(f->key == NULL) continue;
+				
+				sb_cat_quoted(ctx, f->key, f->key_len, f->flags);
+				if(!sb_tail_check(sb, 1)) return;
+				sb_put_unchecked(sb, ':');
+				
+				json_compact_value(ctx, f->value);
+				
+				if(!sb_tail_check(sb, 1)) return;
+				sb_put_unchecked(sb, --n ? ',' : '}');
+			}
+			
+			if(!v->len) sb_put_unchecked(sb, '}');
+			break;
+			
+		// comments can't be represented
+		default:
+			break;
+	}
 }
 
-// checks size and concatenates string
-// does not check for newlines re: line_len
-static void sb_cat(struct json_string_buffer* sb, char* str) {
-	// TODO: optimize
-	size_t len = strlen(str);
-	sb_check(sb, len);
-	memcpy(sb->buf + sb->length, str, len);
-//	strcat(sb->buf, str);
-	sb->length += len;
-	sb->line_len += len; 
+
+///////////////////
+//   Parallel    //
+///////////////////
+
+#ifndef JSON_NO_THREADS
+
+// a run of elements, serialized into its own buffer by whichever thread claims it
+struct par_chunk {
+	struct json_link* first;
+	size_t count;
+	struct json_string_buffer* sb; // NULL if it couldn't be done
+};
+
+struct par_job {
+	struct json_write_context* ctx; // already inside the array
+	struct json_allocator* allocator; // the caller's
+	int multiline;
+	
+	struct par_chunk* chunks;
+	size_t nchunks;
+	
+	pthread_mutex_t lock;
+	size_t next; // the next unclaimed chunk
+};
+
+
+static void* par_worker(void* p) {
+	struct par_job* job = p;
+	struct json_write_context ctx;
+	struct par_chunk* c;
+	size_t i;
+	
+	// the buffers go back to the caller, who frees them
+	json_set_thread_allocator(job->allocator);
+	
+	while(1) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		
+		if(i >= job->nchunks) break;
+		c = &job->chunks[i];
+		
+		// same format and depth, private buffer
+		ctx = *job->ctx;
+		ctx.sb = json_string_buffer_create(4096);
+		if(!ctx.sb) continue; // left for the main thread
+		
+		if(ctx.fmt.minify) json_compact_elems(&ctx, c->first, c->count);
+		else json_arr_elems_to_string(&ctx, c->first, c->count, job->multiline);
+		
+		c->sb = ctx.sb;
+	}
+	
+	return NULL;
 }
 
-// checks size and concatenates a single char
-static void sb_putc(struct json_string_buffer* sb, int c) {
-	// TODO: optimize
-	sb_check(sb, 1);
-	sb->buf[sb->length] = c;
-//	sb->buf[sb->length + 1] = 0;
-	sb->length++;
-	sb->line_len = (c == '\n') ? 0 : (sb->line_len + 1); 
+
+// splits a big array's elements across threads. anything else is done serially.
+void json_stringify_parallel(struct json_write_context* ctx, struct json_value* v, int nthreads) {
+	struct json_string_buffer* sb = ctx->sb;
+	struct par_job job;
+	pthread_t* threads;
+	struct json_link* l;
+	size_t per, i, k;
+	int multiline, nt;
+	
+#ifdef _SC_NPROCESSORS_ONLN
+	if(nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	
+	if(!v || v->type != JSON_TYPE_ARRAY || nthreads < 2 || v->len < JSON_PARALLEL_MIN_ELEMS) {
+		json_stringify(ctx, v);
+		return;
+	}
+	
+	multiline = v->len >= (size_t)ctx->fmt.minArraySzExpand;
+	
+	// single-line arrays wrap based on the running line length, which a slice can't know
+	if(!ctx->fmt.minify && !multiline && ctx->fmt.maxLineLength >= 0) {
+		json_stringify(ctx, v);
+		return;
+	}
+	
+	// a few chunks per thread evens out uneven elements
+	job.nchunks = nthreads * 4;
+	per = (v->len + job.nchunks - 1) / job.nchunks;
+	
+	job.chunks = json_mem_calloc(job.nchunks, sizeof(*job.chunks));
+	threads = json_mem_alloc(sizeof(*threads) * nthreads);
+	if(!job.chunks || !threads) {
+		json_mem_free(job.chunks);
+		json_mem_free(threads);
+		json_stringify(ctx, v);
+		return;
+	}
+	
+	for(l = v->arr.head, i = 0; l && i < job.nchunks; i++) {
+		job.chunks[i].first = l;
+		job.chunks[i].count = per;
+		for(k = 0; l && k < per; k++) l = l->next;
+	}
+	job.nchunks = i;
+	
+	// the opening is written here, as in json_arr_to_string
+	sb_putc(sb, '[');
+	if(!ctx->fmt.minify && multiline) sb_putc(sb, '\n');
+	
+	ctx->depth++;
+	
+	job.ctx = ctx;
+	job.allocator = cur_allocator();
+	job.multiline = multiline;
+	job.next = 0;
+	pthread_mutex_init(&job.lock, NULL);
+	
+	// the calling thread works too
+	for(nt = 0; nt < nthreads - 1; nt++) {
+		if(pthread_create(&threads[nt], NULL, par_worker, &job)) break;
+	}
+	par_worker(&job);
+	
+	while(nt--) pthread_join(threads[nt], NULL);
+	pthread_mutex_destroy(&job.lock);
+	
+	// stitch the slices together in order
+	for(i = 0; i < job.nchunks; i++) {
+		struct par_chunk* c = &job.chunks[i];
+		
+		if(!c->sb) {
+			// a worker ran out of memory. do it here instead.
+			if(ctx->fmt.minify) json_compact_elems(ctx, c->first, c->count);
+			else json_arr_elems_to_string(ctx, c->first, c->count, multiline);
+			continue;
+		}
+		
+		sb_catn(sb, c->sb->buf, c->sb->length);
+		sb->line_len = c->sb->line_len;
+		if(c->sb->sink_error && !sb->sink_error) sb->sink_error = c->sb->sink_error;
+		
+		json_string_buffer_free(c->sb);
+		json_mem_free(c->sb);
+	}
+	
+	ctx->depth--;
+	
+	if(!ctx->fmt.minify && multiline) ctx_indent(ctx);
+	sb_putc(sb, ']');
+	
+	json_mem_free(job.chunks);
+	json_mem_free(threads);
 }
 
-static char* sb_tail_check(struct json_string_buffer* sb, int more) {
-	sb_check(sb, more);
-	return sb->buf + sb->length;
+#else // JSON_NO_THREADS
+
+void json_stringify_parallel(struct json_write_context* ctx, struct json_value* v, int nthreads) {
+	json_stringify(ctx, v);
 }
 
-#define sb_tail_catf(sb, fmt, ...) \
-do { \
-	size_t _len = snprintf(NULL, 0, fmt, __VA_ARGS__); \
-	snprintf(sb_tail_check(sb, _len), _len + 1, fmt, __VA_ARGS__); \
-	sb->length += _len; \
-	sb->line_len += _len; \
-} while(0);
+#endif
 
-void json_stringify(struct json_write_context* ctx, struct json_value* v) {
-	struct json_string_buffer* sb = ctx->sb;
-	char* float_format = ctx->fmt.floatFormat ? ctx->fmt.floatFormat : "%f"; 
-	char qc;
+
+///////////////////
+//     CBOR      //
+///////////////////
+
+// RFC 8949. each json_type has an exact counterpart, so nothing is formatted,
+//   escaped or parsed on the way through.
+
+#define CBOR_UINT   0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_MAP    5
+#define CBOR_TAG    6
+#define CBOR_SIMPLE 7
+
+#define CBOR_FALSE     0xf4
+#define CBOR_TRUE      0xf5
+#define CBOR_NULL      0xf6
+#define CBOR_UNDEFINED 0xf7
+#define CBOR_FLOAT32   0xfa
+#define CBOR_FLOAT64   0xfb
+#define CBOR_BREAK     0xff
+
+#define CBOR_INDEFINITE 31
+
+
+// the initial byte and the shortest big-endian argument after it
+static void cbor_head(struct json_string_buffer* sb, int major, uint64_t n) {
+	unsigned char* o = (unsigned char*)sb_tail_check(sb, 9);
+	int bytes, info, i;
 	
-	if(!v) {
-		//fprintf(stderr, "NULL value passed to %s()\n", __func__);
+	if(!o) return;
+	
+	if(n < 24) {
+		o[0] = (major << 5) | n;
+		sb->length++;
+		return;
+	}
+	
+	if(n <= 0xff) bytes = 1, info = 24;
+	else if(n <= 0xffff) bytes = 2, info = 25;
+	else if(n <= 0xffffffff) bytes = 4, info = 26;
+	else bytes = 8, info = 27;
+	
+	o[0] = (major << 5) | info;
+	for(i = bytes; i > 0; i--, n >>= 8) o[i] = n & 0xff;
+	
+	sb->length += 1 + bytes;
+}
+
+static void cbor_put_float(struct json_string_buffer* sb, double d) {
+	unsigned char* o = (unsigned char*)sb_tail_check(sb, 9);
+	float f = d;
+	uint64_t bits;
+	uint32_t fbits;
+	int i;
+	
+	if(!o) return;
+	
+	// floats that survive the trip through single precision take half the space
+	if((double)f == d) {
+		memcpy(&fbits, &f, 4);
+		o[0] = CBOR_FLOAT32;
+		for(i = 4; i > 0; i--, fbits >>= 8) o[i] = fbits & 0xff;
+		sb->length += 5;
 		return;
 	}
 	
+	memcpy(&bits, &d, 8);
+	o[0] = CBOR_FLOAT64;
+	for(i = 8; i > 0; i--, bits >>= 8) o[i] = bits & 0xff;
+	sb->length += 9;
+}
+
+static int is_comment(struct json_value* v) {
+	return v->type == JSON_TYPE_COMMENT_SINGLE || v->type == JSON_TYPE_COMMENT_MULTI;
+}
+
+static void cbor_encode_value(struct json_string_buffer* sb, struct json_value* v) {
+	struct json_link* l;
+	struct json_obj_field* f;
+	size_t i, n;
+	
 	switch(v->type) {
-		case JSON_TYPE_UNDEFINED:
-			sb_cat(sb, "undefined");
+		case JSON_TYPE_UNDEFINED: 
+			sb_putc(sb, CBOR_UNDEFINED);
 			break;
 			
-		case JSON_TYPE_NULL: 
-			sb_cat(sb, "null"); 
+		case JSON_TYPE_NULL:
+			sb_putc(sb, CBOR_NULL);
 			break;
 			
-		case JSON_TYPE_INT: // 2
-			sb_tail_catf(sb, "%ld", v->n); // TODO: handle bases, formats
+		case JSON_TYPE_BOOL:
+			sb_putc(sb, v->n ? CBOR_TRUE : CBOR_FALSE);
 			break;
 			
-		case JSON_TYPE_DOUBLE: 
-			sb_tail_catf(sb, float_format, v->d); // TODO: handle infinity, nan, etc
+		case JSON_TYPE_INT:
+			json_number_decode(v);
+			if(v->n >= 0) cbor_head(sb, CBOR_UINT, v->n);
+			else cbor_head(sb, CBOR_NEGINT, (uint64_t)(-1 - v->n));
 			break;
 			
-		case JSON_TYPE_STRING:
-			qc = ctx->fmt.useSingleQuotes ? '\'' : '"';
-			sb_putc(sb, qc);
-			sb_cat_escaped(ctx, v->s); 
-			sb_putc(sb, qc);
+		case JSON_TYPE_DOUBLE:
+			json_number_decode(v);
+			cbor_put_float(sb, v->d);
 			break;
 			
-		case JSON_TYPE_OBJ: 
-			json_obj_to_string(ctx, v);
+		case JSON_TYPE_STRING:
+			cbor_head(sb, CBOR_TEXT, v->len);
+			sb_cat_ref(sb, v->s, v->len);
 			break;
 			
-		case JSON_TYPE_ARRAY: // 6
-			json_arr_to_string(ctx, v);
-			break;
+		case JSON_TYPE_ARRAY:
+			// comments have no place in the binary form
+			for(n = 0, l = v->arr.head; l; l = l->next) n += !is_comment(l->v);
 			
-		case JSON_TYPE_COMMENT_SINGLE: // TODO: handle linebreaks in the comment string
-			sb_tail_catf(sb, "//%s\n", v->s);
+			cbor_head(sb, CBOR_ARRAY, n);
+			for(l = v->arr.head; l; l = l->next) {
+				if(!is_comment(l->v)) cbor_encode_value(sb, l->v);
+			}
 			break;
 			
-		case JSON_TYPE_COMMENT_MULTI: // TODO: clean "*/" out of the comment string
-			sb_tail_catf(sb, "/* %s */\n", v->s);
+		case JSON_TYPE_OBJ:
+			for(n = 0, i = 0; i < v->obj.alloc_size; i++) {
+				f = &v->obj.buckets[i];
+				n += f->key && !is_comment(f->value);
+			}
+			
+			cbor_head(sb, CBOR_MAP, n);
+			for(i = 0; i < v->obj.alloc_size; i++) {
+				f = &v->obj.buckets[i];
+				if(!f->key || is_comment(f->value)) continue;
+				
+				cbor_head(sb, CBOR_TEXT, f->key_len);
+				sb_cat_ref(sb, f->key, f->key_len);
+				cbor_encode_value(sb, f->value);
+			}
 			break;
 			
-		// default:
-			// fprintf(stderr, "c_json: unknown type in json_value_to_string\n");
+		default:
+			break;
 	}
 }
 
+int json_cbor_encode(struct json_string_buffer* sb, struct json_value* v) {
+	cbor_encode_value(sb, v);
+	return sb->sink_error;
+}
 
 
 
-static void ctx_indent(struct json_write_context* ctx) {
-	int i = 0; 
-	int len = ctx->fmt.indentAmt * ctx->depth;
+struct cbor_reader {
+	unsigned char* p;
+	unsigned char* end;
+	int depth;
+};
+
+// reads the argument after an initial byte. returns 0, or 1 for an indefinite length.
+static int cbor_arg(struct cbor_reader* r, int info, uint64_t* n, int* err) {
+	int bytes;
 	
-	char* c = sb_tail_check(ctx->sb, len);
+	if(info < 24) {
+		*n = info;
+		return 0;
+	}
 	
-	for(i = 0; i < len; i++) {
-		c[i] = ctx->fmt.indentChar;
+	if(info == CBOR_INDEFINITE) return 1;
+	
+	if(info > 27) {
+		*err = JSON_CBOR_ERROR_INVALID;
+		return 0;
 	}
 	
-	c[len] = 0;
-	ctx->sb->length += len;
+	bytes = 1 << (info - 24);
+	if(r->end - r->p < bytes) {
+		*err = JSON_PARSER_ERROR_UNEXPECTED_EOI;
+		return 0;
+	}
 	
-	ctx->sb->line_len += len;
+	for(*n = 0; bytes > 0; bytes--) *n = (*n << 8) | *r->p++;
+	
+	return 0;
 }
 
-static int line_too_long(struct json_write_context* ctx) {
-	if(ctx->fmt.maxLineLength < 0) return 0;
-	if(ctx->sb->line_len <= ctx->fmt.maxLineLength) return 0;
-	return 1;
+// RFC 8949 appendix D
+static double cbor_half(unsigned h) {
+	int e = (h >> 10) & 0x1f;
+	int m = h & 0x3ff;
+	double d;
+	
+	if(e == 0) d = ldexp(m, -24);
+	else if(e != 31) d = ldexp(m + 1024, e - 25);
+	else d = m == 0 ? INFINITY : NAN;
+	
+	return h & 0x8000 ? -d : d;
 }
 
-
-
-static void sb_cat_escaped(struct json_write_context* ctx, char* str) {
-	struct json_string_buffer* sb = ctx->sb;
-	char qc = ctx->fmt.useSingleQuotes ? '\'' : '"';
+// a text or byte string. *s points into the input unless the string came in
+//   chunks, in which case it is malloc'd and *owned is set.
+static int cbor_read_str(struct cbor_reader* r, int ib, char** s, size_t* len, int* owned) {
+	int major = ib >> 5;
+	int err = 0;
+	uint64_t n;
+	char* buf = NULL, *tmp;
+	size_t blen = 0;
+	
+	*owned = 0;
+	
+	if(!cbor_arg(r, ib & 0x1f, &n, &err)) {
+		if(err) return err;
+		if(n > (uint64_t)(r->end - r->p)) return JSON_PARSER_ERROR_UNEXPECTED_EOI;
+		
+		*s = (char*)r->p;
+		*len = n;
+		r->p += n;
+		return 0;
+	}
 	
-	while(*str) {
-		char c = *str;
+	// indefinite: definite chunks of the same major type up to a break
+	while(1) {
+		if(r->p >= r->end) { err = JSON_PARSER_ERROR_UNEXPECTED_EOI; break; }
 		
-		if(c == qc) sb_putc(sb, '\\');
-		sb_putc(sb, c);
+		ib = *r->p++;
+		if(ib == CBOR_BREAK) {
+			if(!buf && !(buf = json_mem_alloc(1))) { err = JSON_ERROR_OOM; break; }
+			
+			buf[blen] = 0;
+			*s = buf;
+			*len = blen;
+			*owned = 1;
+			return 0;
+		}
+		
+		if(ib >> 5 != major || cbor_arg(r, ib & 0x1f, &n, &err)) { err = JSON_CBOR_ERROR_INVALID; break; }
+		if(err) break;
+		if(n > (uint64_t)(r->end - r->p)) { err = JSON_PARSER_ERROR_UNEXPECTED_EOI; break; }
 		
-		str++;
+		tmp = json_mem_realloc(buf, blen + n + 1);
+		if(!tmp) { err = JSON_ERROR_OOM; break; }
+		buf = tmp;
+		
+		memcpy(buf + blen, r->p, n);
+		blen += n;
+		r->p += n;
 	}
 	
+	json_mem_free(buf);
+	return err;
 }
 
+static int cbor_read_value(struct cbor_reader* r, struct json_value** out);
 
-static void json_arr_to_string(struct json_write_context* ctx, struct json_value* arr) {
-	struct json_link* n;
-	struct json_string_buffer* sb = ctx->sb;
+// count is ignored for indefinite containers, which run up to a break
+static int cbor_read_array(struct cbor_reader* r, struct json_value* arr, uint64_t count, int indefinite) {
+	struct json_value* v;
+	int err;
+	
+	for(; indefinite || count > 0; count--) {
+		if(indefinite) {
+			if(r->p >= r->end) return JSON_PARSER_ERROR_UNEXPECTED_EOI;
+			if(*r->p == CBOR_BREAK) {
+				r->p++;
+				return 0;
+			}
+		}
+		
+		if((err = cbor_read_value(r, &v))) return err;
+		
+		if(json_array_push_tail(arr, v)) {
+			json_free(v);
+			return JSON_ERROR_OOM;
+		}
+	}
 	
-	int multiline = arr->len >= (size_t)ctx->fmt.minArraySzExpand;
+	return 0;
+}
+
+static int cbor_read_map(struct cbor_reader* r, struct json_value* obj, uint64_t count, int indefinite) {
+	struct json_value* v;
+	char* key;
+	size_t klen;
+	int err, ib, owned;
 	
-	sb_putc(sb, '[');
+	for(; indefinite || count > 0; count--) {
+		if(r->p >= r->end) return JSON_PARSER_ERROR_UNEXPECTED_EOI;
+		
+		ib = *r->p++;
+		if(indefinite && ib == CBOR_BREAK) return 0;
+		
+		// only string keys have a json equivalent
+		if(ib >> 5 != CBOR_TEXT && ib >> 5 != CBOR_BYTES) return JSON_CBOR_ERROR_UNSUPPORTED;
+		if((err = cbor_read_str(r, ib, &key, &klen, &owned))) return err;
+		
+		if((err = cbor_read_value(r, &v))) {
+			if(owned) json_mem_free(key);
+			return err;
+		}
+		
+		// the last of duplicate keys wins
+		err = owned ? json_obj_set_key_nodup_n(obj, key, klen, v) : json_obj_set_key_n(obj, key, klen, v);
+		if(err) {
+			if(owned) json_mem_free(key);
+			json_free(v);
+			return JSON_ERROR_OOM;
+		}
+	}
 	
-	if(multiline) sb_putc(sb, '\n');
+	return 0;
+}
+
+static int cbor_read_value(struct cbor_reader* r, struct json_value** out) {
+	struct json_value* v = NULL;
+	unsigned char* b;
+	uint64_t n, bits;
+	char* s;
+	size_t len, sz;
+	int ib, err = 0, indefinite, owned, i;
+	float f;
+	double d;
 	
-	ctx->depth++;
+	*out = NULL;
 	
-	n = arr->arr.head;
-	while(n) {
-		
-		if(multiline) ctx_indent(ctx);
+	if(r->p >= r->end) return JSON_PARSER_ERROR_UNEXPECTED_EOI;
+	if(r->depth >= JSON_CBOR_MAX_DEPTH) return JSON_CBOR_ERROR_TOO_DEEP;
+	
+	ib = *r->p++;
+	
+	switch(ib >> 5) {
+		case CBOR_UINT:
+		case CBOR_NEGINT:
+			if(cbor_arg(r, ib & 0x1f, &n, &err)) return JSON_CBOR_ERROR_INVALID;
+			if(err) return err;
+			
+			// out of int64_t range, like the text parser's big numbers
+			if(n > INT64_MAX) {
+				d = (double)n;
+				v = json_new_double(ib >> 5 == CBOR_UINT ? d : -1.0 - d);
+			}
+			else v = json_new_int(ib >> 5 == CBOR_UINT ? (int64_t)n : -1 - (int64_t)n);
+			break;
 		
-		json_stringify(ctx, n->v);
+		case CBOR_BYTES:
+		case CBOR_TEXT: // not checked for valid utf-8
+			if((err = cbor_read_str(r, ib, &s, &len, &owned))) return err;
+			
+			v = json_new_strn(s, len);
+			if(owned) json_mem_free(s);
+			break;
 		
-		n = n->next;
+		case CBOR_ARRAY:
+		case CBOR_MAP:
+			indefinite = cbor_arg(r, ib & 0x1f, &n, &err);
+			if(err) return err;
+			
+			// every element takes at least one byte, which keeps a bogus count from allocating
+			if(!indefinite && n > (uint64_t)(r->end - r->p)) return JSON_PARSER_ERROR_UNEXPECTED_EOI;
+			
+			if(ib >> 5 == CBOR_ARRAY) v = json_new_array();
+			else {
+				for(sz = 8; !indefinite && sz / 4 * 3 < n; sz *= 2);
+				v = json_new_object(sz);
+			}
+			if(!v) return JSON_ERROR_OOM;
+			
+			r->depth++;
+			if(ib >> 5 == CBOR_ARRAY) err = cbor_read_array(r, v, n, indefinite);
+			else err = cbor_read_map(r, v, n, indefinite);
+			r->depth--;
+			
+			if(err) {
+				json_free(v);
+				return err;
+			}
+			break;
 		
-		if(n) {
-			sb_putc(sb, ',');
-			if(!multiline) sb_putc(sb, ' ');
-		}
-		else if(ctx->fmt.trailingComma && multiline) sb_putc(sb, ',');
+		case CBOR_TAG: // dropped. the tagged item is decoded as is.
+			if(cbor_arg(r, ib & 0x1f, &n, &err)) return JSON_CBOR_ERROR_INVALID;
+			if(err) return err;
+			
+			r->depth++;
+			err = cbor_read_value(r, out);
+			r->depth--;
+			return err;
 		
-		if(multiline) sb_putc(sb, '\n');
-		if(line_too_long(ctx)) {
-			sb_putc(sb, '\n');
-			ctx_indent(ctx);
-		}
+		case CBOR_SIMPLE:
+			switch(ib) {
+				case CBOR_FALSE: v = json_new_false(); break;
+				case CBOR_TRUE: v = json_new_true(); break;
+				case CBOR_NULL: v = json_new_null(); break;
+				case CBOR_UNDEFINED: v = json_new_undefined(); break;
+				
+				case 0xf9: // half
+				case CBOR_FLOAT32:
+				case CBOR_FLOAT64:
+					sz = 2 << (ib - 0xf9);
+					if((size_t)(r->end - r->p) < sz) return JSON_PARSER_ERROR_UNEXPECTED_EOI;
+					
+					b = r->p;
+					for(bits = 0, i = 0; i < (int)sz; i++) bits = (bits << 8) | b[i];
+					r->p += sz;
+					
+					if(sz == 2) d = cbor_half(bits);
+					else if(sz == 4) {
+						uint32_t fb = bits;
+						memcpy(&f, &fb, 4);
+						d = f;
+					}
+					else memcpy(&d, &bits, 8);
+					
+					v = json_new_double(d);
+					break;
+				
+				case CBOR_BREAK: return JSON_CBOR_ERROR_INVALID;
+				default: return JSON_CBOR_ERROR_UNSUPPORTED;
+			}
+			break;
 	}
 	
-	ctx->depth--;
+	if(!v) return JSON_ERROR_OOM;
 	
-	if(multiline) ctx_indent(ctx);
+	*out = v;
+	return 0;
+}
+
+int json_cbor_decode(char* buf, size_t len, struct json_value** out, size_t* used) {
+	struct cbor_reader r;
+	int err;
 	
-	sb_putc(sb, ']');
+	r.p = (unsigned char*)buf;
+	r.end = r.p + len;
+	r.depth = 0;
+	
+	err = cbor_read_value(&r, out);
+	if(used) *used = (char*)r.p - buf;
+	
+	return err;
 }
 
 
-static int key_must_have_quotes(char* key) {
-	if(isdigit(key[0])) return 1;
-	return  strlen(key) != strspn(key, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_$");
-}
 
 
-static void json_obj_to_string(struct json_write_context* ctx, struct json_value* obj) {
-	size_t i;
-	struct json_obj_field* f;
-	struct json_string_buffer* sb = ctx->sb;
-	
-	int multiline = obj->len >= (size_t)ctx->fmt.minObjSzExpand;
-	int noquotes = ctx->fmt.noQuoteKeys;
-	char quoteChar = ctx->fmt.useSingleQuotes ? '\'' : '"';
+///////////////////
+//     Image     //
+///////////////////
+
+// the tree is written out as its own structs, with every pointer set to where it
+//   will be if the file is mapped at the image's base address. mapped there, it is
+//   ready to use as is and its pages are shared by every process that maps it.
+//   anywhere else, a private copy of the pages gets relocated.
+
+#ifndef _WIN32
+
+#define JSON_IMAGE_MAGIC "CJSONIMG"
+#define JSON_IMAGE_VERSION 2 // 2: containers carry their hash
+#define JSON_IMAGE_HDR_SIZE 64
+
+struct json_image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian; // 0x01020304 as written
+	uint16_t sz_value, sz_link, sz_field, sz_ptr; // the layout has to match
+	uint64_t base;
+	uint64_t size;
+	uint64_t root; // offset of the root value
+};
+
+struct img_writer {
+	struct json_string_buffer* sb;
+	uint64_t off;
+	uintptr_t base;
+	int err;
+};
+
+#define img_ptr(w, o) ((void*)((w)->base + (uintptr_t)(o)))
+
+// everything is 8-byte aligned. returns the offset it was written at.
+static uint64_t img_put(struct img_writer* w, void* p, size_t len) {
+	static char zeros[8];
+	uint64_t off = w->off;
+	size_t pad = (8 - (len & 7)) & 7;
 	
-	sb_putc(sb, '{');
+	sb_catn(w->sb, p, len);
+	if(pad) sb_catn(w->sb, zeros, pad);
 	
-	if(multiline) sb_putc(sb, '\n');
+	w->off += len + pad;
+	return off;
+}
+
+// children go out before their parents, so every offset a struct needs is already known.
+//   containers carry their json_hash, built from the children's as they go out, since
+//   the mapping is read-only and nothing in it can change.
+static uint64_t img_write(struct img_writer* w, struct json_value* v, unsigned int* hash) {
+	struct json_value c = *v;
+	struct json_link* l, nl;
+	struct json_obj_field* f, nf;
+	uint64_t* offs, first, h;
+	unsigned int ch;
+	size_t i, n;
 	
-	ctx->depth++;
+	c.refs = 0;
+	c.hash = 0;
 	
-	size_t n = obj->len;
-	for(i = 0; i < obj->obj.alloc_size; i++) {
-		f = &obj->obj.buckets[i];
-		if(f->key == NULL) continue;
+	switch(v->type) {
+		case JSON_TYPE_INT:
+		case JSON_TYPE_DOUBLE:
+			// the source text doesn't come along
+			json_number_decode(v);
+			c = *v;
+			c.flags &= ~(JSON_NUM_SRC | JSON_NUM_LAZY);
+			c.len = 0;
+			break;
 		
-		if(multiline) ctx_indent(ctx);
+		case JSON_TYPE_STRING:
+		case JSON_TYPE_COMMENT_SINGLE:
+		case JSON_TYPE_COMMENT_MULTI:
+			c.s = img_ptr(w, img_put(w, v->s, v->len + 1));
+			break;
 		
-		int needquotes = key_must_have_quotes(f->key); 
+		case JSON_TYPE_ARRAY:
+			for(n = 0, l = v->arr.head; l; l = l->next) n++;
+			
+			offs = json_mem_alloc(sizeof(*offs) * (n ? n : 1));
+			if(!offs) {
+				w->err = 1;
+				return 0;
+			}
+			
+			h = JSON_TYPE_ARRAY;
+			for(i = 0, l = v->arr.head; l; l = l->next) {
+				offs[i++] = img_write(w, l->v, &ch);
+				h = hash_elem(h, ch);
+			}
+			c.hash = hash_fold(h);
+			
+			// the links are contiguous
+			first = w->off;
+			for(i = 0; i < n; i++) {
+				nl.prev = i > 0 ? img_ptr(w, first + (i - 1) * sizeof(nl)) : NULL;
+				nl.next = i < n - 1 ? img_ptr(w, first + (i + 1) * sizeof(nl)) : NULL;
+				nl.v = img_ptr(w, offs[i]);
+				img_put(w, &nl, sizeof(nl));
+			}
+			json_mem_free(offs);
+			
+			c.len = n;
+			c.arr.head = n ? img_ptr(w, first) : NULL;
+			c.arr.tail = n ? img_ptr(w, first + (n - 1) * sizeof(nl)) : NULL;
+			break;
 		
-		if(!noquotes || needquotes) {
-			sb_putc(sb, quoteChar);
-			sb_cat_escaped(ctx, f->key);
-			sb_putc(sb, quoteChar);
-		}
-		else sb_cat(sb, f->key);
+		case JSON_TYPE_OBJ:
+			// key and value offsets for each bucket
+			offs = json_mem_calloc(1, sizeof(*offs) * 2 * (v->obj.alloc_size ? v->obj.alloc_size : 1));
+			if(!offs) {
+				w->err = 1;
+				return 0;
+			}
+			
+			h = 0;
+			for(i = 0; i < v->obj.alloc_size; i++) {
+				f = &v->obj.buckets[i];
+				if(!f->key) continue;
+				
+				offs[i * 2] = img_put(w, f->key, f->key_len + 1);
+				offs[i * 2 + 1] = img_write(w, f->value, &ch);
+				h += hash_member(f->hash, ch);
+			}
+			c.hash = hash_fold(hash_obj_end(h, v->len));
+			
+			// same table, same hashes, so lookups work unchanged
+			first = w->off;
+			for(i = 0; i < v->obj.alloc_size; i++) {
+				f = &v->obj.buckets[i];
+				memset(&nf, 0, sizeof(nf));
+				
+				if(f->key) {
+					nf = *f;
+					nf.key = img_ptr(w, offs[i * 2]);
+					nf.value = img_ptr(w, offs[i * 2 + 1]);
+				}
+				img_put(w, &nf, sizeof(nf));
+			}
+			json_mem_free(offs);
+			
+			c.obj.buckets = img_ptr(w, first);
+			break;
 		
+		default:
+			break;
+	}
+	
+	*hash = c.hash ? c.hash : json_hash(v);
+	return img_put(w, &c, sizeof(c));
+}
+
+int json_save_image(char* path, struct json_value* root, void* base) {
+	struct json_image_header h = {0};
+	struct img_writer w = {0};
+	unsigned int rh;
+	char hdr[JSON_IMAGE_HDR_SIZE] = {0};
+	int fd, err;
+	
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) return 1;
+	
+	w.sb = json_string_buffer_create_sink(1 << 16, json_sink_fd, (void*)(intptr_t)fd);
+	if(!w.sb) {
+		close(fd);
+		return 1;
+	}
+	w.base = base ? (uintptr_t)base : JSON_IMAGE_BASE;
+	
+	// the header is filled in once the root's offset is known
+	img_put(&w, hdr, sizeof(hdr));
+	
+	memcpy(h.magic, JSON_IMAGE_MAGIC, 8);
+	h.version = JSON_IMAGE_VERSION;
+	h.endian = 0x01020304;
+	h.sz_value = sizeof(struct json_value);
+	h.sz_link = sizeof(struct json_link);
+	h.sz_field = sizeof(struct json_obj_field);
+	h.sz_ptr = sizeof(void*);
+	h.base = w.base;
+	h.root = img_write(&w, root, &rh);
+	h.size = w.off;
+	memcpy(hdr, &h, sizeof(h));
+	
+	err = json_string_buffer_flush(w.sb) || w.err;
+	json_string_buffer_free(w.sb);
+	json_mem_free(w.sb);
+	
+	if(!err && (lseek(fd, 0, SEEK_SET) || write(fd, hdr, sizeof(hdr)) != sizeof(hdr))) err = 1;
+	if(close(fd)) err = 1;
+	
+	return err;
+}
+
+
+#define img_reloc(p, d) ((p) = (void*)((uintptr_t)(p) + (d)))
+
+// for an image that couldn't be mapped at its base
+static void img_relocate(struct json_value* v, uintptr_t d) {
+	struct json_link* l;
+	struct json_obj_field* f;
+	size_t i;
+	
+	switch(v->type) {
+		case JSON_TYPE_STRING:
+		case JSON_TYPE_COMMENT_SINGLE:
+		case JSON_TYPE_COMMENT_MULTI:
+			img_reloc(v->s, d);
+			break;
 		
-		sb_putc(sb, ':');
-		if(ctx->fmt.objColonSpace) sb_putc(sb, ' ');
+		case JSON_TYPE_ARRAY:
+			if(!v->arr.head) break;
+			
+			img_reloc(v->arr.head, d);
+			img_reloc(v->arr.tail, d);
+			for(l = v->arr.head; l; l = l->next) {
+				if(l->prev) img_reloc(l->prev, d);
+				if(l->next) img_reloc(l->next, d);
+				img_reloc(l->v, d);
+				img_relocate(l->v, d);
+			}
+			break;
 		
+		case JSON_TYPE_OBJ:
+			img_reloc(v->obj.buckets, d);
+			for(i = 0; i < v->obj.alloc_size; i++) {
+				f = &v->obj.buckets[i];
+				if(!f->key) continue;
+				
+				img_reloc(f->key, d);
+				img_reloc(f->value, d);
+				img_relocate(f->value, d);
+			}
+			break;
 		
-		json_stringify(ctx, f->value);
+		default:
+			break;
+	}
+}
+
+int json_map_image(char* path, struct json_image* img) {
+	struct json_image_header h;
+	struct stat st;
+	char* p = MAP_FAILED;
+	int fd, flags = MAP_SHARED;
+	
+	fd = open(path, O_RDONLY);
+	if(fd < 0) return 1;
+	
+	if(fstat(fd, &st) || st.st_size < JSON_IMAGE_HDR_SIZE
+		|| read(fd, &h, sizeof(h)) != sizeof(h)
+		|| memcmp(h.magic, JSON_IMAGE_MAGIC, 8) || h.version != JSON_IMAGE_VERSION || h.endian != 0x01020304
+		|| h.sz_value != sizeof(struct json_value) || h.sz_link != sizeof(struct json_link)
+		|| h.sz_field != sizeof(struct json_obj_field) || h.sz_ptr != sizeof(void*)
+		|| h.size != (uint64_t)st.st_size || h.root >= h.size
+	) {
+		close(fd);
+		return 1;
+	}
+	
+#ifdef MAP_FIXED_NOREPLACE
+	flags |= MAP_FIXED_NOREPLACE;
+#endif
+	
+	if(h.base) {
+		p = mmap((void*)(uintptr_t)h.base, h.size, PROT_READ, flags, fd, 0);
 		
-		if(n-- > 1) {
-			sb_putc(sb, ',');
-			if(!multiline) sb_putc(sb, ' ');
+		// older kernels treat the address as a hint
+		if(p != MAP_FAILED && p != (char*)(uintptr_t)h.base) {
+			munmap(p, h.size);
+			p = MAP_FAILED;
 		}
-		else if(ctx->fmt.trailingComma && multiline) sb_putc(sb, ',');
-		
-		if(multiline) sb_putc(sb, '\n');
-		if(line_too_long(ctx)) {
-			sb_putc(sb, '\n');
-			ctx_indent(ctx);
+	}
+	
+	if(p == MAP_FAILED) {
+		p = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(p == MAP_FAILED) {
+			close(fd);
+			return 1;
 		}
+		
+		img_relocate((struct json_value*)(p + h.root), (uintptr_t)p - (uintptr_t)h.base);
+		mprotect(p, h.size, PROT_READ);
 	}
 	
-	ctx->depth--;
+	close(fd);
 	
-	if(multiline) ctx_indent(ctx);
-	sb_putc(sb, '}');
+	img->root = (struct json_value*)(p + h.root);
+	img->addr = p;
+	img->size = h.size;
+	
+	return 0;
 }
 
+void json_unmap_image(struct json_image* img) {
+	if(img->addr) munmap(img->addr, img->size);
+	
+	img->root = NULL;
+	img->addr = NULL;
+	img->size = 0;
+}
+
+#endif // _WIN32
+
 
 struct json_value* json_new_str(char* s) {
 	return json_new_strn(s, strlen(s));
@@ -2588,11 +6696,21 @@ struct json_value* json_new_str(char* s) {
 struct json_value* json_new_strn(char* s, size_t len) {
 	struct json_value* v;
 	
-	v = malloc(sizeof(*v));
+	v = value_alloc();
+	if(!v) return NULL;
+	
 	v->type = JSON_TYPE_STRING;
-	v->s = strndup(s, len);
+	v->s = json_memdup(s, len);
+	if(!v->s) {
+		value_free(v);
+		return NULL;
+	}
+
 	v->len = len;
 	v->base = 0;
+	v->flags = json_str_flags(s, len);
+	v->refs = 0;
+	v->hash = 0;
 	
 	return v;
 }
@@ -2600,11 +6718,14 @@ struct json_value* json_new_strn(char* s, size_t len) {
 struct json_value* json_new_double(double d) {
 	struct json_value* v;
 	
-	v = malloc(sizeof(*v));
+	v = value_alloc();
 	v->type = JSON_TYPE_DOUBLE;
 	v->d = d;
 	v->len = 0;
 	v->base = 0;
+	v->flags = 0;
+	v->refs = 0;
+	v->hash = 0;
 	
 	return v;
 }
@@ -2612,11 +6733,14 @@ struct json_value* json_new_double(double d) {
 struct json_value* json_new_int(int64_t n) {
 	struct json_value* v;
 	
-	v = malloc(sizeof(*v));
+	v = value_alloc();
 	v->type = JSON_TYPE_INT;
 	v->n = n;
 	v->len = 0;
 	v->base = 0;
+	v->flags = 0;
+	v->refs = 0;
+	v->hash = 0;
 	
 	return v;
 }
@@ -2624,27 +6748,33 @@ struct json_value* json_new_int(int64_t n) {
 struct json_value* json_new_array() {
 	struct json_value* v;
 	
-	v = malloc(sizeof(*v));
+	v = value_alloc();
 	v->type = JSON_TYPE_ARRAY;
 	v->arr.head = NULL;
 	v->arr.tail = NULL;
 	v->len = 0;
 	v->base = 0;
+	v->flags = 0;
+	v->refs = 0;
+	v->hash = 0;
 	
 	return v;
 }
 
 struct json_value* json_new_object(size_t initial_alloc_size) {
 	
-	struct json_value* obj = malloc(sizeof(*obj));
+	struct json_value* obj = value_alloc();
 	
 	obj->type = JSON_TYPE_OBJ;
 	obj->len = 0;
 	obj->base = 0;
+	obj->flags = 0;
+	obj->refs = 0;
+	obj->hash = 0;
 	obj->obj.alloc_size = initial_alloc_size;
-	obj->obj.buckets = calloc(1, sizeof(*obj->obj.buckets) * obj->obj.alloc_size);
+	obj->obj.buckets = buckets_alloc(obj->obj.alloc_size);
 	if(!obj->obj.buckets) {
-		free(obj);
+		value_free(obj);
 		return NULL;
 	}
 	
@@ -2654,8 +6784,13 @@ struct json_value* json_new_object(size_t initial_alloc_size) {
 struct json_value* json_new_null() {
 	struct json_value* v;
 	
-	v = malloc(sizeof(*v));
+	v = value_alloc();
 	v->type = JSON_TYPE_NULL;
+	v->len = 0;
+	v->base = 0;
+	v->flags = 0;
+	v->refs = 0;
+	v->hash = 0;
 	
 	return v;
 }
@@ -2663,8 +6798,13 @@ struct json_value* json_new_null() {
 struct json_value* json_new_undefined() {
 	struct json_value* v;
 	
-	v = malloc(sizeof(*v));
+	v = value_alloc();
 	v->type = JSON_TYPE_UNDEFINED;
+	v->len = 0;
+	v->base = 0;
+	v->flags = 0;
+	v->refs = 0;
+	v->hash = 0;
 	
 	return v;
 }
@@ -2672,11 +6812,14 @@ struct json_value* json_new_undefined() {
 struct json_value* json_new_true() {
 	struct json_value* v;
 	
-	v = malloc(sizeof(*v));
+	v = value_alloc();
 	v->type = JSON_TYPE_BOOL;
 	v->n = 1; // true
 	v->len = 0;
 	v->base = 0;
+	v->flags = 0;
+	v->refs = 0;
+	v->hash = 0;
 	
 	return v;
 }
@@ -2684,11 +6827,14 @@ struct json_value* json_new_true() {
 struct json_value* json_new_false() {
 	struct json_value* v;
 	
-	v = malloc(sizeof(*v));
+	v = value_alloc();
 	v->type = JSON_TYPE_BOOL;
 	v->n = 0; // false
 	v->len = 0;
 	v->base = 0;
+	v->flags = 0;
+	v->refs = 0;
+	v->hash = 0;
 	
 	return v;
 }
@@ -71,6 +71,7 @@ JSON_TYPEDEF enum json_error {
 	JSON_LEX_ERROR_INVALID_STRING,
 	JSON_LEX_ERROR_UNEXPECTED_END_OF_INPUT,
 	JSON_LEX_ERROR_INVALID_CHAR,
+	JSON_LEX_ERROR_INVALID_UTF8,
 	
 	JSON_PARSER_ERROR_CORRUPT_STACK,
 	JSON_PARSER_ERROR_STACK_EXHAUSTED,
@@ -79,6 +80,14 @@ JSON_TYPEDEF enum json_error {
 	JSON_PARSER_ERROR_BRACE_MISMATCH,
 	JSON_PARSER_ERROR_BRACKET_MISMATCH,
 	
+	JSON_CBOR_ERROR_INVALID,
+	JSON_CBOR_ERROR_UNSUPPORTED,
+	JSON_CBOR_ERROR_TOO_DEEP,
+	
+	JSON_PATCH_ERROR_INVALID,
+	JSON_PATCH_ERROR_PATH,
+	JSON_PATCH_ERROR_TEST_FAILED,
+	
 	JSON_ERROR_MAXVALUE
 } JSON_TD(json_error_e);
 
@@ -86,11 +95,23 @@ JSON_TYPEDEF enum json_error {
 struct json_obj_field;
 struct json_link;
 
+// json_value.flags
+#define JSON_NUM_SRC  0x0001 // num.src/len hold the number's original text
+#define JSON_NUM_LAZY 0x0002 // n/d haven't been decoded from num.src yet
+// strings, set by the parser and json_new_str*. a set bit is a guarantee; a clear
+//   one just means the serializer checks for itself. clear them if you change s.
+#define JSON_STR_CLEAN 0x0004 // no quotes, backslashes or control chars
+#define JSON_STR_ASCII 0x0008 // nothing above 0x7f
+#define JSON_STR_IDENT 0x0010 // [A-Za-z_$][A-Za-z0-9_$]*, so it can be an unquoted key
+
 JSON_TYPEDEF struct json_value {
 	enum json_type type;
-	int base;
+	short base;
+	unsigned short flags;
+	unsigned int refs; // owners besides the first. see json_retain.
+	unsigned int hash; // containers that can't change: json_hash, cached. otherwise 0.
 	
-	size_t len;
+	size_t len; // strings: byte length, not counting the terminator. arrays/objects: element count
 	
 	union {
 		int64_t n;
@@ -104,6 +125,10 @@ JSON_TYPEDEF struct json_value {
 		struct {
 			struct json_link* head, *tail;
 		} arr;
+		struct {
+			uint64_t bits; // n or d, once decoded
+			char* src; // points into the source retained by the json_file
+		} num;
 	};
 } JSON_TD(json_value_t);
 
@@ -117,10 +142,19 @@ JSON_TYPEDEF struct json_link {
 
 
 
+// every allocation the library makes goes through one of these. user is passed back.
+JSON_TYPEDEF struct json_allocator {
+	void* (*alloc)(void* user, size_t size);
+	void* (*realloc)(void* user, void* p, size_t size);
+	void (*free)(void* user, void* p);
+	void* user;
+} JSON_TD(json_allocator_t);
+
 JSON_TYPEDEF struct json_file {
 	struct json_value* root;
 	
-	void* lex_info; // don't poke around in here...
+	void* lex_info; // don't poke around in here... (the source retained for lazy_numbers)
+	struct json_allocator* allocator; // the parse's override, used again by json_file_free
 	
 	enum json_error error;
 	char* error_str;
@@ -130,11 +164,59 @@ JSON_TYPEDEF struct json_file {
 } JSON_TD(json_file_t);
 
 
+JSON_TYPEDEF struct json_parse_options {
+	// RFC 8259 only. rejects comments, single quotes and backticks, unquoted keys,
+	//   hex/octal/binary numbers, undefined/infinity, C-style escapes,
+	//   control characters in strings and extra or trailing commas. 
+	char strict;
+	
+	// reject strings that aren't valid utf-8 once their escapes are decoded, so
+	//   relaxed \x escapes can't produce bad bytes either. plain ascii isn't rescanned.
+	char validate_utf8;
+	
+	// numbers are kept as spans of the source and only converted by json_as_*.
+	//   the json_file keeps a copy of the source alive for them, so values
+	//   must not outlive it. stringify writes the original text back out.
+	//   read numbers through json_as_*, not n/d directly.
+	char lazy_numbers;
+	
+	// the parsed tree is passed through json_intern with this pool
+	struct json_intern_pool* intern;
+	
+	// overrides the thread's allocator for the parse. the tree has to be freed with
+	//   it in effect too; json_file_free does that, otherwise see json_set_thread_allocator.
+	struct json_allocator* allocator;
+} JSON_TD(json_parse_options_t);
+
+
+// same layout as struct iovec, so the list can go straight to writev()
+JSON_TYPEDEF struct json_iovec {
+	void* iov_base;
+	size_t iov_len;
+} JSON_TD(json_iovec_t);
+
+// receives output from a string buffer as it fills. returns 0 on success.
+typedef int (*json_sink_fn)(void* user, char* buf, size_t len);
+
 JSON_TYPEDEF struct json_string_buffer {
 	char* buf;
 	size_t length;
 	size_t alloc;
 	int line_len;
+	
+	// optional. buf becomes a fixed-size staging area that is handed to
+	//   the sink whenever it fills, instead of growing.
+	json_sink_fn sink;
+	void* sink_user;
+	int sink_error; // the first non-zero sink return, or JSON_ERROR_OOM if buf couldn't
+	                //   grow. later output is dropped.
+	
+	// optional, and not together with a sink. long clean runs of strings are
+	//   referenced here instead of copied into buf.
+	struct json_iovec* iov;
+	int iov_cnt;
+	int iov_alloc;
+	size_t iov_mark; // how much of buf the list already covers
 } JSON_TD(json_string_buffer_t);
 
 
@@ -146,12 +228,13 @@ JSON_TYPEDEF struct json_output_format {
 	char objColonSpace;
 	char noQuoteKeys;
 	char useSingleQuotes;
-// 	char escapeNonLatin;
+	char escapeNonAscii; // write everything above 0x7f as \uXXXX
 // 	char breakLongStrings;
 	int minArraySzExpand;
 	int minObjSzExpand;
 	int maxLineLength; // only wraps after the comma on array/obj elements
-	char* floatFormat;
+	char* floatFormat; // printf format for doubles. NULL for the shortest round-trip form
+	char minify; // compact RFC 8259 output. everything above except floatFormat is ignored
 } JSON_TD(json_output_format_t);
 
 
@@ -172,11 +255,12 @@ Type coercion rules:
 	number -> string = sprintf, accoding to some nice rules.
 	string -> number = strtod/i
 	
-Strings are always dup'd. You must free them yourself.
+Strings are always dup'd. You must free them yourself, with json_mem_free.
 
 JSON_TYPE_INT is assumed to be C int
 
 Numbers over 2^63 are not properly supported yet. they will be truncated to 0
+Parse with lazy_numbers to keep the original text; json_as_strdup returns it.
 */
 int json_as_type(struct json_value* v, enum json_type t, void* out); 
 int64_t json_as_int(struct json_value* v); 
@@ -200,9 +284,22 @@ struct json_value* json_array_pop_head(struct json_value* arr);
 size_t json_array_calc_length(struct json_value* arr);
 
 int json_obj_get_key(struct json_value* obj, char* key, struct json_value** val);
+// obj takes val. if key is already there, its old value is json_free'd: it belonged
+//   to obj, so don't free it yourself, and json_retain it first to keep it.
 int json_obj_set_key(struct json_value* obj, char* key, struct json_value* val);
 int json_obj_set_key_nodup(struct json_value* obj, char* key, struct json_value* val); // takes ownership of key's memory
 
+// the _n versions take the key's length, so keys can contain null bytes.
+//   the plain ones strlen the key and call these.
+int json_obj_get_key_n(struct json_value* obj, char* key, size_t len, struct json_value** val);
+int json_obj_set_key_n(struct json_value* obj, char* key, size_t len, struct json_value* val);
+int json_obj_set_key_nodup_n(struct json_value* obj, char* key, size_t len, struct json_value* val); // key must be json_mem_alloc'd with a null at key[len]
+struct json_value* json_obj_get_val_n(struct json_value* obj, char* key, size_t len);
+
+// frees the key and its value. returns 0 if the key was there.
+int json_obj_delete_key(struct json_value* obj, char* key);
+int json_obj_delete_key_n(struct json_value* obj, char* key, size_t len);
+
 // will probably be changed or removed later
 // coerces and strdup's the result
 // returns null if the key does not exist
@@ -211,7 +308,8 @@ char* json_obj_key_as_string(struct json_value* obj, char* key);
 // returns a newly allocated string, or NULL if it's not a string
 char* json_obj_get_strdup(struct json_value* obj, char* key);
 
-// returns pointer to the internal string, or null if it's not a string
+// returns pointer to the internal string, or null if it's not a string.
+//   the value's len is the real length; the string may contain nulls.
 char* json_obj_get_str(struct json_value* obj, char* key);
 
 // returns a double or the default value if it's not an integer
@@ -229,21 +327,104 @@ struct json_value* json_obj_get_val(struct json_value* obj, char* key);
 // returns 0 when there is none left
 // set iter to NULL to start
 int json_obj_next(struct json_value* val, void** iter, char** key, struct json_value** value);
+int json_obj_next_n(struct json_value* val, void** iter, char** key, size_t* key_len, struct json_value** value);
 
 struct json_value* json_deep_copy(struct json_value* v);
+// into gets copies of from's values
 void json_merge(struct json_value* into, struct json_value* from); 
+// the same merge without copying: into's containers take references to from's
+//   values. they're shared, so json_obj_get_mut or
+//   json_unshare before changing anything that came from from.
+void json_merge_shared(struct json_value* into, struct json_value* from);
+// the same merge, but from is consumed: its keys, values and array links are moved
+//   into into rather than copied or retained. don't use from afterwards.
+void json_merge_move(struct json_value* into, struct json_value* from);
+// rfc 7396. null in patch deletes the key, objects merge recursively and anything
+//   else replaces the target's value. consumes patch like json_merge_move; pass
+//   json_retain(patch) to apply the same one repeatedly.
+void json_merge_patch(struct json_value* target, struct json_value* patch);
+
+// structural hash. equal values hash the same regardless of object key order, and
+//   numbers hash by value, so 1 and 1.0 match. a tree that can still change is
+//   hashed in full every time; only json_intern's canonical containers and
+//   mapped images keep theirs in v->hash, since nothing below them can change.
+unsigned int json_hash(struct json_value* v);
+// deep comparison, rfc 6902 style: numbers by exact value, so 1 equals 1.0 but
+//   2^53 + 1 doesn't equal the double it rounds to. objects in any order.
+//   containers that both have cached hashes reject at once if they differ.
+int json_equal(struct json_value* a, struct json_value* b);
+
+// rfc 6902. returns an array of operations that turns a into b, or NULL if out of
+//   memory. added and replaced values are references to b's, not copies.
+struct json_value* json_diff(struct json_value* a, struct json_value* b);
+// applies all of patch to *doc or none of it. *doc may be replaced, and is left
+//   untouched when an operation fails. returns 0 or a json_error. patch is not
+//   consumed; the values it adds are shared with it.
+int json_patch_apply(struct json_value** doc, struct json_value* patch);
+
+// hash-consing. json_intern takes v and returns a tree in which every scalar and
+//   every container of up to JSON_INTERN_MAX_LEN members is a shared reference
+//   to the one copy of it in the pool, so repeated subtrees are stored once.
+//   the result is shared like anything json_retain'd: json_unshare before
+//   changing it. numbers are decoded and lose their source text. pools aren't
+//   thread safe, and keep their values alive until json_intern_pool_free.
+struct json_intern_pool;
+struct json_intern_pool* json_intern_pool_new(void);
+void json_intern_pool_free(struct json_intern_pool* p);
+struct json_value* json_intern(struct json_intern_pool* p, struct json_value* v);
+
+/*
+Sharing:
+	json_retain is an O(1) copy: it adds an owner and returns v. json_free drops
+	one owner and only frees v with the last. the counts are atomic.
+	
+	a value with more than one owner must not be modified. json_unshare gives
+	the caller a value of its own to modify: v itself if it has no other owners,
+	otherwise a copy whose containers share v's children, with the caller's
+	reference moved to it. json_obj_get_mut does the same for the value under
+	a key and stores the result back, so obj itself must already be unshared.
+	for arrays, l->v = json_unshare(l->v). both return NULL if out of memory.
+	
+	so changing one field of a shared template copies only the path to it:
+		doc = json_unshare(json_retain(tmpl));
+		srv = json_obj_get_mut(doc, "server");
+		json_obj_set_key(srv, "port", json_new_int(8080));
+*/
+struct json_value* json_retain(struct json_value* v);
+struct json_value* json_unshare(struct json_value* v);
+struct json_value* json_obj_get_mut(struct json_value* obj, char* key);
+struct json_value* json_obj_get_mut_n(struct json_value* obj, char* key, size_t len);
 
 #ifndef JSON_NO_STDIO
 struct json_file* json_load_path(char* path);
 struct json_file* json_read_file(FILE* f);
+struct json_file* json_load_path_opts(char* path, struct json_parse_options* opts);
+struct json_file* json_read_file_opts(FILE* f, struct json_parse_options* opts);
 #endif 
 
+// source must have a null byte at source[len]
 struct json_file* json_parse_string(char* source, size_t len);
+// opts may be NULL for the default, relaxed parsing
+struct json_file* json_parse_string_opts(char* source, size_t len, struct json_parse_options* opts);
 
 // recursive.
 void json_free(struct json_value* v);
 void json_file_free(struct json_file* jsf);
 
+// keeps the parser's state warm across parses, for hot loops over small documents.
+//   opts are copied, and every parse made with the context uses them. a context
+//   is used by one thread at a time.
+struct json_parser_ctx;
+struct json_parser_ctx* json_parser_ctx_new(struct json_parse_options* opts);
+void json_parser_ctx_free(struct json_parser_ctx* ctx);
+// the same as json_parse_string_opts with the context's options
+struct json_file* json_parser_ctx_parse(struct json_parser_ctx* ctx, char* source, size_t len);
+// skips the json_file. returns 0 or a json_error, with the root, or NULL, in *out.
+//   lazy numbers point straight into source, which has to outlive them.
+int json_parser_ctx_parse_value(struct json_parser_ctx* ctx, char* source, size_t len, struct json_value** out);
+// the last parse's error, and where it happened
+enum json_error json_parser_ctx_error(struct json_parser_ctx* ctx, long* line_num, long* char_num);
+
 struct json_value* json_new_str(char* s);
 struct json_value* json_new_strn(char* s, size_t len);
 struct json_value* json_new_double(double d);
@@ -258,6 +439,26 @@ struct json_value* json_new_false(void);
 
 
 
+// memory is always freed through the allocator that allocated it, so set this before
+//   the library allocates anything. NULL goes back to malloc. a stays in use.
+void json_set_allocator(struct json_allocator* a);
+// the same for the calling thread only, taking precedence over the global one.
+//   returns the thread's previous one. json_stringify_parallel's workers inherit it.
+struct json_allocator* json_set_thread_allocator(struct json_allocator* a);
+// from the current allocator. for keys given to json_obj_set_key_nodup, and for
+//   freeing what the library hands back: json_as_strdup's strings, buffers' structs.
+void* json_mem_alloc(size_t size);
+void json_mem_free(void* p);
+// each thread keeps up to JSON_FREELIST_MAX freed values, links and 8/16/32 bucket
+//   tables per size class for reuse, while no custom allocator is in effect. they
+//   go back to malloc when the thread exits, or now with this. build with
+//   JSON_NO_FREELISTS to turn the caches off, e.g. for memory checkers.
+void json_thread_cache_release(void);
+
+
+// returns 0 if s is valid utf-8. uses SSSE3 when the cpu has it.
+int json_utf8_validate(char* s, size_t len);
+
 char* json_get_type_str(enum json_type t); 
 char* json_get_err_str(enum json_error e);
 
@@ -268,8 +469,71 @@ void json_dump_value(struct json_value* root, int cur_depth, int max_depth);
 struct json_string_buffer* json_string_buffer_create(size_t initSize);
 void json_string_buffer_free(struct json_string_buffer* sb);
 
+// streaming output. call json_string_buffer_flush after the last json_stringify.
+struct json_string_buffer* json_string_buffer_create_sink(size_t bufSize, json_sink_fn sink, void* user);
+// writes out anything still buffered. returns sb->sink_error: nonzero if the output is
+//   incomplete, for any kind of buffer.
+int json_string_buffer_flush(struct json_string_buffer* sb);
+
+// scatter-gather output. unescaped runs of at least JSON_IOV_MIN_REF bytes are
+//   referenced from the values' strings rather than copied.
+struct json_string_buffer* json_string_buffer_create_iov(size_t initSize);
+// call once after the last json_stringify. the entries point into sb->buf and into
+//   the values, so both must outlive the list. NULL if there is no list, or the
+//   output is incomplete.
+struct json_iovec* json_string_buffer_iov(struct json_string_buffer* sb, int* count);
+
+// ready-made sinks. user is the FILE*, or the fd cast with (void*)(intptr_t)
+#ifndef JSON_NO_STDIO
+int json_sink_file(void* user, char* buf, size_t len);
+#endif
+int json_sink_fd(void* user, char* buf, size_t len);
+
 void json_stringify(struct json_write_context* ctx, struct json_value* v);
 
+// splits a large root array across nthreads threads (<= 0 for one per cpu). the output
+//   is identical to json_stringify. define JSON_NO_THREADS to build without pthreads.
+void json_stringify_parallel(struct json_write_context* ctx, struct json_value* v, int nthreads);
+
+// one-shot serialization. fmt may be NULL for minified output.
+// the exact length json_stringify_to needs, not counting the null terminator
+size_t json_stringify_measure(struct json_value* v, struct json_output_format* fmt);
+// snprintf semantics: writes at most cap - 1 bytes plus a terminator and returns the
+//   full length, so a return >= cap means the output was truncated.
+//   returns 0 if it runs out of memory.
+size_t json_stringify_to(char* buf, size_t cap, struct json_value* v, struct json_output_format* fmt);
+
+
+// CBOR (RFC 8949). every type maps one to one: ints stay ints, doubles stay doubles
+//   (sent as float32 when that is exact), undefined is simple value 23. comments are dropped.
+// appends to sb, which may have a sink or an iovec list. returns the sink's error, if any.
+int json_cbor_encode(struct json_string_buffer* sb, struct json_value* v);
+// decodes one item. returns 0 or a json_error, and the bytes consumed in *used if it isn't NULL.
+//   byte strings become strings, tags are ignored, integers beyond int64_t become doubles.
+//   text is not checked for valid utf-8.
+int json_cbor_decode(char* buf, size_t len, struct json_value** out, size_t* used);
+
+
+#ifndef _WIN32
+// a parsed tree saved as a file that can be mmap'd and used with no parsing
+JSON_TYPEDEF struct json_image {
+	struct json_value* root; // read-only. don't json_free or modify anything in it.
+	void* addr;
+	size_t size;
+} JSON_TD(json_image_t);
+
+// base is the address json_map_image tries to map the file at; NULL for the default.
+//   images that have to be mapped together need their own ranges. returns 0 on success.
+//   lazy numbers are decoded and saved without their source text. containers are
+//   saved with their json_hash, so hashing and comparing never write to the mapping.
+int json_save_image(char* path, struct json_value* root, void* base);
+// mapped at its base, the image is shared read-only with every other process using it
+//   and nothing is touched until it is read. otherwise a private copy is relocated.
+//   only map images you wrote; they're trusted as they are. returns 0 on success.
+int json_map_image(char* path, struct json_image* img);
+void json_unmap_image(struct json_image* img);
+#endif
+
 
 
 